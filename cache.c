@@ -0,0 +1,1049 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Generate the cache key (unresolved vhost & selector) for a request
+ */
+void cache_key(state *st)
+{
+	/* A cut key could match another request - leave those uncached */
+	if (snprintf(st->req_key, sizeof(st->req_key), "%s%s", st->server_host, st->req_selector) >= (int) sizeof(st->req_key))
+		strclear(st->req_key);
+}
+
+
+/*
+ * (Re)build the shared index of virtual host directories
+ */
+#ifdef HAVE_SHMEM
+void vhost_index(state *st, shm_state *shm, time_t mtime)
+{
+	DIR *dp;
+	struct dirent *dir;
+	int i;
+
+	if (st->debug) syslog(LOG_INFO, "indexing virtual hosts under \"%s\"", st->server_root);
+
+	/* Hide the table from others while it's being built */
+	shm->vhost_count = 0;
+	if ((dp = opendir(st->server_root)) == NULL) return;
+
+	for (i = 0; (dir = readdir(dp));) {
+
+		/* Skip .hidden dirs and . & .. */
+		if (dir->d_name[0] == '.') continue;
+
+		/* Special case - skip lost+found (don't ask) */
+		if (sstrncmp(dir->d_name, "lost+found") == MATCH) continue;
+
+		/* Too many vhosts - fall back to scanning the root */
+		if (i == SHM_VHOSTS || strlen(dir->d_name) >= sizeof(shm->vhost[0])) {
+			i = ERROR;
+			break;
+		}
+
+		sstrlcpy(shm->vhost[i], dir->d_name);
+		i++;
+	}
+	closedir(dp);
+
+	/* Publish the new table & invalidate cached lookups */
+	shm->vhost_count = i;
+	shm->vhost_generation++;
+	shm->vhost_mtime = mtime;
+}
+#endif
+
+
+/*
+ * Return a pointer to the cache slot for a selector
+ */
+#ifdef HAVE_SHMEM
+shm_vhost_cache *vhost_cache_slot(shm_state *shm, char *selector, unsigned long hash)
+{
+	shm_vhost_cache *slot;
+	shm_vhost_cache *oldest;
+	int i;
+
+	oldest = NULL;
+
+	for (i = 0; i < CACHE_PROBES; i++) {
+		slot = &shm->vhost_cache[(hash + i) % SHM_VHOST_CACHE];
+
+		/* Cached entry or a free (outdated) slot */
+		if (slot->generation != shm->vhost_generation) return slot;
+		if (slot->hash == hash && strcmp(slot->selector, selector) == MATCH) return slot;
+
+		/* Remember the oldest slot for replacing */
+		if (!oldest || slot->ctime < oldest->ctime) oldest = slot;
+	}
+
+	return oldest;
+}
+#endif
+
+
+/*
+ * Find the vhost of a selector not found under the current vhost
+ * Returns OK when found, ERROR when in no vhost, QUIT when unsure
+ */
+#ifdef HAVE_SHMEM
+int vhost_lookup(state *st, shm_state *shm)
+{
+	shm_vhost_cache *slot;
+	struct stat file;
+	char vhost[64];
+	unsigned long hash;
+	time_t now;
+	long generation;
+	int i;
+
+	/* Root directory changes mean vhosts were added or removed */
+	if (stat(st->server_root, &file) == ERROR) return QUIT;
+	if (file.st_mtime != shm->vhost_mtime) vhost_index(st, shm, file.st_mtime);
+	if (shm->vhost_count == ERROR) return QUIT;
+
+	/* Too long selectors aren't cached */
+	if (strlen(st->req_selector) >= sizeof(slot->selector)) return QUIT;
+
+	hash = strhash(st->req_selector);
+	generation = shm->vhost_generation;
+	now = time(NULL);
+
+	/* Check the cache first */
+	slot = vhost_cache_slot(shm, st->req_selector, hash);
+
+	if (slot->generation == generation && slot->hash == hash &&
+	    strcmp(slot->selector, st->req_selector) == MATCH) {
+
+		/* Cached "not found anywhere" */
+		if (slot->vhost == ERROR && (now - slot->ctime) < VHOST_CACHE_TTL) return ERROR;
+
+		/* Cached vhost - make sure the resource is still there */
+		if (slot->vhost >= 0 && slot->vhost < shm->vhost_count) {
+			sstrlcpy(vhost, shm->vhost[slot->vhost]);
+			snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
+				st->server_root, vhost, st->req_selector);
+
+			if (stat(st->req_realpath, &file) == OK) {
+				sstrlcpy(st->server_host, vhost);
+				return OK;
+			}
+		}
+	}
+
+	/* Loop through the indexed vhosts (skipping the current one) */
+	for (i = 0; i < shm->vhost_count; i++) {
+		sstrlcpy(vhost, shm->vhost[i]);
+		if (strcmp(vhost, st->server_host) == MATCH) continue;
+
+		snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
+			st->server_root, vhost, st->req_selector);
+		if (stat(st->req_realpath, &file) == OK) break;
+	}
+
+	/* Cache the result */
+	slot->generation = generation;
+	slot->hash = hash;
+	slot->ctime = now;
+	slot->vhost = (i < shm->vhost_count) ? i : ERROR;
+	sstrlcpy(slot->selector, st->req_selector);
+
+	if (slot->vhost == ERROR) return ERROR;
+
+	/* Virtual host found */
+	sstrlcpy(st->server_host, vhost);
+	return OK;
+}
+#endif
+
+
+/*
+ * Return the number of valid entries in the vhost cache
+ */
+#ifdef HAVE_SHMEM
+int vhost_cache_used(shm_state *shm)
+{
+	int used;
+	int i;
+
+	for (used = i = 0; i < SHM_VHOST_CACHE; i++)
+		if (shm->vhost_cache[i].generation == shm->vhost_generation) used++;
+
+	return used;
+}
+#endif
+
+
+/*
+ * (Re)build the shared index of users with ~/public_gopher
+ */
+#if defined(HAVE_SHMEM) && defined(HAVE_PASSWD)
+void user_index(state *st, shm_state *shm, time_t mtime)
+{
+	struct passwd *pwd;
+	struct stat dir;
+	char buf[BUFSIZE];
+	shm_user *user;
+	pid_t builder;
+	int i;
+
+	/* One process rebuilds (unless it died doing so), the others use getpwnam() */
+	builder = shm->user_builder;
+	if (builder && (kill(builder, 0) == OK || errno == EPERM)) return;
+	if (!__sync_bool_compare_and_swap(&shm->user_builder, builder, getpid())) return;
+
+	if (st->debug) syslog(LOG_INFO, "indexing ~userdirs from the passwd database");
+
+	/* The index is fresh for this passwd from now on, even if it never fills */
+	shm->user_count = ERROR;
+	shm->user_mtime = mtime;
+	shm->user_time = time(NULL);
+	sstrlcpy(shm->user_dir, st->user_dir);
+
+	setpwent();
+	for (i = 0; (pwd = getpwent());) {
+
+		/* Skip too small uids */
+		if (pwd->pw_uid < PASSWD_MIN_UID) continue;
+
+		/* Look for a world-readable user-owned ~/public_gopher */
+		snprintf(buf, sizeof(buf), "%s/%s", pwd->pw_dir, st->user_dir);
+		if (stat(buf, &dir) == ERROR) continue;
+		if ((dir.st_mode & S_IROTH) == 0) continue;
+		if (dir.st_uid != pwd->pw_uid) continue;
+
+		/* Too many users or too long names - use getpwnam() until passwd changes */
+		if (i == SHM_USERS ||
+		    strlen(pwd->pw_name) >= sizeof(user->name) ||
+		    strlen(pwd->pw_dir) >= sizeof(user->dir)) {
+			i = ERROR;
+			break;
+		}
+
+		user = &shm->user[i++];
+		user->mtime = dir.st_mtime;
+		user->uid = pwd->pw_uid;
+		sstrlcpy(user->name, pwd->pw_name);
+		sstrlcpy(user->gecos, pwd->pw_gecos);
+		sstrlcpy(user->dir, pwd->pw_dir);
+	}
+	endpwent();
+
+	/* Publish the new index */
+	shm->user_count = i;
+	__sync_synchronize();
+	shm->user_builder = 0;
+}
+#endif
+
+
+/*
+ * Make sure the userdir index is fresh - returns TRUE if it's usable
+ */
+#if defined(HAVE_SHMEM) && defined(HAVE_PASSWD)
+int user_index_ok(state *st, shm_state *shm)
+{
+	struct stat file;
+	time_t now;
+
+	if (!st->opt_cache) return FALSE;
+
+	/* Refresh on passwd changes, -u changes or after a timeout */
+	now = time(NULL);
+	if (stat(PASSWD_FILE, &file) == ERROR) file.st_mtime = 0;
+
+	if (file.st_mtime != shm->user_mtime ||
+	    (now - shm->user_time) >= USER_INDEX_TTL ||
+	    strcmp(shm->user_dir, st->user_dir) != MATCH)
+		user_index(st, shm, file.st_mtime);
+
+	return (shm->user_count != ERROR);
+}
+#endif
+
+
+/*
+ * Return an indexed user as a struct passwd (valid until the next call)
+ */
+#if defined(HAVE_SHMEM) && defined(HAVE_PASSWD)
+struct passwd *user_entry(shm_state *shm, int i)
+{
+	static struct passwd pwd;
+	static shm_user user;
+
+	/* Copy the entry so that the index can change underneath */
+	memcpy(&user, &shm->user[i], sizeof(user));
+	user.name[sizeof(user.name) - 1] = '\0';
+	user.gecos[sizeof(user.gecos) - 1] = '\0';
+	user.dir[sizeof(user.dir) - 1] = '\0';
+
+	memset(&pwd, 0, sizeof(pwd));
+	pwd.pw_name = user.name;
+	pwd.pw_gecos = user.gecos;
+	pwd.pw_dir = user.dir;
+	pwd.pw_uid = user.uid;
+	pwd.pw_passwd = EMPTY;
+	pwd.pw_shell = EMPTY;
+
+	return &pwd;
+}
+#endif
+
+
+/*
+ * getpwnam() using the userdir index when possible
+ */
+#ifdef HAVE_PASSWD
+struct passwd *user_getpwnam(state *st, char *name)
+{
+#ifdef HAVE_SHMEM
+	shm_state *shm = st->shm;
+	int i;
+
+	if (shm && user_index_ok(st, shm)) {
+		for (i = 0; i < shm->user_count; i++)
+			if (strcmp(shm->user[i].name, name) == MATCH) return user_entry(shm, i);
+
+		return NULL;
+	}
+#endif
+	return getpwnam(name);
+}
+#endif
+
+
+/*
+ * Return a pointer to the negative cache slot for a key
+ */
+#ifdef HAVE_SHMEM
+shm_notfound *notfound_slot(shm_state *shm, char *key, unsigned long hash)
+{
+	shm_notfound *slot;
+	shm_notfound *oldest;
+	int i;
+
+	oldest = NULL;
+
+	for (i = 0; i < CACHE_PROBES; i++) {
+		slot = &shm->notfound[(hash + i) % SHM_NOTFOUND];
+
+		/* Cached entry or a free slot */
+		if (slot->hash == hash && strcmp(slot->key, key) == MATCH) return slot;
+		if (slot->ctime == 0) return slot;
+
+		/* Remember the oldest slot for replacing */
+		if (!oldest || slot->ctime < oldest->ctime) oldest = slot;
+	}
+
+	return oldest;
+}
+#endif
+
+
+/*
+ * Check whether a selector was recently found not to exist
+ */
+#ifdef HAVE_SHMEM
+int notfound_lookup(state *st, shm_state *shm)
+{
+	shm_notfound *slot;
+	struct stat file;
+	unsigned long hash;
+
+	/* Too long keys aren't cached */
+	if (!*st->req_key || strlen(st->req_key) >= sizeof(slot->key)) return FALSE;
+
+	hash = strhash(st->req_key);
+	slot = notfound_slot(shm, st->req_key, hash);
+
+	if (slot->hash != hash || strcmp(slot->key, st->req_key) != MATCH) return FALSE;
+	if ((time(NULL) - slot->ctime) >= NOTFOUND_TTL) return FALSE;
+
+	/* Anything created in the parent dir invalidates the entry */
+	if (!watch_valid(shm, slot->watch_epoch, slot->watch_dir, slot->watch_self, slot->watch_stamp)) {
+
+		/* A change in the second the entry was made wouldn't show */
+		if (slot->mtime >= slot->ctime) return FALSE;
+
+		if (stat(slot->parent, &file) == ERROR) file.st_mtime = 0;
+		if (file.st_mtime != slot->mtime) return FALSE;
+	}
+
+	shm->notfound_hits++;
+	return TRUE;
+}
+#endif
+
+
+/*
+ * Remember that the requested selector doesn't exist
+ */
+#ifdef HAVE_SHMEM
+void notfound_add(state *st, shm_state *shm)
+{
+	shm_notfound *slot;
+	struct stat file;
+	char parent[BUFSIZE];
+	unsigned long hash;
+	char *c;
+	int en = errno;
+
+	if (!*st->req_key || strlen(st->req_key) >= sizeof(slot->key)) return;
+
+	/* Figure out the parent dir of the missing resource (under the vhost it'd be created in) */
+	if (st->opt_vhost && strcmp(st->req_root, st->server_root) == MATCH) {
+		if (snprintf(parent, sizeof(parent), "%s/%s%s", st->server_root,
+		    st->server_host, st->req_selector) >= (int) sizeof(parent)) return;
+	}
+	else sstrlcpy(parent, st->req_realpath);
+	if ((c = strrchr(parent, '/'))) *c = '\0';
+	if (!*parent || strlen(parent) >= sizeof(slot->parent)) return;
+
+	if (stat(parent, &file) == ERROR) file.st_mtime = 0;
+
+	hash = strhash(st->req_key);
+	slot = notfound_slot(shm, st->req_key, hash);
+
+	/* Invalidate the slot while it's being updated */
+	slot->ctime = 0;
+	slot->watch_epoch = 0;
+	if (file.st_mtime) slot->watch_epoch = watch_snapshot(shm, parent, &file,
+		&slot->watch_dir, &slot->watch_self, &slot->watch_stamp);
+
+	slot->hash = hash;
+	slot->mtime = file.st_mtime;
+	sstrlcpy(slot->key, st->req_key);
+	sstrlcpy(slot->parent, parent);
+	slot->ctime = time(NULL);
+
+	/* die() reports the original error */
+	errno = en;
+}
+#endif
+
+
+/*
+ * Return the number of valid entries in the negative cache
+ */
+#ifdef HAVE_SHMEM
+int notfound_used(shm_state *shm)
+{
+	time_t now;
+	int used;
+	int i;
+
+	now = time(NULL);
+
+	for (used = i = 0; i < SHM_NOTFOUND; i++)
+		if (shm->notfound[i].ctime && (now - shm->notfound[i].ctime) < NOTFOUND_TTL) used++;
+
+	return used;
+}
+#endif
+
+
+/*
+ * Return a pointer to the memo slot for a key
+ */
+#ifdef HAVE_SHMEM
+shm_memo *memo_slot(shm_state *shm, char *key, unsigned long hash)
+{
+	shm_memo *slot;
+	shm_memo *oldest;
+	int i;
+
+	oldest = NULL;
+
+	for (i = 0; i < CACHE_PROBES; i++) {
+		slot = &shm->memo[(hash + i) % SHM_MEMO];
+
+		/* Cached entry or a free slot */
+		if (slot->hash == hash && strcmp(slot->key, key) == MATCH) return slot;
+		if (slot->ctime == 0) return slot;
+
+		/* Remember the oldest slot for replacing */
+		if (!oldest || slot->ctime < oldest->ctime) oldest = slot;
+	}
+
+	return oldest;
+}
+#endif
+
+
+/*
+ * Look up a memoized selector resolution - returns TRUE if still valid
+ */
+#ifdef HAVE_SHMEM
+int memo_lookup(state *st, shm_state *shm, struct stat *file)
+{
+	shm_memo memo;
+	shm_memo *slot;
+	unsigned long hash;
+
+	if (!*st->req_key || strlen(st->req_key) >= sizeof(slot->key)) return FALSE;
+
+	hash = strhash(st->req_key);
+	slot = memo_slot(shm, st->req_key, hash);
+
+	/* Copy the entry so that it can't change underneath */
+	memcpy(&memo, slot, sizeof(memo));
+	memo.key[sizeof(memo.key) - 1] = '\0';
+	memo.realpath[sizeof(memo.realpath) - 1] = '\0';
+	memo.selector[sizeof(memo.selector) - 1] = '\0';
+	memo.host[sizeof(memo.host) - 1] = '\0';
+
+	if (memo.hash != hash || strcmp(memo.key, st->req_key) != MATCH) return FALSE;
+	if ((time(NULL) - memo.ctime) >= MEMO_TTL) return FALSE;
+
+	/* Nothing changed according to the watcher? */
+	if (watch_valid(shm, memo.watch_epoch, memo.watch_dir, memo.watch_self, memo.watch_stamp)) {
+		memset(file, 0, sizeof(struct stat));
+		file->st_ino = memo.ino;
+		file->st_dev = memo.dev;
+		file->st_mode = memo.mode;
+		file->st_size = memo.size;
+		file->st_mtime = memo.mtime;
+		file->st_ctime = memo.file_ctime;
+	}
+
+	/* Same inode with no changes to content, mode or owner? */
+	else {
+		if (stat(memo.realpath, file) == ERROR) return FALSE;
+		if (file->st_ino != memo.ino || file->st_dev != memo.dev ||
+		    file->st_mode != memo.mode || file->st_size != memo.size ||
+		    file->st_mtime != memo.mtime || file->st_ctime != memo.file_ctime) return FALSE;
+	}
+
+	/* Restore the resolved request */
+	sstrlcpy(st->req_realpath, memo.realpath);
+	sstrlcpy(st->req_selector, memo.selector);
+	sstrlcpy(st->server_host, memo.host);
+	st->req_filetype = memo.filetype;
+	st->req_filesize = memo.size;
+
+	shm->memo_hits++;
+	return TRUE;
+}
+#endif
+
+
+/*
+ * Memoize the resolution of a request that passed all checks
+ */
+#ifdef HAVE_SHMEM
+void memo_add(state *st, shm_state *shm, struct stat *file)
+{
+	shm_memo *slot;
+	unsigned long hash;
+
+	if (!*st->req_key || strlen(st->req_key) >= sizeof(slot->key)) return;
+	if (strlen(st->req_realpath) >= sizeof(slot->realpath)) return;
+	if (strlen(st->req_selector) >= sizeof(slot->selector)) return;
+	if (strlen(st->server_host) >= sizeof(slot->host)) return;
+
+	hash = strhash(st->req_key);
+	slot = memo_slot(shm, st->req_key, hash);
+
+	/* Invalidate the slot while it's being updated */
+	slot->ctime = 0;
+	slot->watch_epoch = watch_snapshot(shm, st->req_realpath, file,
+		&slot->watch_dir, &slot->watch_self, &slot->watch_stamp);
+	slot->hash = hash;
+	slot->ino = file->st_ino;
+	slot->dev = file->st_dev;
+	slot->mode = file->st_mode;
+	slot->size = file->st_size;
+	slot->mtime = file->st_mtime;
+	slot->file_ctime = file->st_ctime;
+	slot->filetype = st->req_filetype;
+	sstrlcpy(slot->key, st->req_key);
+	sstrlcpy(slot->realpath, st->req_realpath);
+	sstrlcpy(slot->selector, st->req_selector);
+	sstrlcpy(slot->host, st->server_host);
+	slot->ctime = time(NULL);
+}
+#endif
+
+
+/*
+ * Tell whether memoizing the request would push out a live entry
+ */
+#ifdef HAVE_SHMEM
+int memo_evicts(state *st, shm_state *shm)
+{
+	shm_memo *slot;
+	unsigned long hash;
+
+	if (!*st->req_key) return FALSE;
+
+	hash = strhash(st->req_key);
+	slot = memo_slot(shm, st->req_key, hash);
+
+	if (!slot->ctime || (time(NULL) - slot->ctime) >= MEMO_TTL) return FALSE;
+	return (slot->hash != hash || strcmp(slot->key, st->req_key) != MATCH);
+}
+#endif
+
+
+/*
+ * Return the number of valid entries in the memo
+ */
+#ifdef HAVE_SHMEM
+int memo_used(shm_state *shm)
+{
+	time_t now;
+	int used;
+	int i;
+
+	now = time(NULL);
+
+	for (used = i = 0; i < SHM_MEMO; i++)
+		if (shm->memo[i].ctime && (now - shm->memo[i].ctime) < MEMO_TTL) used++;
+
+	return used;
+}
+#endif
+
+
+/*
+ * Generate the cache file name of a compiled gophermap
+ */
+void map_cache_file(state *st, char *mapfile, char *out, size_t outsize)
+{
+	snprintf(out, outsize, "%s/%08lx.map", st->cache_dir, strhash(mapfile));
+}
+
+
+/*
+ * Map a compiled gophermap from the cache, return ERROR if missing or stale
+ */
+int map_load(state *st, char *mapfile, struct stat *file, smap *map)
+{
+	smaphead *head;
+	smapdep *dep;
+	smaprec *rec;
+	struct stat s;
+	char buf[BUFSIZE];
+	char *end;
+	char *c;
+	int fd;
+	int i;
+
+	/* Open & map the cache file */
+	map_cache_file(st, mapfile, buf, sizeof(buf));
+	if ((fd = open(buf, O_RDONLY)) == ERROR) return ERROR;
+
+	if (fstat(fd, &s) == ERROR || s.st_size < (off_t) sizeof(smaphead)) {
+		close(fd);
+		return ERROR;
+	}
+
+	memset(map, 0, sizeof(smap));
+	map->size = s.st_size;
+
+#ifdef HAVE_MMAP
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map->data == MAP_FAILED) {
+		map->data = NULL;
+		return ERROR;
+	}
+	map->mapped = TRUE;
+#else
+	if (!(map->data = malloc(map->size))) {
+		close(fd);
+		return ERROR;
+	}
+	i = read(fd, map->data, map->size);
+	close(fd);
+
+	if (i != (int) map->size) {
+		map_free(map);
+		return ERROR;
+	}
+#endif
+
+	/* Sanity check the header */
+	head = (smaphead *) map->data;
+	if (memcmp(head->magic, MAP_MAGIC, sizeof(head->magic)) != MATCH ||
+	    sizeof(smaphead) + head->deps + head->ops != map->size) {
+		map_free(map);
+		return ERROR;
+	}
+
+	/* Every file the map was compiled from must be unchanged */
+	c = map->data + sizeof(smaphead);
+	end = c + head->deps;
+
+	for (i = 0; c < end; c += dep->len, i++) {
+		dep = (smapdep *) c;
+		if (dep->len <= (int) sizeof(smapdep) || dep->len > end - c) break;
+
+		/* First one is the map itself (the cache file name is a hash) */
+		if (i == 0) {
+			if (strcmp((char *) (dep + 1), mapfile) != MATCH) break;
+			s = *file;
+		}
+		else if (stat((char *) (dep + 1), &s) == ERROR) break;
+
+		if (s.st_mtime != dep->mtime || s.st_ctime != dep->ctime ||
+		    s.st_size != dep->size || s.st_ino != dep->ino ||
+		    s.st_dev != dep->dev) break;
+	}
+
+	if (i == 0 || c != end) {
+		map_free(map);
+		return ERROR;
+	}
+
+	/* Make sure walking the instructions stays inside the map */
+	map->start = sizeof(smaphead) + head->deps;
+	end = map->data + map->size;
+
+	for (c = map->data + map->start; c < end; c += rec->len) {
+		rec = (smaprec *) c;
+		if (rec->len <= (int) sizeof(smaprec) || rec->len > end - c ||
+		    c[rec->len - 1] != '\0') break;
+	}
+
+	if (c != end) {
+		map_free(map);
+		return ERROR;
+	}
+
+	return OK;
+}
+
+
+/*
+ * Store a compiled gophermap in the cache (failures are silently ignored)
+ */
+void map_save(state *st, char *mapfile, smap *deps, smap *ops)
+{
+	smaphead head;
+	char buf[BUFSIZE];
+	char tmp[BUFSIZE];
+	int fd;
+
+	/* Write to a temporary file & rename it in place */
+	map_cache_file(st, mapfile, buf, sizeof(buf));
+	if (snprintf(tmp, sizeof(tmp), "%s.%i", buf, (int) getpid()) >= (int) sizeof(tmp)) return;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, CACHE_MODE)) == ERROR) return;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, MAP_MAGIC, sizeof(head.magic));
+	head.deps = deps->size;
+	head.ops = ops->size;
+
+	if (write(fd, &head, sizeof(head)) != (ssize_t) sizeof(head) ||
+	    write(fd, deps->data, deps->size) != (ssize_t) deps->size ||
+	    write(fd, ops->data, ops->size) != (ssize_t) ops->size) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	close(fd);
+	if (rename(tmp, buf) == ERROR) unlink(tmp);
+}
+
+
+/*
+ * Lock a single-flight slot (for a few instructions at a time)
+ */
+#ifdef HAVE_SHMEM
+void flight_lock(shm_flight *slot)
+{
+	pid_t self;
+	pid_t owner;
+	int i;
+
+	self = getpid();
+	for (i = 1;; i++) {
+		if (__sync_bool_compare_and_swap(&slot->lock, 0, self)) return;
+
+		/* A process killed while holding the lock mustn't block us forever */
+		if (i % FLIGHT_SPINS == 0) {
+			owner = slot->lock;
+			if (owner && kill(owner, 0) == ERROR && errno == ESRCH &&
+			    __sync_bool_compare_and_swap(&slot->lock, owner, self)) return;
+		}
+
+		sched_yield();
+	}
+}
+#endif
+
+
+/*
+ * Unlock a single-flight slot
+ */
+#ifdef HAVE_SHMEM
+void flight_unlock(shm_flight *slot)
+{
+	__sync_bool_compare_and_swap(&slot->lock, getpid(), 0);
+}
+#endif
+
+
+/*
+ * Check whether the leader of a single-flight slot is still around
+ */
+#ifdef HAVE_SHMEM
+int flight_alive(shm_flight *slot)
+{
+	return (kill(slot->pid, 0) == OK || errno == EPERM);
+}
+#endif
+
+
+/*
+ * Generate the cache file name of a shared response
+ */
+void flight_file(state *st, int slot, long gen, char *out, size_t outsize)
+{
+	snprintf(out, outsize, "%s/flight.%i.%li", st->cache_dir, slot, gen);
+}
+
+
+/*
+ * Keep a copy of the leader's output for the followers
+ */
+void flight_capture(state *st, const char *buf, size_t size)
+{
+	char *data;
+	size_t max;
+
+	if (!st->flight_ok) return;
+
+	/* Grow the buffer (too big responses aren't shared) */
+	if (st->flight_size + size > st->flight_max) {
+		for (max = st->flight_max ? st->flight_max : BUFSIZE * 16;
+			max < st->flight_size + size; max *= 2);
+		if (max > FLIGHT_MAX) max = FLIGHT_MAX;
+
+		if (max < st->flight_size + size || !(data = realloc(st->flight_buf, max))) {
+			st->flight_ok = FALSE;
+			return;
+		}
+		st->flight_buf = data;
+		st->flight_max = max;
+	}
+
+	memcpy(st->flight_buf + st->flight_size, buf, size);
+	st->flight_size += size;
+}
+
+
+/*
+ * Wait for the leader & send out its response (returns if that fails)
+ */
+#ifdef HAVE_SHMEM
+void flight_follow(state *st, int i, long gen)
+{
+	shm_flight *slot;
+	char buf[BUFSIZE];
+	ssize_t bytes;
+	int waited;
+	int fd;
+
+	slot = &st->shm->flight[i];
+	if (st->debug) syslog(LOG_INFO, "waiting for pid %i to compute \"%s\"", (int) slot->pid, slot->key);
+
+	/* Sleep until the leader is done, dies or takes too long */
+	for (waited = 0; slot->state == FLIGHT_RUNNING && slot->gen == gen; waited += FLIGHT_POLL) {
+		if (waited >= FLIGHT_TIMEOUT) break;
+
+		if (!flight_alive(slot)) {
+			flight_lock(slot);
+			if (slot->state == FLIGHT_RUNNING && slot->gen == gen) slot->state = FLIGHT_FAILED;
+			flight_unlock(slot);
+			break;
+		}
+
+		futex_wait(&slot->state, FLIGHT_RUNNING, FLIGHT_POLL);
+	}
+
+	/* Open the response before letting go of the slot */
+	fd = ERROR;
+	flight_file(st, i, gen, buf, sizeof(buf));
+	if (slot->state == FLIGHT_DONE && slot->gen == gen) fd = open(buf, O_RDONLY);
+
+	/* Last one out cleans up */
+	flight_lock(slot);
+	if (--slot->waiters == 0 && slot->gen == gen && slot->state != FLIGHT_RUNNING) {
+		if (slot->state == FLIGHT_DONE) unlink(buf);
+		slot->state = FLIGHT_IDLE;
+	}
+	flight_unlock(slot);
+
+	if (fd == ERROR) return;
+
+	/* Send the shared response */
+	st->shm->flight_shared++;
+
+	while ((bytes = read(fd, buf, sizeof(buf))) > 0)
+		if (fwrite(buf, bytes, 1, stdout) != 1) break;
+	close(fd);
+
+	finish(st);
+	exit(EXIT_SUCCESS);
+}
+#endif
+
+
+/*
+ * Join or lead the computation of an expensive response (single-flight)
+ */
+#ifdef HAVE_SHMEM
+void flight_begin(state *st)
+{
+#ifdef HAVE_SINK
+	shm_flight *slot;
+	char key[BUFSIZE];
+	unsigned long hash;
+	long gen;
+	int i;
+
+	/* The response needs a place to go */
+	if (!st->opt_share || !st->shm || !st->opt_cache || !*st->cache_dir ||
+	    st->flight_slot != ERROR) return;
+
+	/* Everything that changes the response goes into the key (or no flight) */
+	if (snprintf(key, sizeof(key), "%c%s:%i%s\t%s", st->req_protocol, st->server_host,
+		st->server_port, st->req_selector, st->req_query_string) >= (int) sizeof(slot->key)) return;
+	hash = strhash(key);
+	i = hash % SHM_FLIGHTS;
+	slot = &st->shm->flight[i];
+
+	flight_lock(slot);
+
+	/* Somebody is computing this already (or just did) - wait for it */
+	if (slot->hash == hash && strcmp(slot->key, key) == MATCH &&
+	    ((slot->state == FLIGHT_RUNNING && flight_alive(slot)) || slot->state == FLIGHT_DONE)) {
+		slot->waiters++;
+		gen = slot->gen;
+		flight_unlock(slot);
+
+		flight_follow(st, i, gen);
+		return;
+	}
+
+	/* Lead unless the slot is busy with another response */
+	if (slot->waiters == 0 && !(slot->state == FLIGHT_RUNNING && flight_alive(slot))) {
+		slot->state = FLIGHT_RUNNING;
+		slot->pid = getpid();
+		slot->gen++;
+		slot->hash = hash;
+		sstrlcpy(slot->key, key);
+
+		st->flight_slot = i;
+		st->flight_gen = slot->gen;
+		st->flight_ok = TRUE;
+	}
+
+	flight_unlock(slot);
+#endif
+}
+#endif
+
+
+/*
+ * Stop leading a flight whose response turned out to be per-client
+ */
+#ifdef HAVE_SHMEM
+void flight_abandon(state *st)
+{
+	if (st->flight_slot == ERROR) return;
+
+	/* The followers compute their own */
+	st->flight_ok = FALSE;
+	flight_end(st);
+}
+#endif
+
+
+/*
+ * Hand the leader's response over to the waiting followers
+ */
+#ifdef HAVE_SHMEM
+void flight_end(state *st)
+{
+	shm_flight *slot;
+	char buf[BUFSIZE];
+	char tmp[BUFSIZE];
+	int fd;
+	int ok;
+
+	if (st->flight_slot == ERROR) return;
+	slot = &st->shm->flight[st->flight_slot];
+
+	/* Nobody waiting is the common case */
+	flight_lock(slot);
+	if (slot->gen == st->flight_gen && slot->waiters == 0) slot->state = FLIGHT_IDLE;
+	ok = (slot->gen == st->flight_gen && slot->state == FLIGHT_RUNNING);
+	flight_unlock(slot);
+
+	if (ok) {
+		ok = FALSE;
+
+		/* Store the response where the followers can find it */
+		flight_file(st, st->flight_slot, st->flight_gen, buf, sizeof(buf));
+
+		if (st->flight_ok && snprintf(tmp, sizeof(tmp), "%s.tmp", buf) < (int) sizeof(tmp) &&
+		    (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, CACHE_MODE)) != ERROR) {
+			if (write(fd, st->flight_buf, st->flight_size) == (ssize_t) st->flight_size &&
+			    rename(tmp, buf) == OK) ok = TRUE;
+			close(fd);
+			if (!ok) unlink(tmp);
+		}
+
+		/* Everybody may have given up while we were writing */
+		flight_lock(slot);
+		if (slot->gen == st->flight_gen) {
+			slot->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+
+			if (slot->waiters == 0) {
+				if (ok) unlink(buf);
+				slot->state = FLIGHT_IDLE;
+			}
+		}
+		flight_unlock(slot);
+
+		futex_wake(&slot->state);
+	}
+
+	if (st->flight_buf) free(st->flight_buf);
+	st->flight_buf = NULL;
+	st->flight_slot = ERROR;
+}
+#endif
@@ -27,34 +27,379 @@
 
 
 /*
- * Send a binary file to the client
+ * Write output to the client & count the bytes (stdout sink)
  */
-void send_binary_file(state *st)
+ssize_t sink_write(void *cookie, const char *buf, size_t size)
 {
-	/* Faster sendfile() version */
-#ifdef HAVE_SENDFILE
+	state *st = (state *) cookie;
+
+	/* Single-flight leaders keep a copy for the followers */
+	if (st->flight_slot != ERROR) flight_capture(st, buf, size);
+
+	/* HTTP/1.x clients need headers & framing */
+	if (st->http_version >= HTTP_10) return http_write(st, buf, size);
+
+	return sink_raw(st, buf, size);
+}
+
+
+/*
+ * Can the client socket be written to without going through TLS?
+ */
+int sink_direct(state *st)
+{
+#ifdef HAVE_TLS
+	if (st->tls && !st->tls_ktls) return FALSE;
+#endif
+	return TRUE;
+}
+
+
+/*
+ * Write to the client socket (through TLS unless the kernel does it)
+ */
+ssize_t sink_send(state *st, const char *buf, size_t size)
+{
+#ifdef HAVE_TLS
+	if (!sink_direct(st)) return tls_write(st, buf, size);
+#endif
+	return write(1, buf, size);
+}
+
+
+/*
+ * Write straight to the client & count the bytes
+ */
+size_t sink_raw(state *st, const char *buf, size_t size)
+{
+	ssize_t bytes;
+	size_t done;
+
+	/* Only count what the kernel really accepted */
+	for (done = 0; done < size; done += bytes) {
+		if ((bytes = sink_send(st, buf + done, size - done)) == ERROR) {
+			if (errno == EINTR) { bytes = 0; continue; }
+			break;
+		}
+		st->out_bytes += bytes;
+	}
+
+	if (done < size) st->flight_ok = FALSE;
+	return done;
+}
+
+
+/*
+ * funopen() flavour of sink_write()
+ */
+int sink_funwrite(void *cookie, const char *buf, int size)
+{
+	if (size <= 0) return 0;
+	if (sink_write(cookie, buf, (size_t) size) == 0) return ERROR;
+	return size;
+}
+
+
+/*
+ * Replace stdout with a stream that counts the bytes sent
+ */
+void sink_open(state *st)
+{
+#ifdef HAVE_FOPENCOOKIE
+	cookie_io_functions_t io = { NULL, sink_write, NULL, NULL };
+	FILE *fp;
+
+	if ((fp = fopencookie(st, "w", io))) stdout = fp;
+#endif
+#ifdef HAVE_FUNOPEN
+	FILE *fp;
+
+	if ((fp = funopen(st, NULL, sink_funwrite, NULL, NULL))) stdout = fp;
+#endif
+}
+
+
+/*
+ * Flush & end the response (& the connection unless it's kept alive)
+ */
+void sink_close(state *st)
+{
+	fflush(stdout);
+	http_end(st);
+#ifdef HAVE_TLS
+	tls_close(st);
+#endif
+}
+
+
+/*
+ * Open the requested file (the one resolve_path() checked if there is one)
+ */
+int open_request(state *st)
+{
+	struct stat file;
 	int fd;
-	off_t offset = 0;
 
-	if (st->debug) syslog(LOG_INFO, "outputting binary file \"%s\"", st->req_realpath);
+	if ((fd = st->req_fd) == ERROR) {
+		if ((fd = open(st->req_realpath, O_RDONLY | O_CLOEXEC)) == ERROR) return ERROR;
+	}
+	st->req_fd = ERROR;
 
-	if ((fd = open(st->req_realpath, O_RDONLY)) == ERROR) return;
-	sendfile(1, fd, &offset, st->req_filesize);
-	close(fd);
+	/* A memoized size may be older than the file (the watcher lags) */
+	if (fstat(fd, &file) == OK) st->req_filesize = file.st_size;
+	return fd;
+}
 
-	/* More compatible POSIX fread()/fwrite() version */
-#else
+
+/*
+ * Send a binary file to the client
+ */
+void send_binary_file(state *st)
+{
 	FILE *fp;
 	char buf[BUFSIZE];
 	int bytes;
+	int fd;
 
 	if (st->debug) syslog(LOG_INFO, "outputting binary file \"%s\"", st->req_realpath);
 
-	if ((fp = fopen(st->req_realpath , "r")) == NULL) return;
+	/* Faster sendfile() version (TLS only if the kernel encrypts) */
+#ifdef HAVE_SENDFILE
+	if (sink_direct(st)) {
+		send_file_direct(st);
+		return;
+	}
+#endif
+
+	/* More compatible POSIX fread()/fwrite() version */
+	if ((fd = open_request(st)) == ERROR) return;
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return;
+	}
+	st->http_length = st->req_filesize;
+
 	while ((bytes = fread(buf, 1, sizeof(buf), fp)) > 0)
 		fwrite(buf, bytes, 1, stdout);
 	fclose(fp);
+}
+
+
+/*
+ * Send a binary file with sendfile()
+ */
+#ifdef HAVE_SENDFILE
+void send_file_direct(state *st)
+{
+	int fd;
+
+	if ((fd = open_request(st)) == ERROR) return;
+	send_file_range(st, fd, 0, st->req_filesize);
+	close(fd);
+}
+
+
+/*
+ * Send part of an open file with sendfile()
+ */
+void send_file_range(state *st, int fd, off_t offset, off_t size)
+{
+	ssize_t bytes;
+	off_t end;
+
+	/* sendfile() bypasses stdio (& needs the HTTP header out first) */
+	st->http_length = size;
+	fflush(stdout);
+	http_start(st);
+
+	/* Loop until done, the client went away or the file shrunk */
+	for (end = offset + size; offset < end;) {
+		if ((bytes = sendfile(1, fd, &offset, end - offset)) <= 0) {
+			if (bytes == ERROR && errno == EINTR) continue;
+			break;
+		}
+		st->out_bytes += bytes;
+	}
+}
 #endif
+
+
+/*
+ * Format a number into a tar header field (base-256 if octal won't fit)
+ */
+void tar_number(char *out, size_t len, unsigned long long val)
+{
+	size_t i;
+
+	if (val < (1ULL << (3 * (len - 1)))) {
+		snprintf(out, len, "%0*llo", (int) len - 1, val);
+		return;
+	}
+
+	for (i = len - 1; i > 0; i--) {
+		out[i] = val & 0xff;
+		val >>= 8;
+	}
+	out[0] = (char) 0x80;
+}
+
+
+/*
+ * Build the ustar header block of one file
+ */
+void tar_header(char *block, char *prefix, char *name, struct stat *file)
+{
+	unsigned int sum;
+	int i;
+
+	memset(block, 0, TAR_BLOCK);
+	memcpy(block, name, strlen(name));
+
+	tar_number(block + 100, 8, file->st_mode & 0755);
+	tar_number(block + 108, 8, 0);
+	tar_number(block + 116, 8, 0);
+	tar_number(block + 124, 12, file->st_size);
+	tar_number(block + 136, 12, file->st_mtime);
+	block[156] = '0';
+
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	memcpy(block + 345, prefix, strlen(prefix));
+
+	/* Checksum is calculated with the checksum field full of spaces */
+	memset(block + 148, ' ', 8);
+	for (sum = 0, i = 0; i < TAR_BLOCK; i++) sum += (unsigned char) block[i];
+	snprintf(block + 148, 8, "%06o", sum);
+}
+
+
+/*
+ * Send one file of a tar archive padded to full blocks, return ERROR
+ * if the client went away
+ */
+int tar_body(state *st, int fd, off_t size)
+{
+	char buf[BUFSIZE];
+	off_t offset;
+	ssize_t bytes;
+
+	offset = 0;
+
+	/* Faster sendfile() version (HTTP chunks & userspace TLS have to go through stdio) */
+#ifdef HAVE_SENDFILE
+	fflush(stdout);
+
+	if (!st->http_chunked && sink_direct(st)) {
+		while (offset < size) {
+			if ((bytes = sendfile(1, fd, &offset, size - offset)) <= 0) {
+				if (bytes == ERROR && errno == EINTR) continue;
+				if (bytes == ERROR && errno != EINVAL && errno != ENOSYS) return ERROR;
+				break;
+			}
+			st->out_bytes += bytes;
+		}
+		lseek(fd, offset, SEEK_SET);
+	}
+#endif
+
+	for (; offset < size; offset += bytes) {
+		if ((bytes = read(fd, buf, (size - offset) < (off_t) sizeof(buf) ?
+			(size_t) (size - offset) : sizeof(buf))) <= 0) break;
+		if (fwrite(buf, bytes, 1, stdout) != 1) return ERROR;
+	}
+
+	/* Fill in for a file that shrunk & pad to a full block */
+	memset(buf, 0, sizeof(buf));
+	size += (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+	for (; offset < size; offset += bytes) {
+		bytes = (size - offset) < (off_t) sizeof(buf) ? (size - offset) : (off_t) sizeof(buf);
+		if (fwrite(buf, bytes, 1, stdout) != 1) return ERROR;
+	}
+
+	return OK;
+}
+
+
+/*
+ * Send the files of a directory as a tar archive (/dir/?tar)
+ */
+void send_tar(state *st)
+{
+	sdirent *dir;
+	struct stat file;
+	char block[TAR_BLOCK];
+	char prefix[BUFSIZE];
+	char buf[BUFSIZE];
+	char *c;
+	int num;
+	int dfd;
+	int fd;
+	int i;
+
+	/* Scripts are for running, not for downloading */
+	if (strstr(st->req_realpath, st->cgi_file))
+		die(st, ERR_ACCESS, "Refusing to archive CGI scripts");
+
+	/* Files hidden by the gophermap stay hidden (which a program may decide) */
+	if (snprintf(buf, sizeof(buf), "%s/%s", st->req_realpath, st->map_file) >= (int) sizeof(buf))
+		die(st, ERR_ACCESS, "Refusing to archive a directory whose gophermap path is too long");
+	if (map_hidden(st, buf) == ERROR)
+		die(st, ERR_ACCESS, "Refusing to archive a directory listed by a program");
+
+	/* Files go into a directory named after the selector */
+	sstrlcpy(buf, st->req_selector);
+	while ((c = strrchr(buf, '/')) && !c[1] && c > buf) *c = '\0';
+	if ((c = strrchr(buf, '/'))) c++;
+	else c = buf;
+
+	if (*c) sstrlcpy(prefix, c);
+	else sstrlcpy(prefix, st->server_host);
+	prefix[TAR_PREFIX] = '\0';
+
+	if ((dfd = open(st->req_realpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR)
+		die(st, ERR_NOTFOUND, NULL);
+
+	num = sortdir(st->req_realpath, &dir);
+	http_header(st, TAR_MIME);
+
+	if (st->debug) syslog(LOG_INFO, "outputting directory \"%s\" as tar", st->req_realpath);
+
+	for (i = 0; i < num; i++) {
+
+		/* Same files as in the menu (but no folders or inline maps) */
+		if (!menu_visible(st, &dir[i])) continue;
+		if ((dir[i].mode & S_IFMT) != S_IFREG) continue;
+		if (strstr(dir[i].name, st->map_file) > dir[i].name) continue;
+		if (strlen(dir[i].name) > TAR_NAME) continue;
+
+		/* With -B symlinks could point anywhere */
+		if ((fd = openat(dfd, dir[i].name, O_RDONLY | O_NONBLOCK |
+			(st->opt_beneath ? O_NOFOLLOW : 0))) == ERROR) continue;
+
+		if (fstat(fd, &file) == ERROR || (file.st_mode & S_IFMT) != S_IFREG ||
+		    (file.st_mode & S_IROTH) == 0) {
+			close(fd);
+			continue;
+		}
+
+		/* Header from memory, body straight from the file */
+		tar_header(block, prefix, dir[i].name, &file);
+		if (fwrite(block, TAR_BLOCK, 1, stdout) != 1 ||
+		    tar_body(st, fd, file.st_size) == ERROR) {
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+
+	/* End of archive */
+	memset(block, 0, TAR_BLOCK);
+	fwrite(block, TAR_BLOCK, 1, stdout);
+	fwrite(block, TAR_BLOCK, 1, stdout);
+
+	if (dir) free(dir);
+	close(dfd);
 }
 
 
@@ -67,9 +412,14 @@ void send_text_file(state *st)
 	char in[BUFSIZE];
 	char out[BUFSIZE];
 	int line;
+	int fd;
 
 	if (st->debug) syslog(LOG_INFO, "outputting text file \"%s\"", st->req_realpath);
-	if ((fp = fopen(st->req_realpath , "r")) == NULL) return;
+	if ((fd = open_request(st)) == ERROR) return;
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return;
+	}
 
 	/* Loop through the file line by line */
 	line = 0;
@@ -124,7 +474,6 @@ void url_redirect(state *st)
 			st->req_selector,
 			st->req_remote_addr);
 	}
-	log_combined(st, HTTP_OK);
 
 	/* Output HTML */
 	printf("<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
@@ -137,6 +486,9 @@ void url_redirect(state *st)
 		"<PRE>\n", dest);
 	footer(st);
 	printf("</PRE>\n</BODY>\n</HTML>\n");
+
+	sink_close(st);
+	log_combined(st, HTTP_OK);
 }
 
 
@@ -147,6 +499,7 @@ void url_redirect(state *st)
 void server_status(state *st, shm_state *shm, int shmid)
 {
 	struct shmid_ds shm_ds;
+	shm_state *snap;
 	time_t now;
 	time_t uptime;
 	int sessions;
@@ -159,22 +512,65 @@ void server_status(state *st, shm_state *shm, int shmid)
 			st->server_port,
 			st->req_remote_addr);
 	}
-	log_combined(st, HTTP_OK);
 
 	/* Quit if shared memory isn't initialized yet */
-	if (!shm) return;
+	if (!shm) {
+		log_combined(st, HTTP_OK);
+		return;
+	}
 
 	/* Update counters */
 	shm->hits++;
-	shm->kbytes += 1;
+
+	/* Work on a private snapshot so slow clients don't see moving numbers */
+	if ((snap = malloc(sizeof(shm_state)))) memcpy(snap, shm, sizeof(shm_state));
+	else snap = shm;
 
 	/* Get server uptime */
 	now = time(NULL);
-	uptime = (now - shm->start_time) + 1;
+	uptime = (now - snap->start_time) + 1;
 
 	/* Get shared memory info */
 	shmctl(shmid, IPC_STAT, &shm_ds);
 
+	/* Count active sessions */
+	sessions = 0;
+	for (i = 0; i < SHM_SESSIONS; i++)
+		if ((now - snap->session[i].req_atime) < st->session_timeout) sessions++;
+
+	/* Machine-readable formats */
+	if (strcmp(st->req_query_string, STATUS_PROMETHEUS) == MATCH) {
+		status_prometheus(st, snap, (int) uptime, sessions, (int) shm_ds.shm_nattch);
+	}
+
+	else if (strcmp(st->req_query_string, STATUS_JSON) == MATCH) {
+		status_json(st, snap, (int) uptime, sessions, (int) shm_ds.shm_nattch);
+	}
+
+	/* Apache mod_status style */
+	else status_text(st, snap, (int) uptime, sessions, (int) shm_ds.shm_nattch);
+
+	if (snap != shm) free(snap);
+
+	/* Log & account for the status page itself */
+	sink_close(st);
+	log_combined(st, HTTP_OK);
+	update_shm_bytes(st, shm);
+}
+#endif
+
+
+/*
+ * Print /server-status in Apache mod_status ?auto format
+ */
+#ifdef HAVE_SHMEM
+void status_text(state *st, shm_state *snap, int uptime, int sessions, int busy)
+{
+	time_t now;
+	int i;
+
+	now = time(NULL);
+
 	/* Print statistics */
 	printf("Total Accesses: %li" CRLF
 		"Total kBytes: %li" CRLF
@@ -184,32 +580,54 @@ void server_status(state *st, shm_state *shm, int shmid)
 		"BytesPerReq: %li" CRLF
 		"BusyServers: %i" CRLF
 		"IdleServers: 0" CRLF
-		"CPULoad: %.2f" CRLF,
-			shm->hits,
-			shm->kbytes,
-			(int) uptime,
-			(float) shm->hits / (float) uptime,
-			shm->kbytes * 1024 / (int) uptime,
-			shm->kbytes * 1024 / (shm->hits + 1),
-			(int) shm_ds.shm_nattch,
-			loadavg());
+		"CPULoad: %.2f" CRLF
+		"VhostIndex: %i" CRLF
+		"VhostCache: %i/%i" CRLF
+		"UserIndex: %i" CRLF
+		"NotFoundCache: %i/%i" CRLF
+		"NotFoundHits: %li" CRLF
+		"MemoCache: %i/%i" CRLF
+		"MemoHits: %li" CRLF
+		"WatchedDirs: %i" CRLF
+		"SharedResponses: %li" CRLF,
+			snap->hits,
+			(long) (snap->bytes / 1024),
+			uptime,
+			(float) snap->hits / (float) uptime,
+			(long) (snap->bytes / uptime),
+			(long) (snap->bytes / (snap->hits + 1)),
+			busy,
+			loadavg(),
+			snap->vhost_count,
+			vhost_cache_used(snap), SHM_VHOST_CACHE,
+			snap->user_count,
+			notfound_used(snap), SHM_NOTFOUND,
+			snap->notfound_hits,
+			memo_used(snap), SHM_MEMO,
+			snap->memo_hits,
+			watch_active(snap) ? snap->watch_dirs : 0,
+			snap->flight_shared);
+
+	/* Print request latencies (in microseconds) */
+	latency_status(snap);
+
+	/* Print heavy hitters */
+	sketch_status("TopSelector", &snap->top_selectors);
+	sketch_status("TopClientHits", &snap->top_clients);
+	sketch_status("TopClientBytes", &snap->top_clients_bytes);
 
 	/* Print active sessions */
-	sessions = 0;
-
 	for (i = 0; i < SHM_SESSIONS; i++) {
-		if ((now - shm->session[i].req_atime) < st->session_timeout) {
-			sessions++;
-
+		if ((now - snap->session[i].req_atime) < st->session_timeout) {
 			printf("Session: %-4i %-40s %-4li %-7li gopher://%s:%i/%c%s" CRLF,
-				(int) (now - shm->session[i].req_atime),
-				shm->session[i].req_remote_addr,
-				shm->session[i].hits,
-				shm->session[i].kbytes,
-				shm->session[i].server_host,
-				shm->session[i].server_port,
-				shm->session[i].req_filetype,
-				shm->session[i].req_selector);
+				(int) (now - snap->session[i].req_atime),
+				snap->session[i].req_remote_addr,
+				snap->session[i].hits,
+				(long) (snap->session[i].bytes / 1024),
+				snap->session[i].server_host,
+				snap->session[i].server_port,
+				snap->session[i].req_filetype,
+				snap->session[i].req_selector);
 		}
 	}
 
@@ -230,16 +648,11 @@ void caps_txt(state *st, shm_state *shm)
 			st->server_port,
 			st->req_remote_addr);
 	}
-	log_combined(st, HTTP_OK);
 
 	/* Update counters */
 #ifdef HAVE_SHMEM
 	if (shm) {
 		shm->hits++;
-		shm->kbytes += 1;
-
-		/* Update session data */
-		st->req_filesize += 1024;
 		update_shm_session(st, shm);
 	}
 #endif
@@ -276,6 +689,13 @@ void caps_txt(state *st, shm_state *shm)
 		printf("ServerGeolocationString=%s" CRLF, st->server_location);
 	if (*st->server_admin)
 		printf("ServerAdmin=%s" CRLF, st->server_admin);
+
+	/* Log & account for what was sent */
+	sink_close(st);
+	log_combined(st, HTTP_OK);
+#ifdef HAVE_SHMEM
+	if (shm) update_shm_bytes(st, shm);
+#endif
 }
 
 
@@ -300,7 +720,11 @@ void setenv_cgi(state *st, char *script)
 	snprintf(buf, sizeof(buf), SERVER_SOFTWARE "/" VERSION);
 	setenv("SERVER_VERSION", buf, 1);
 
-	if (st->req_protocol == PROTO_HTTP)
+	if (st->http_version == HTTP_11)
+		setenv("SERVER_PROTOCOL", "HTTP/1.1", 1);
+	else if (st->http_version == HTTP_10)
+		setenv("SERVER_PROTOCOL", "HTTP/1.0", 1);
+	else if (st->req_protocol == PROTO_HTTP)
 		setenv("SERVER_PROTOCOL", "HTTP/0.9", 1);
 	else
 		setenv("SERVER_PROTOCOL", "RFC1436", 1);
@@ -348,14 +772,88 @@ void setenv_cgi(state *st, char *script)
  */
 void run_cgi(state *st, char *script, char *arg)
 {
+	char buf[BUFSIZE];
+	ssize_t bytes;
+	struct stat file;
+	pid_t pid;
+	int status;
+	int fd[2];
+
 	/* Setup environment & execute the binary */
 	if (st->debug) syslog(LOG_INFO, "executing script \"%s\"", script);
 
 	setenv_cgi(st, script);
+	st->req_kind = KIND_CGI;
+
+	/* Concurrent requests may share the output if the sticky bit says it's the same for all */
+#ifdef HAVE_SHMEM
+	if (stat(script, &file) == OK && (file.st_mode & S_ISVTX)) flight_begin(st);
+#endif
+	fflush(stdout);
+
+	/* Pipe the script output through us so it gets counted */
+	if (pipe(fd) == OK) {
+		if ((pid = fork()) == 0) {
+			close(fd[0]);
+			dup2(fd[1], 1);
+			close(fd[1]);
+
+			/* Scripts expect the default SIGPIPE behaviour */
+			signal(SIGPIPE, SIG_DFL);
+			execl(script, script, arg, NULL);
+			_exit(127);	/* Like sh(1) for commands not found */
+		}
+		close(fd[1]);
+
+		/* Couldn't fork() - fall back to exec() */
+		if (pid == ERROR) close(fd[0]);
+
+		/* Copy script output to the client */
+		else {
+			while ((bytes = read(fd[0], buf, sizeof(buf))) != 0) {
+				if (bytes == ERROR) {
+					if (errno == EINTR) continue;
+					break;
+				}
+				if (fwrite(buf, bytes, 1, stdout) != 1) break;
+			}
+			close(fd[0]);
+
+			/* Did the exec() fail? */
+			while (waitpid(pid, &status, 0) == ERROR && errno == EINTR);
+			if (st->out_bytes == 0 && WIFEXITED(status) &&
+			    WEXITSTATUS(status) == 127) {
+				fflush(stdout);
+				if (st->out_bytes == 0) die(st, ERR_INTERNAL, "Couldn't execute script");
+			}
+
+			/* Log, account & quit */
+			finish(st);
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	/* Scripts can't write through userspace TLS */
+	if (!sink_direct(st)) die(st, ERR_INTERNAL, "Couldn't execute script");
+
+	/* We won't be around after exec() so account for the startup only */
+	timer_phase(st, PHASE_SEND);
+	update_shm_stats(st);
+
+	/* Nor can we share the output */
+#ifdef HAVE_SHMEM
+	st->flight_ok = FALSE;
+	flight_end(st);
+#endif
+
+	/* HTTP clients get the raw output on a connection that ends with it */
+	st->http_keepalive = FALSE;
+	http_start(st);
+
 	execl(script, script, arg, NULL);
 
 	/* Didn't work - die */
-	die(st, ERR_ACCESS, NULL);
+	die(st, ERR_INTERNAL, NULL);
 }
 
 
@@ -399,11 +897,20 @@ void gopher_file(state *st)
 			run_cgi(st, buf, st->req_realpath);
 	}
 
+	/* HTTP clients may have the file already */
+	if (st->http_version >= HTTP_10 &&
+	    (st->req_fd != ERROR ? fstat(st->req_fd, &file) : stat(st->req_realpath, &file)) == OK)
+		http_validate(st, &file);
+
 	/* Output regular files */
-	if (st->req_filetype == TYPE_TEXT || st->req_filetype == TYPE_MIME)
+	if (st->req_filetype == TYPE_TEXT || st->req_filetype == TYPE_MIME) {
+		st->req_kind = KIND_TEXT;
 		send_text_file(st);
-	else
+	}
+	else {
+		st->req_kind = KIND_BINARY;
 		send_binary_file(st);
+	}
 }
 
 
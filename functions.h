@@ -4,24 +4,70 @@ void info(state *st, char *str, char type);
 void footer(state *st);
 void die(state *st, char *message, char *description);
 void log_combined(state *st, int status);
+void finish(state *st);
+int vhost_to_path(state *st);
 void selector_to_path(state *st);
+int resolve_path(state *st, struct stat *file);
+void resolve_selector(state *st, struct stat *file);
 char *get_local_address(void);
 char *get_peer_address(void);
 void init_state(state *st);
+ssize_t sink_write(void *cookie, const char *buf, size_t size);
+int sink_direct(state *st);
+ssize_t sink_send(state *st, const char *buf, size_t size);
+size_t sink_raw(state *st, const char *buf, size_t size);
+int sink_funwrite(void *cookie, const char *buf, int size);
+void sink_open(state *st);
+void sink_close(state *st);
+int open_request(state *st);
 void send_binary_file(state *st);
+void send_file_direct(state *st);
+void send_file_range(state *st, int fd, off_t offset, off_t size);
+void tar_number(char *out, size_t len, unsigned long long val);
+void tar_header(char *block, char *prefix, char *name, struct stat *file);
+int tar_body(state *st, int fd, off_t size);
+void send_tar(state *st);
 void send_text_file(state *st);
 void url_redirect(state *st);
 void server_status(state *st, shm_state *shm, int shmid);
+void status_text(state *st, shm_state *snap, int uptime, int sessions, int busy);
 void caps_txt(state *st, shm_state *shm);
 void setenv_cgi(state *st, char *script);
 void run_cgi(state *st, char *script, char *arg);
 void gopher_file(state *st);
 int foldersort(const void *a, const void *b);
-int sortdir(char *path, sdirent *list, int max);
+int direntry(int fd, struct dirent *d, sdirent *entry);
+int loaddir(char *path, sdirent **list);
+int sortdir(char *path, sdirent **list);
+unsigned long long dirkey(sdirent *dir, int order);
+int keysort(const void *a, const void *b);
+int keysort_natural(const void *a, const void *b);
+int radixsort(skey *list, int num);
+void keyradixsort(skey *list, int num, int (*cmp)(const void *, const void *));
+void keyswap(skey *a, skey *b);
+void keyselect(skey *list, int num, int k, int (*cmp)(const void *, const void *));
+void sortrange(skey *list, int num, int first, int last, int (*cmp)(const void *, const void *));
+void menu_option(state *st, char *option);
+void userlist_item(state *st, struct passwd *pwd, time_t mtime);
 void userlist(state *st);
 void vhostlist(state *st);
 char gopher_filetype(state *st, char *file, char magic);
+void *map_alloc(state *st, smap *map, size_t len);
+void map_op(state *st, smap *map, char op, char type, char flags, int port, char *a, char *b, char *c);
+void map_dep(state *st, smap *map, char *path, struct stat *file);
+void map_free(smap *map);
+int map_line(state *st, char *line, smap *ops, smap *deps, int depth, int top);
+void map_compile(state *st, FILE *fp, smap *ops, smap *deps, int depth, int top);
+int map_run(state *st, char *data, size_t size);
+int map_stream(state *st, FILE *fp, int depth);
+int map_get(state *st, char *mapfile, struct stat *file, int depth, smap *ops);
+int map_hidden(state *st, char *mapfile);
 int gophermap(state *st, char *mapfile, int depth);
+int dirtag(state *st, int fd, char *name, char *out, size_t outsize);
+int menu_visible(state *st, sdirent *dir);
+void menu_item(state *st, int fd, sdirent *dir, int width);
+void menu_stream(state *st, int width);
+void menu_pages(state *st, int page, int pages, int exact);
 void gopher_menu(state *st);
 void strrepeat(char *dest, char c, size_t num);
 void strreplace(char *str, char from, char to);
@@ -33,12 +79,161 @@ char *strcharset(int charset);
 void strniconv(int charset, char *out, char *in, size_t outsize);
 void strnencode(char *out, const char *in, size_t outsize);
 void strndecode(char *out, char *in, size_t outsize);
+int strnatcmp(const char *a, const char *b);
+unsigned long strhash(const char *str);
+void strnjson(char *out, const char *in, size_t outsize);
+void strnprom(char *out, const char *in, size_t outsize);
+void strnhtml(char *out, const char *in, size_t outsize);
+void strnurl(char *out, const char *in, size_t outsize);
+void days_to_civil(long days, int *year, int *month, int *day);
+long civil_to_days(int year, int month, int day);
+long tmoffset(struct tm *tm, time_t t);
+int tzoffset(time_t t, long *offset);
+void strfdate(char *out, time_t t, size_t outsize);
+void strflogdate(char *out, size_t outsize);
+void strfhttpdate(char *out, time_t t, size_t outsize);
+time_t strphttpdate(char *str);
 void strfsize(char *out, off_t size, size_t outsize);
 void platform(state *st);
 float loadavg(void);
+long long monotime(void);
+int open_beneath(state *st, int dirfd, char *path, int flags);
+void futex_wait(int *word, int val, int msec);
+void futex_wake(int *word);
 int get_shm_session_id(state *st, shm_state *shm);
 void get_shm_session(state *st, shm_state *shm);
 void update_shm_session(state *st, shm_state *shm);
+void update_shm_bytes(state *st, shm_state *shm);
 void add_ftype_mapping(state *st, char *suffix);
-void add_rewrite_mapping(state *st, char *match);
 void parse_args(state *st, int argc, char *argv[]);
+void timer_phase(state *st, int phase);
+int hist_bucket(long usecs);
+long hist_value(int bucket);
+long hist_percentile(shm_histogram *hist, int permille);
+void update_shm_stats(state *st);
+void latency_status(shm_state *shm);
+void sketch_update(shm_sketch *sketch, char *key, long weight);
+int hittersort(const void *a, const void *b);
+int sketch_sort(shm_sketch *sketch, shm_hitter *list);
+void update_shm_hitters(state *st, shm_state *shm);
+void sketch_status(char *name, shm_sketch *sketch);
+void sketch_json(char *name, shm_sketch *sketch);
+void prom_metric(char *name, char *type, char *help);
+void sketch_prometheus(char *name, char *label, char *help, shm_sketch *sketch);
+void status_prometheus(state *st, shm_state *snap, int uptime, int sessions, int busy);
+void status_json(state *st, shm_state *snap, int uptime, int sessions, int busy);
+void cache_key(state *st);
+void vhost_index(state *st, shm_state *shm, time_t mtime);
+shm_vhost_cache *vhost_cache_slot(shm_state *shm, char *selector, unsigned long hash);
+int vhost_lookup(state *st, shm_state *shm);
+int vhost_cache_used(shm_state *shm);
+void user_index(state *st, shm_state *shm, time_t mtime);
+int user_index_ok(state *st, shm_state *shm);
+struct passwd *user_entry(shm_state *shm, int i);
+struct passwd *user_getpwnam(state *st, char *name);
+shm_notfound *notfound_slot(shm_state *shm, char *key, unsigned long hash);
+int notfound_lookup(state *st, shm_state *shm);
+void notfound_add(state *st, shm_state *shm);
+int notfound_used(shm_state *shm);
+shm_memo *memo_slot(shm_state *shm, char *key, unsigned long hash);
+int memo_lookup(state *st, shm_state *shm, struct stat *file);
+void memo_add(state *st, shm_state *shm, struct stat *file);
+int memo_evicts(state *st, shm_state *shm);
+int memo_used(shm_state *shm);
+void map_cache_file(state *st, char *mapfile, char *out, size_t outsize);
+int map_load(state *st, char *mapfile, struct stat *file, smap *map);
+void map_save(state *st, char *mapfile, smap *deps, smap *ops);
+void flight_lock(shm_flight *slot);
+void flight_unlock(shm_flight *slot);
+int flight_alive(shm_flight *slot);
+void flight_file(state *st, int slot, long gen, char *out, size_t outsize);
+void flight_capture(state *st, const char *buf, size_t size);
+void flight_follow(state *st, int i, long gen);
+void flight_begin(state *st);
+void flight_abandon(state *st);
+void flight_end(state *st);
+int rewrite_node(state *st, int parent, char c);
+void add_rewrite_mapping(state *st, char *match);
+void load_rewrite_file(state *st, char *file);
+void rewrite_expand(char *out, size_t outsize, char *replace, char *in, regmatch_t *match);
+void rewrite_selector(state *st);
+void http_hostname(state *st, char *host);
+void http_request(state *st, char *selector, size_t size);
+void http_serve(state *st, char *selector, size_t size);
+void http_header(state *st, char *mimetype);
+void http_mimetype(state *st, char *out, size_t outsize);
+int http_writev(state *st, struct iovec *iov, int count);
+size_t http_body(state *st, const char *buf, size_t size);
+void http_start(state *st);
+size_t html_line(state *st, char *line, char *out, size_t outsize);
+ssize_t http_write(state *st, const char *buf, size_t size);
+void http_validate(state *st, struct stat *file);
+void http_end(state *st);
+ssize_t tls_read(void *cookie, char *buf, size_t size);
+int tls_funread(void *cookie, char *buf, int size);
+ssize_t tls_write(state *st, const void *buf, size_t size);
+int tls_writev(state *st, struct iovec *iov, int count);
+void tls_tickets(state *st, SSL_CTX *ctx);
+void tls_open(state *st);
+void tls_close(state *st);
+void add_proxy(state *st, char *mapping);
+int proxy_match(state *st);
+int proxy_connect(sproxy *proxy);
+void proxy_line(state *st, sproxy *proxy, char *line);
+int proxy_send(state *st, sproxy *proxy, char type, FILE *in, FILE *save);
+void proxy_cache_file(state *st, sproxy *proxy, char type, char *selector, char *key, size_t keysize, char *out, size_t outsize);
+void proxy_cached(state *st, sproxy *proxy, char type, FILE *fp, char *path, struct stat *file);
+int proxysort(const void *a, const void *b);
+void proxy_evict(state *st);
+void proxy_stored(state *st, off_t size);
+void proxy_request(state *st, int i);
+unsigned int search_string(state *st, sindex *idx, const char *str);
+sidxbuild *search_slot(sindex *idx, const char *word);
+void search_add(state *st, sindex *idx, const char *word, int doc, int count);
+void search_text(state *st, sindex *idx, int doc, const char *text, size_t len);
+void search_map(state *st, sindex *idx, int doc, char *mapfile);
+int search_old(sindex *idx, char *path);
+void search_doc(state *st, sindex *idx, char *path, char *name, sdirent *dir);
+int search_beneath(state *st, char *path);
+void search_walk(state *st, sindex *idx, char *path, int depth);
+int search_open(state *st, char *file, smap *map);
+unsigned int search_varint(unsigned char **c, unsigned char *end);
+size_t search_putvarint(unsigned char *out, unsigned int val);
+int search_wordsort(const void *a, const void *b);
+int search_postsort(const void *a, const void *b);
+int search_write(state *st, sindex *idx, char *file);
+void search_index(state *st);
+int search_find(smap *map, char *word);
+int search_hitsort(const void *a, const void *b);
+void server_search(state *st);
+void pack_write(spackbuild *pack, const void *data, size_t size);
+void pack_add(state *st, spackbuild *pack, size_t selector, char *str, char type, char kind, size_t offset, size_t size);
+char *pack_render(state *st, spackbuild *pack, char *selector, char *path, char type, size_t *size);
+void pack_rendered(state *st, spackbuild *pack, char *selector, char *path, char type, char kind);
+void pack_copy(state *st, spackbuild *pack, char *selector, char *path, char type);
+int pack_dynamic(state *st, char *mapfile);
+int pack_static(state *st, char *realpath, sdirent *dir, int num);
+int pack_filtered(state *st, char *path, char type);
+void pack_walk(state *st, spackbuild *pack, char *selector, int depth);
+void pack_build(state *st);
+spackent *pack_find(char *data, char *selector);
+void pack_request(state *st);
+int watch_active(shm_state *shm);
+int watch_bucket(char *path);
+long watch_stamp(shm_state *shm, int dir, int self);
+int watch_valid(shm_state *shm, long epoch, int dir, int self, long stamp);
+long watch_snapshot(shm_state *shm, char *path, struct stat *file, int *dir, int *self, long *stamp);
+int watch_add(swatch *w, char *path, int depth);
+int watch_tree(swatch *w, char *root);
+int watch_event(shm_state *shm, swatch *w, struct inotify_event *ev);
+void watch_run(state *st, shm_state *shm);
+void warm_priority(state *st);
+void warm_throttle(swarm *warm);
+void warm_queue(swarm *warm, char *selector);
+void warm_menu(state *st, swarm *warm);
+int warm_selector(state *st, swarm *warm, char *host, char *selector);
+void warm_walk(state *st, swarm *warm, char *host);
+void warm_vhosts(state *st, swarm *warm);
+void warm_hitters(state *st, swarm *warm, shm_sketch *sketch);
+void warm_log(char *logfile, shm_sketch *sketch);
+void warm_run(state *st, shm_state *shm);
@@ -105,12 +105,36 @@ void die(state *st, char *message, char *description)
 	/* Handle NULL description */
 	if (description == NULL) description = strerror(en);
 
+	/* Errors get latency statistics of their own */
+	st->req_kind = KIND_ERROR;
+
+	/* Count errors by type */
+#ifdef HAVE_SHMEM
+	if (st->shm) {
+		if (strcmp(message, ERR_NOTFOUND) == MATCH) {
+
+			/* Only log every nth not found to keep floods out of syslog */
+			if ((++st->shm->errors[ERR_TYPE_NOTFOUND] % st->log_sample) != 0)
+				st->opt_syslog = FALSE;
+		}
+		else if (strcmp(message, ERR_ACCESS) == MATCH) st->shm->errors[ERR_TYPE_ACCESS]++;
+		else st->shm->errors[ERR_TYPE_OTHER]++;
+	}
+#endif
+
 	/* Log the error */
 	if (st->opt_syslog) {
 		syslog(LOG_ERR, "error \"%s\" for request \"%s\" from %s",
 			description, st->req_selector, st->req_remote_addr);
 	}
-	log_combined(st, HTTP_404);
+
+	/* HTTP clients get a real status code unless the body has started */
+	if (!st->http_sent) {
+		if (strcmp(message, ERR_NOTFOUND) == MATCH) st->http_status = HTTP_404;
+		else if (strcmp(message, ERR_ACCESS) == MATCH) st->http_status = HTTP_403;
+		else st->http_status = HTTP_500;
+		st->http_length = ERROR;
+	}
 
 	/* Handle menu errors */
 	if (st->req_filetype == TYPE_MENU || st->req_filetype == TYPE_QUERY) {
@@ -120,6 +144,7 @@ void die(state *st, char *message, char *description)
 
 	/* Handle image errors */
 	else if (st->req_filetype == TYPE_GIF || st->req_filetype == TYPE_IMAGE) {
+		http_header(st, "image/gif");
 		fwrite(error_gif, sizeof(error_gif), 1, stdout);
 	}
 
@@ -142,7 +167,15 @@ void die(state *st, char *message, char *description)
 		footer(st);
 	}
 
+	/* Log & account for what we actually sent */
+	sink_close(st);
+	log_combined(st, st->http_status ? st->http_status : HTTP_404);
+#ifdef HAVE_SHMEM
+	if (st->shm) update_shm_bytes(st, st->shm);
+#endif
+
 	/* Quit */
+	update_shm_stats(st);
 	exit(EXIT_FAILURE);
 }
 
@@ -153,18 +186,14 @@ void die(state *st, char *message, char *description)
 void log_combined(state *st, int status)
 {
 	FILE *fp;
-	struct tm *ltime;
 	char timestr[64];
-	time_t now;
 
 	/* Try to open the logfile for appending */
 	if (!*st->log_file) return;
 	if ((fp = fopen(st->log_file , "a")) == NULL) return;
 
 	/* Format time */
-	now = time(NULL);
-	ltime = localtime(&now);
-	strftime(timestr, sizeof(timestr), HTTP_DATE, ltime);
+	strflogdate(timestr, sizeof(timestr));
 
 	/* Generate log entry */
 	fprintf(fp, "%s %s:%i - [%s] \"GET %c%s HTTP/1.0\" %i %li \"%s\" \"" HTTP_USERAGENT "\"\n",
@@ -175,47 +204,106 @@ void log_combined(state *st, int status)
 		st->req_filetype,
 		st->req_selector,
 		status,
-		(long) st->req_filesize,
+		(long) st->out_bytes,
 		st->req_referrer);
 	fclose(fp);
 }
 
 
 /*
- * Convert gopher selector to an absolute path
+ * Log & account for a successfully served request
  */
-void selector_to_path(state *st)
+void finish(state *st)
+{
+	/* Make sure everything has been written */
+	sink_close(st);
+	timer_phase(st, PHASE_SEND);
+
+	/* Let the requests waiting for this response have it */
+#ifdef HAVE_SHMEM
+	flight_end(st);
+#endif
+
+	/* Log the request with the real transfer size */
+	log_combined(st, st->http_status);
+	timer_phase(st, PHASE_LOG);
+
+	/* Update transfer & latency statistics */
+#ifdef HAVE_SHMEM
+	if (st->shm) update_shm_bytes(st, st->shm);
+#endif
+	update_shm_stats(st);
+}
+
+
+/*
+ * Look for the selector under the current & other virtual hosts
+ */
+int vhost_to_path(state *st)
 {
 	DIR *dp;
 	struct dirent *dir;
 	struct stat file;
-#ifdef HAVE_PASSWD
-	struct passwd *pwd;
-	char *path = EMPTY;
-	char *c;
-#endif
-	char buf[BUFSIZE];
 	int i;
 
-	/* Handle selector rewriting */
-	for (i = 0; i < st->rewrite_count; i++) {
+	/* Try looking for the selector from the current vhost */
+	snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
+		st->server_root, st->server_host, st->req_selector);
+	if (stat(st->req_realpath, &file) == OK) return OK;
+
+	/* Look up the selector from the shared vhost index */
+	i = QUIT;
+#ifdef HAVE_SHMEM
+	if (st->shm && st->opt_cache) i = vhost_lookup(st, st->shm);
+#endif
+	if (i == OK) return OK;
+	if (i == ERROR) return ERROR;
 
-		/* Match found? */
-		if (strstr(st->req_selector, st->rewrite[i].match) == st->req_selector) {
+	/* Loop through all vhosts looking for the selector */
+	if ((dp = opendir(st->server_root)) == NULL) return ERROR;
+	while ((dir = readdir(dp))) {
 
-			/* Replace match with a new string */
-			snprintf(buf, sizeof(buf), "%s%s",
-				st->rewrite[i].replace,
-				st->req_selector + strlen(st->rewrite[i].match));
+		/* Skip .hidden dirs and . & .. */
+		if (dir->d_name[0] == '.') continue;
 
-			if (st->debug) {
-				syslog(LOG_INFO, "rewriting selector \"%s\" -> \"%s\"",
-					st->req_selector, buf);
-			}
+		/* Special case - skip lost+found (don't ask) */
+		if (sstrncmp(dir->d_name, "lost+found") == MATCH) continue;
+
+		/* Generate path to the found vhost */
+		snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
+			st->server_root, dir->d_name, st->req_selector);
 
-			sstrlcpy(st->req_selector, buf);
+		/* Did we find the selector under this vhost? */
+		if (stat(st->req_realpath, &file) == OK) {
+
+			/* Virtual host found - update state & return */
+			sstrlcpy(st->server_host, dir->d_name);
+			closedir(dp);
+			return OK;
 		}
 	}
+	closedir(dp);
+
+	/* Not found under any vhost */
+	return ERROR;
+}
+
+
+/*
+ * Convert gopher selector to an absolute path
+ */
+void selector_to_path(state *st)
+{
+	struct stat file;
+#ifdef HAVE_PASSWD
+	struct passwd *pwd;
+	char *path = EMPTY;
+	char *c;
+#endif
+	char buf[BUFSIZE];
+
+	/* Handle selector rewriting */
+	rewrite_selector(st);
 
 #ifdef HAVE_PASSWD
 	/* Virtual userdir (~user -> /home/user/public_gopher)? */
@@ -229,14 +317,17 @@ void selector_to_path(state *st)
 		}
 
 		/* Check user validity */
-		if ((pwd = getpwnam(buf)) == NULL)
+		if ((pwd = user_getpwnam(st, buf)) == NULL)
 			die(st, ERR_NOTFOUND, "User not found");
 		if (pwd->pw_uid < PASSWD_MIN_UID)
 			die(st, ERR_NOTFOUND, "User found but UID too low");
 
 		/* Generate absolute path to users own gopher root */
-		snprintf(st->req_realpath, sizeof(st->req_realpath),
-			"%s/%s/%s", pwd->pw_dir, st->user_dir, path);
+		if (snprintf(st->req_root, sizeof(st->req_root),
+			"%s/%s", pwd->pw_dir, st->user_dir) >= (int) sizeof(st->req_root) ||
+		    snprintf(st->req_realpath, sizeof(st->req_realpath),
+			"%s/%s", st->req_root, path) >= (int) sizeof(st->req_realpath))
+			die(st, ERR_NOTFOUND, "Path too long");
 
 		/* Check ~public_gopher access rights */
 		if (stat(st->req_realpath, &file) == ERROR)
@@ -254,41 +345,111 @@ void selector_to_path(state *st)
 #endif
 
 	/* Virtual hosting */
-	if (st->opt_vhost) {
+	if (st->opt_vhost && vhost_to_path(st) == OK) {
+		snprintf(st->req_root, sizeof(st->req_root), "%s/%s",
+			st->server_root, st->server_host);
+		return;
+	}
 
-		/* Try looking for the selector from the current vhost */
-		snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
-			st->server_root, st->server_host, st->req_selector);
-		if (stat(st->req_realpath, &file) == OK) return;
+	/* Handle normal selectors */
+	sstrlcpy(st->req_root, st->server_root);
+	snprintf(st->req_realpath, sizeof(st->req_realpath),
+		"%s%s", st->server_root, st->req_selector);
+}
+
+
+/*
+ * stat() the resolved path relative to its root directory
+ */
+int resolve_path(state *st, struct stat *file)
+{
+	char *path;
+#ifdef HAVE_OPENAT2
+	int fd;
+	int i;
+#endif
 
-		/* Loop through all vhosts looking for the selector */
-		if ((dp = opendir(st->server_root)) == NULL) die(st, ERR_NOTFOUND, NULL);
-		while ((dir = readdir(dp))) {
+	/* Path to the resource relative to its root */
+	path = st->req_realpath + strlen(st->req_root);
+	while (*path == '/') path++;
+	if (!*path) path = ".";
+
+	/* Keep the root dir open for the rest of the request */
+	if (st->root_fd == ERROR &&
+	    (st->root_fd = open(st->req_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR)
+		return ERROR;
+
+	/* Let the kernel resolve the path (without /proc magic links) */
+#ifdef HAVE_OPENAT2
+	if ((fd = open_beneath(st, st->root_fd, path, O_PATH)) != ERROR) {
+		i = fstat(fd, file);
+		close(fd);
+
+		/* Files are sent from what was checked, not looked up again by name */
+		if (i == OK && (file->st_mode & S_IFMT) == S_IFREG) {
+			if (st->req_fd != ERROR) close(st->req_fd);
+			st->req_fd = open_beneath(st, st->root_fd, path, O_RDONLY | O_NONBLOCK);
+		}
+		return i;
+	}
+	if (errno != ENOSYS) return ERROR;
+#endif
+	return fstatat(st->root_fd, path, file, 0);
+}
 
-			/* Skip .hidden dirs and . & .. */
-			if (dir->d_name[0] == '.') continue;
 
-			/* Special case - skip lost+found (don't ask) */
-			if (sstrncmp(dir->d_name, "lost+found") == MATCH) continue;
+/*
+ * Resolve the selector to a path, stat() it & check access rights
+ */
+void resolve_selector(state *st, struct stat *file)
+{
+	/* Convert seletor to path & stat() */
+	selector_to_path(st);
+	if (st->debug) syslog(LOG_INFO, "path to resource is \"%s\"", st->req_realpath);
+	timer_phase(st, PHASE_RESOLVE);
 
-			/* Generate path to the found vhost */
-			snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
-				st->server_root, dir->d_name, st->req_selector);
+	if (resolve_path(st, file) == ERROR) {
 
-			/* Did we find the selector under this vhost? */
-			if (stat(st->req_realpath, &file) == OK) {
+		/* Symlinks out of the gopher root with -B */
+		if (errno == EXDEV)
+			die(st, ERR_ACCESS, "Refusing to resolve outside of the gopher root");
 
-				/* Virtual host found - update state & return */
-				sstrlcpy(st->server_host, dir->d_name);
-				return;
-			}
+		/* Handle virtual /caps.txt requests */
+		if (st->opt_caps && sstrncmp(st->req_selector, CAPS_TXT) == MATCH) {
+#ifdef HAVE_SHMEM
+			caps_txt(st, st->shm);
+#else
+			caps_txt(st, NULL);
+#endif
+			exit(EXIT_SUCCESS);
 		}
-		closedir(dp);
+
+		/* Requested file not found - remember it & die() */
+#ifdef HAVE_SHMEM
+		if (st->shm && st->opt_cache) notfound_add(st, st->shm);
+#endif
+		die(st, ERR_NOTFOUND, NULL);
 	}
 
-	/* Handle normal selectors */
-	snprintf(st->req_realpath, sizeof(st->req_realpath),
-		"%s%s", st->server_root, st->req_selector);
+	/* Fetch request filesize from stat() */
+	st->req_filesize = file->st_size;
+
+	/* Everyone must have read access but no write access */
+	if ((file->st_mode & S_IROTH) == 0)
+		die(st, ERR_ACCESS, "File or directory not world-readable");
+	if ((file->st_mode & S_IWOTH) != 0)
+		die(st, ERR_ACCESS, "File or directory world-writeable");
+
+	/* If stat said it was a dir then it's a menu */
+	if ((file->st_mode & S_IFMT) == S_IFDIR) st->req_filetype = TYPE_MENU;
+
+	/* Not a dir - let's guess the filetype again... */
+	else if ((file->st_mode & S_IFMT) == S_IFREG)
+		st->req_filetype = gopher_filetype(st, st->req_realpath, st->opt_magic);
+
+	/* Menu selectors must end with a slash */
+	if (st->req_filetype == TYPE_MENU && strlast(st->req_selector) != '/')
+		sstrlcat(st->req_selector, "/");
 }
 
 
@@ -393,6 +554,10 @@ void init_state(state *st)
 	strclear(st->req_realpath);
 	strclear(st->req_query_string);
 	strclear(st->req_referrer);
+	strclear(st->req_key);
+	strclear(st->req_root);
+	st->root_fd = ERROR;
+	st->req_fd = ERROR;
 	sstrlcpy(st->req_local_addr, get_local_address());
 	sstrlcpy(st->req_remote_addr, get_peer_address());
 	/* strclear(st->req_remote_host); */
@@ -403,6 +568,7 @@ void init_state(state *st)
 	/* Output */
 	st->out_width = DEFAULT_WIDTH;
 	st->out_charset = DEFAULT_CHARSET;
+	st->out_bytes = 0;
 
 	/* Settings */
 	sstrlcpy(st->server_root, DEFAULT_ROOT);
@@ -423,9 +589,19 @@ void init_state(state *st)
 	strclear(st->log_file);
 
 	st->hidden_count = 0;
+	st->page_size = 0;
+	st->menu_sort = SORT_NAME;
 	st->filetype_count = 0;
 	strclear(st->filter_dir);
+	strclear(st->cache_dir);
+	st->proxy_count = 0;
+	st->rewrite = NULL;
 	st->rewrite_count = 0;
+	st->rewrite_max = 0;
+	st->rewrite_regex = 0;
+	st->rewrite_trie = NULL;
+	st->rewrite_nodes = 0;
+	st->rewrite_nodes_max = 0;
 
 	strclear(st->server_description);
 	strclear(st->server_location);
@@ -436,6 +612,47 @@ void init_state(state *st)
 	st->session_timeout = DEFAULT_SESSION_TIMEOUT;
 	st->session_max_kbytes = DEFAULT_SESSION_MAX_KBYTES;
 	st->session_max_hits = DEFAULT_SESSION_MAX_HITS;
+	st->log_sample = DEFAULT_LOG_SAMPLE;
+
+	/* Statistics */
+	st->shm = NULL;
+	st->req_start = monotime();
+	st->req_timer = st->req_start;
+	for (i = 0; i < PHASES; i++) st->req_usecs[i] = 0;
+	st->req_phases = 0;
+	st->req_kind = KIND_ERROR;
+
+	/* Single-flight */
+	st->flight_slot = ERROR;
+	st->flight_gen = 0;
+	st->flight_buf = NULL;
+	st->flight_size = 0;
+	st->flight_max = 0;
+	st->flight_ok = FALSE;
+
+	/* HTTP */
+	st->http_version = 0;
+	st->http_status = HTTP_OK;
+	st->http_keepalive = FALSE;
+	st->http_chunked = FALSE;
+	st->http_html = FALSE;
+	st->http_sent = FALSE;
+	st->http_done = FALSE;
+	st->http_reuse = NULL;
+	st->http_length = ERROR;
+	st->http_since = 0;
+	st->http_mtime = 0;
+	strclear(st->http_host);
+	strclear(st->http_match);
+	strclear(st->http_etag);
+	strclear(st->http_mime);
+	st->http_linelen = 0;
+
+	/* TLS */
+	strclear(st->tls_file);
+	st->tls_ctx = NULL;
+	st->tls = NULL;
+	st->tls_ktls = FALSE;
 
 	/* Feature options */
 	st->opt_vhost = TRUE;
@@ -449,7 +666,15 @@ void init_state(state *st)
 	st->opt_query = TRUE;
 	st->opt_caps = TRUE;
 	st->opt_shm = TRUE;
+	st->opt_cache = TRUE;
 	st->opt_root = TRUE;
+	st->opt_beneath = FALSE;
+	st->opt_keepalive = TRUE;
+	st->opt_index = FALSE;
+	st->opt_pack = FALSE;
+	st->opt_watch = FALSE;
+	st->opt_share = FALSE;
+	strclear(st->warm_source);
 	st->debug = FALSE;
 
 	/* Load default suffix -> filetype mappings */
@@ -475,6 +700,8 @@ int main(int argc, char *argv[])
 	char buf[BUFSIZE];
 	char *dest;
 	char *c;
+	int memo;
+	int i;
 #ifdef HAVE_SHMEM
 	struct shmid_ds shm_ds;
 	shm_state *shm;
@@ -492,6 +719,10 @@ int main(int argc, char *argv[])
 	init_state(&st);
 	srand(time(NULL) / (getpid() + getppid()));
 
+	/* Count every byte sent to the client, even from aborted transfers */
+	signal(SIGPIPE, SIG_IGN);
+	sink_open(&st);
+
 	/* Handle command line arguments */
 	parse_args(&st, argc, argv);
 
@@ -510,6 +741,18 @@ int main(int argc, char *argv[])
 		die(&st, ERR_ACCESS, "Refusing to run as root");
 #endif
 
+	/* Build the search index & quit */
+	if (st.opt_index) {
+		search_index(&st);
+		return OK;
+	}
+
+	/* Build a snapshot pack of the vhost & quit */
+	if (st.opt_pack) {
+		pack_build(&st);
+		return OK;
+	}
+
 	/* Try to get shared memory */
 #ifdef HAVE_SHMEM
 	if ((shmid = shmget(SHM_KEY, sizeof(shm_state), IPC_CREAT | SHM_MODE)) == ERROR) {
@@ -536,6 +779,7 @@ int main(int argc, char *argv[])
 
 	/* For debugging shared memory issues */
 	if (!st.opt_shm) shm = NULL;
+	st.shm = shm;
 
 	/* Get server platform and description */
 	if (shm) {
@@ -548,12 +792,44 @@ int main(int argc, char *argv[])
 #endif
 		platform(&st);
 
+	/* Watch the gopher root for changes until told to quit */
+	if (st.opt_watch) {
+#ifdef HAVE_INOTIFY
+		watch_run(&st, shm);
+		return OK;
+#else
+		fprintf(stderr, "No inotify support compiled in\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	/* Warm up the caches & exit */
+	if (*st.warm_source) {
+#ifdef HAVE_SHMEM
+		warm_run(&st, shm);
+#else
+		warm_run(&st, NULL);
+#endif
+		return OK;
+	}
+
+	/* Do the TLS handshake before anything gets read or written */
+	if (*st.tls_file) {
+#ifdef HAVE_TLS
+		tls_open(&st);
+#else
+		if (st.opt_syslog) syslog(LOG_ERR, "no TLS support compiled in");
+		exit(EXIT_FAILURE);
+#endif
+	}
+
 	/* Read selector */
 	if (fgets(selector, sizeof(selector) - 1, stdin) == NULL)
 		selector[0] = '\0';
 
 	/* Remove trailing CRLF */
 	chomp(selector);
+	timer_phase(&st, PHASE_READ);
 
 	if (st.debug) syslog(LOG_INFO, "client sent us \"%s\"", selector);
 
@@ -574,19 +850,20 @@ int main(int argc, char *argv[])
 		printf("+VIEWS:" CRLF " application/gopher+-menu: <512b>" CRLF);
 		printf("." CRLF);
 
+		sink_close(&st);
 		if (st.debug) syslog(LOG_INFO, "got a request for gopher+ root menu");
 		return OK;
 	}
 
-	/* Convert HTTP request to gopher (respond using headerless HTTP/0.9) */
+	/* Convert HTTP request to gopher */
 	if (sstrncmp(selector, "GET ") == MATCH ||
 	    sstrncmp(selector, "POST ") == MATCH ) {
 
-		if ((c = strchr(selector, ' '))) sstrlcpy(selector, c + 1);
-		if ((c = strchr(selector, ' '))) *c = '\0';
-
 		st.req_protocol = PROTO_HTTP;
 
+		/* Keep-alive connections come back here once per request */
+		http_serve(&st, selector, sizeof(selector));
+
 		if (st.debug) syslog(LOG_INFO, "got HTTP request for \"%s\"", selector);
 	}
 
@@ -596,6 +873,9 @@ int main(int argc, char *argv[])
 	if (shm) get_shm_session(&st, shm);
 #endif
 
+	/* HTTP Host: header works like a ;vhost hint */
+	if (st.opt_vhost && *st.http_host) sstrlcpy(st.server_host, st.http_host);
+
 	/* Loop through the selector, fix it & separate query_string */
 	dest = st.req_selector;
 	if (selector[0] != '/') *dest++ = '/';
@@ -645,48 +925,35 @@ int main(int argc, char *argv[])
 	/* Remove possible extra cruft from server_host */
 	if ((c = strchr(st.server_host, '\t'))) *c = '\0';
 
-	/* Guess request filetype so we can die() with style... */
-	st.req_filetype = gopher_filetype(&st, st.req_selector, FALSE);
-
-	/* Convert seletor to path & stat() */
-	selector_to_path(&st);
-	if (st.debug) syslog(LOG_INFO, "path to resource is \"%s\"", st.req_realpath);
-
-	if (stat(st.req_realpath, &file) == ERROR) {
-
-		/* Handle virtual /caps.txt requests */
-		if (st.opt_caps && sstrncmp(st.req_selector, CAPS_TXT) == MATCH) {
-#ifdef HAVE_SHMEM
-			caps_txt(&st, shm);
-#else
-			caps_txt(&st, NULL);
-#endif
-			return OK;
-		}
-
-		/* Requested file not found - die() */
-		die(&st, ERR_NOTFOUND, NULL);
+	/* Handle /server-search queries */
+	if (sstrncmp(st.req_selector, SERVER_SEARCH) == MATCH) {
+		server_search(&st);
+		return OK;
 	}
 
-	/* Fetch request filesize from stat() */
-	st.req_filesize = file.st_size;
+	/* Selectors under a proxy prefix come from an upstream server */
+	if ((i = proxy_match(&st)) != ERROR) proxy_request(&st, i);
 
-	/* Everyone must have read access but no write access */
-	if ((file.st_mode & S_IROTH) == 0)
-		die(&st, ERR_ACCESS, "File or directory not world-readable");
-	if ((file.st_mode & S_IWOTH) != 0)
-		die(&st, ERR_ACCESS, "File or directory world-writeable");
+	/* Packed vhosts are served without touching the filesystem */
+	pack_request(&st);
 
-	/* If stat said it was a dir then it's a menu */
-	if ((file.st_mode & S_IFMT) == S_IFDIR) st.req_filetype = TYPE_MENU;
+	/* Guess request filetype so we can die() with style... */
+	st.req_filetype = gopher_filetype(&st, st.req_selector, FALSE);
 
-	/* Not a dir - let's guess the filetype again... */
-	else if ((file.st_mode & S_IFMT) == S_IFREG)
-		st.req_filetype = gopher_filetype(&st, st.req_realpath, st.opt_magic);
+	/* Short-circuit recently not found selectors */
+	cache_key(&st);
+#ifdef HAVE_SHMEM
+	if (shm && st.opt_cache && notfound_lookup(&st, shm))
+		die(&st, ERR_NOTFOUND, "Not found (cached)");
+#endif
 
-	/* Menu selectors must end with a slash */
-	if (st.req_filetype == TYPE_MENU && strlast(st.req_selector) != '/')
-		sstrlcat(st.req_selector, "/");
+	/* Reuse the resolution of a hot selector or resolve it */
+	memo = FALSE;
+#ifdef HAVE_SHMEM
+	if (shm && st.opt_cache) memo = memo_lookup(&st, shm, &file);
+#endif
+	if (memo) timer_phase(&st, PHASE_RESOLVE);
+	else resolve_selector(&st, &file);
 
 	/* Change directory to wherever the resource was */
 	sstrlcpy(buf, st.req_realpath);
@@ -695,12 +962,20 @@ int main(int argc, char *argv[])
 	else c = buf;
 
 	if (chdir(c) == ERROR) die(&st, ERR_ACCESS, NULL);
+	timer_phase(&st, PHASE_STAT);
+
+	/* Remember how the selector was resolved */
+#ifdef HAVE_SHMEM
+	if (shm && st.opt_cache && !memo) memo_add(&st, shm, &file);
+#endif
 
-	/* Keep count of hits and data transfer */
+	/* Keep count of hits (data transfer is counted after sending) */
 #ifdef HAVE_SHMEM
 	if (shm) {
 		shm->hits++;
-		shm->kbytes += st.req_filesize / 1024;
+
+		/* Track the hottest selectors & clients */
+		update_shm_hitters(&st, shm);
 
 		/* Update user session */
 		update_shm_session(&st, shm);
@@ -716,16 +991,23 @@ int main(int argc, char *argv[])
 			st.req_selector,
 			st.req_remote_addr);
 	}
+	timer_phase(&st, PHASE_LOG);
 
 	/* Check file type & act accordingly */
 	switch (file.st_mode & S_IFMT) {
 		case S_IFDIR:
-			log_combined(&st, HTTP_OK);
+			/* Whole directory as a tar archive */
+			if (strcmp(st.req_query_string, TAR_QUERY) == MATCH) {
+				st.req_kind = KIND_BINARY;
+				send_tar(&st);
+				break;
+			}
+
+			st.req_kind = KIND_MENU;
 			gopher_menu(&st);
 			break;
 
 		case S_IFREG:
-			log_combined(&st, HTTP_OK);
 			gopher_file(&st);
 			break;
 
@@ -733,6 +1015,9 @@ int main(int argc, char *argv[])
 			die(&st, ERR_ACCESS, "Refusing to serve out special files");
 	}
 
+	/* Log & update statistics */
+	finish(&st);
+
 	/* Clean exit */
 	return OK;
 }
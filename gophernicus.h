@@ -42,20 +42,57 @@
 #define HAVE_IPv6		/* Requires modern POSIX */
 #define HAVE_PASSWD		/* For systems with passwd-like userdb */
 #define PASSWD_MIN_UID 100	/* Minimum allowed UID for ~userdirs */
+#define PASSWD_FILE "/etc/passwd"	/* Userdir index is refreshed when this changes */
 #define HAVE_LOCALES		/* setlocale() and friends */
 #define HAVE_SHMEM		/* Shared memory support */
 #define HAVE_UNAME		/* uname() */
 #define HAVE_POPEN		/* popen() */
+#define HAVE_CLOCK_GETTIME	/* clock_gettime(CLOCK_MONOTONIC) */
+#define HAVE_MMAP		/* mmap() for compiled gophermaps */
 #undef  HAVE_STRLCPY		/* strlcpy() from OpenBSD */
 #undef  HAVE_SENDFILE		/* sendfile() in Linux & others */
 
 /* Linux */
 #ifdef __linux
+#define _GNU_SOURCE
 #undef  PASSWD_MIN_UID
 #define PASSWD_MIN_UID 500
 #define HAVE_SENDFILE
 #endif
 
+/* glibc & uClibc let us replace stdout with a custom stream */
+#ifdef __linux
+#include <features.h>
+#ifdef __GLIBC__
+#define HAVE_FOPENCOOKIE
+#endif
+#endif
+
+/* Linux processes can sleep on a word in shared memory */
+#ifdef __linux
+#define HAVE_FUTEX
+#endif
+
+/* Linux 5.6+ can resolve paths beneath a directory in the kernel */
+#ifdef __linux
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#define HAVE_OPENAT2
+#endif
+#endif
+
+/* Linux can give a process the disk only when nobody else wants it */
+#ifdef __linux
+#ifdef SYS_ioprio_set
+#define HAVE_IOPRIO
+#endif
+#endif
+
+/* Linux reports filesystem changes (for validating caches without stat()) */
+#ifdef __linux
+#define HAVE_INOTIFY
+#endif
+
 /* Embedded Linux with uClibc */
 #ifdef __UCLIBC__
 #undef HAVE_SHMEM
@@ -73,15 +110,38 @@
 #define HAVE_STRLCPY
 #endif
 
+/* BSDs and MacOS have funopen() for custom streams */
+#if defined(__OpenBSD__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+#define HAVE_FUNOPEN
+#endif
+
 /* MacOS */
 #if defined(__APPLE__)
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_10
 #define HAVE_STRLCPY
 #endif
+#if __MAC_OS_X_VERSION_MIN_REQUIRED < 101200
+#undef HAVE_CLOCK_GETTIME
+#endif
 #endif
 
 /* Add other OS-specific defines here */
 
+/* Output byte counting needs a custom stdout stream */
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define HAVE_SINK
+#endif
+
+/* The change watcher publishes into shared memory */
+#if defined(HAVE_INOTIFY) && !defined(HAVE_SHMEM)
+#undef HAVE_INOTIFY
+#endif
+
+/* TLS is opt-in (make tls) and needs the custom streams */
+#if defined(HAVE_TLS) && !defined(HAVE_SINK)
+#undef HAVE_TLS
+#endif
+
 /*
  * Include headers
  */
@@ -92,33 +152,79 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <string.h>
+#include <ctype.h>
 #include <libgen.h>
 #include <time.h>
 #include <syslog.h>
 #include <errno.h>
 #include <pwd.h>
 #include <limits.h>
+#include <signal.h>
+#include <regex.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 #ifdef HAVE_SENDFILE
 #include <sys/sendfile.h>
-#include <fcntl.h>
+#endif
+
+#ifdef HAVE_OPENAT2
+#include <linux/openat2.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_FUTEX
+#include <linux/futex.h>
+#endif
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#else
+struct inotify_event;
 #endif
 
 #ifdef HAVE_LOCALES
 #include <locale.h>
 #endif
 
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#else
+#define SSL void
+#define SSL_CTX void
+#endif
+
 #ifdef HAVE_SHMEM
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #else
 #define shm_state void
+#define shm_histogram void
+#define shm_sketch void
+#define shm_hitter void
+#define shm_vhost_cache void
+#define shm_user void
+#define shm_notfound void
+#define shm_memo void
+#define shm_flight void
 #endif
 
 #if defined(HAVE_IPv4) || defined(HAVE_IPv6)
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #endif
 
 #ifdef HAVE_UNAME
@@ -176,10 +282,28 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 
 /* HTTP protocol stuff for logging */
 #define HTTP_OK		200
+#define HTTP_304	304
+#define HTTP_403	403
 #define HTTP_404	404
+#define HTTP_500	500
 #define HTTP_DATE	"%d/%b/%Y:%T %z"
 #define HTTP_USERAGENT	"Unknown gopher client"
 
+/* HTTP frontend */
+#define HTTP_09		9	/* Headerless responses */
+#define HTTP_10		10
+#define HTTP_11		11
+#define HTTP_REQUESTS	100	/* Requests per keep-alive connection */
+#define HTTP_TIMEOUT	15	/* Seconds to wait for the next request */
+#define HTTP_CHUNK	16384	/* Buffer for menus converted to HTML */
+#define HTTP_DAYS	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+#define HTTP_MIME	"application/octet-stream"
+
+/* TLS listener */
+#define TLS_TIMEOUT	30	/* Seconds allowed for the handshake */
+#define TLS_TICKET_KEYS	80	/* Session ticket name + HMAC + AES keys */
+#define TLS_TICKET_ROTATE 86400	/* Seconds between ticket key changes */
+
 /* Defaults for settings */
 #define DEFAULT_HOST	"localhost"
 #define DEFAULT_PORT	70
@@ -199,6 +323,9 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define DEFAULT_SESSION_MAX_KBYTES	4194304
 #define DEFAULT_SESSION_MAX_HITS	4096
 
+/* Log every not found error to syslog */
+#define DEFAULT_LOG_SAMPLE	1
+
 /* Dummy values for gopher protocol */
 #define DUMMY_SELECTOR	"null"
 #define DUMMY_HOST	"null.host\t1"
@@ -213,10 +340,56 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 /* Special requests */
 #define SERVER_STATUS	"/server-status"
 #define CAPS_TXT	"/caps.txt"
+#define SERVER_SEARCH	"/server-search"
+
+/* Machine-readable /server-status formats */
+#define STATUS_PROMETHEUS	"format=prometheus"
+#define STATUS_JSON		"format=json"
+#define STATUS_PREFIX		"gophernicus_"
+
+/* Directory downloads (/dir/?tar) */
+#define TAR_QUERY	"tar"
+#define TAR_MIME	"application/x-tar"
+#define TAR_BLOCK	512
+#define TAR_NAME	100	/* ustar name field */
+#define TAR_PREFIX	155	/* ustar prefix field */
+
+/* Request phases for latency statistics */
+#define PHASE_READ	0	/* Reading & parsing the selector */
+#define PHASE_RESOLVE	1	/* selector_to_path() */
+#define PHASE_STAT	2	/* stat() & filetype classification */
+#define PHASE_SEND	3	/* Menu generation or file output */
+#define PHASE_LOG	4	/* syslog() & combined logging */
+#define PHASE_TOTAL	5	/* Whole request */
+#define PHASES		6
+
+#define PHASE_NAMES	"read", "resolve", "stat", "send", "log", "total"
+
+/* Request kinds for latency statistics */
+#define KIND_MENU	0
+#define KIND_TEXT	1
+#define KIND_BINARY	2
+#define KIND_CGI	3
+#define KIND_ERROR	4
+#define KINDS		5
+
+#define KIND_NAMES	"menu", "text", "binary", "cgi", "error"
+
+/* Log-bucketed latency histograms (HDR-style, ~12% precision) */
+#define HIST_SUB_BITS	3	/* Sub-buckets per power of two = 2^bits */
+#define HIST_BUCKETS	240	/* Enough for 2^31 microseconds */
 
 /* Error messages */
 #define ERR_ACCESS	"Access denied!"
 #define ERR_NOTFOUND	"File or directory not found!"
+#define ERR_INTERNAL	"Internal server error!"
+
+#define ERR_TYPE_NOTFOUND	0
+#define ERR_TYPE_ACCESS		1
+#define ERR_TYPE_OTHER		2
+#define ERR_TYPES		3
+
+#define ERR_TYPE_NAMES	"notfound", "access", "other"
 
 #define ERROR_HOST	"error.host\t1"
 #define ERROR_PREFIX	"Error: "
@@ -226,12 +399,19 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define SERVER_SOFTWARE_FULL SERVER_SOFTWARE "/" VERSION " (%s)"
 
 #define HEADER_FORMAT	"[%s]"
+#define PAGE_FORMAT	"Page %i of %i"
+#define PAGE_FORMAT_STREAM	"Page %i"
+#define PAGE_PREV	"<< Previous page"
+#define PAGE_NEXT	"Next page >>"
 #define FOOTER_FORMAT	"Gophered by Gophernicus/" VERSION " on %s"
 
 #define UNITS		"KB", "MB", "GB", "TB", "PB", NULL
 #define DATE_FORMAT	"%Y-%b-%d %H:%M"	/* See man 3 strftime */
 #define DATE_WIDTH	17
 #define DATE_LOCALE 	"POSIX"
+#define DATE_MONTHS	"Jan", "Feb", "Mar", "Apr", "May", "Jun", \
+			"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+#define DATE_CACHE	4096	/* Days of UTC offsets to remember */
 
 #define USERDIR_FORMAT	"~%s", pwd->pw_name	/* See man 3 getpwent */
 #define VHOST_FORMAT	"gopher://%s/"
@@ -254,8 +434,84 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define MAX_HIDDEN	32	/* Maximum number of hidden files */
 #define MAX_FILETYPES	128	/* Maximum number of suffix to filetype mappings */
 #define MAX_FILTERS	16	/* Maximum number of file filters */
-#define MAX_SDIRENT	1024	/* Maximum number of files per directory to handle */
-#define MAX_REWRITE	32	/* Maximum number of selector rewrite options */
+#define SDIRENT_ALLOC	256	/* Initial size of directory listing arrays */
+
+/* Menu sort orders */
+#define SORT_NONE	0	/* Stream in readdir() order */
+#define SORT_NAME	1	/* Folders first, alphabetic */
+#define SORT_NATURAL	2	/* Folders first, "file2" before "file10" */
+#define SORT_MTIME	3	/* Folders first, newest first */
+#define SORT_SIZE	4	/* Folders first, smallest first */
+
+#define SORT_KEY_FILE	(1ULL << 63)		/* Files sort after folders */
+#define SORT_KEY_MAX	(SORT_KEY_FILE - 1)
+#define SORT_KEY_BYTES	7			/* Name prefix bytes in keys */
+#define RADIX_MIN	256			/* Radix sort bigger menus */
+
+#define REWRITE_RULES	32	/* Initial size of the rewrite rule array */
+#define REWRITE_NODES	256	/* Initial size of the rewrite trie */
+#define REWRITE_CAPTURES 10	/* Regex captures \0 - \9 */
+
+/* Compiled gophermaps */
+#define MAP_MAGIC	"GMAP0001"	/* Compiled gophermap format version */
+#define CACHE_MODE	0600		/* Access mode for files in the cache dir */
+#define MAP_ALLOC	4096		/* Initial size of compile buffers */
+#define MAP_ALIGN	8		/* Records start at multiples of this */
+#define MAP_DEPTH	4		/* Maximum gophermap include depth */
+
+#define MAP_INFO	1	/* Info line */
+#define MAP_TITLE	2	/* Title line */
+#define MAP_ITEM	3	/* Resource: name, selector & host */
+#define MAP_HIDE	4	/* Hide a file from the menu */
+#define MAP_FTYPE	5	/* Filetype override */
+#define MAP_OPTION	6	/* Menu option */
+#define MAP_USERS	7	/* List of ~userdirs */
+#define MAP_VHOSTS	8	/* List of virtual hosts */
+#define MAP_EXEC	9	/* Include run at request time (port = depth) */
+#define MAP_STOP	10	/* Stop here & list the directory */
+#define MAP_QUIT	11	/* Stop here */
+
+#define MAP_HOST	1	/* Resource has an explicit host */
+#define MAP_PORT	2	/* Resource has an explicit port */
+#define MAP_ABSOLUTE	4	/* Selector is not relative to the menu */
+
+/* Caching proxy for upstream gopher servers */
+#define MAX_PROXIES	16		/* Maximum number of upstream mappings */
+#define PROXY_PORT	70		/* Default upstream port */
+#define PROXY_TIMEOUT	10		/* Seconds to wait for the upstream */
+#define PROXY_TTL	300		/* Seconds before a cached response is refetched */
+#define PROXY_OBJECT_MAX (8 * 1024 * 1024)	/* Biggest response to cache */
+#define PROXY_CACHE_MAX	(256 * 1024 * 1024)	/* Total size of cached responses */
+#define PROXY_FILE	"proxy."	/* Cache file name prefix */
+
+/* Full-text search index */
+#define SEARCH_FILE	"search.idx"	/* Index file in the cache dir */
+#define SEARCH_MAGIC	"GIDX0001"	/* Index format version */
+#define SEARCH_MIN	2		/* Shortest word indexed */
+#define SEARCH_WORD	32		/* Longest word indexed */
+#define SEARCH_READ	(1024 * 1024)	/* Bytes of a text file indexed */
+#define SEARCH_DEPTH	32		/* Deepest directory indexed */
+#define SEARCH_WORDS	65536		/* Initial size of the word hash */
+#define SEARCH_TERMS	8		/* Words used from a query */
+#define SEARCH_RESULTS	100		/* Results listed */
+
+/* Cache warm-up */
+#define WARM_RATE	200		/* Selectors warmed per second */
+#define WARM_MAX	100000		/* Selectors warmed per run */
+#define WARM_DEPTH	16		/* Deepest directory walked */
+#define WARM_MEMO	256		/* Walked selectors remembered in the memo */
+#define WARM_NICE	19		/* CPU priority of the warm-up */
+
+#ifdef HAVE_IOPRIO
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#endif
+
+/* Snapshot packs of immutable vhosts */
+#define PACK_FILE	"pack."		/* Pack file name prefix in the cache dir */
+#define PACK_MAGIC	"GPAK0002"	/* Pack format version */
+#define PACK_DEPTH	32		/* Deepest directory packed */
 
 /* Struct for file suffix -> gopher filetype mapping */
 typedef struct {
@@ -265,10 +521,373 @@ typedef struct {
 
 /* Struct for selector rewriting */
 typedef struct {
-	char match[BUFSIZE];
-	char replace[BUFSIZE];
+	char *match;
+	char *replace;
+	regex_t *regex;
 } srewrite;
 
+/* Growing buffer for a compiled gophermap (or the mapped cache file) */
+typedef struct {
+	char *data;
+	size_t size;
+	size_t max;
+	size_t start;	/* Offset of the first instruction */
+	int mapped;
+} smap;
+
+/* Header of a compiled gophermap file */
+typedef struct {
+	char magic[8];
+	size_t deps;	/* Bytes of dependency records */
+	size_t ops;	/* Bytes of instruction records */
+} smaphead;
+
+/* File a compiled gophermap was built from (path follows, first is the map) */
+typedef struct {
+	int len;
+	time_t mtime;
+	time_t ctime;
+	off_t size;
+	ino_t ino;
+	dev_t dev;
+} smapdep;
+
+/* Compiled gophermap instruction (zero-terminated strings follow) */
+typedef struct {
+	int len;
+	int port;
+	char op;
+	char type;
+	char flags;
+} smaprec;
+
+/* Selector prefix served from an upstream gopher server */
+typedef struct {
+	char prefix[64];
+	char host[64];
+	int port;
+} sproxy;
+
+/* Cached upstream response (for finding the least recently used) */
+typedef struct {
+	char name[32];
+	time_t atime;
+	off_t size;
+} sproxyfile;
+
+/* Search index file header (documents, words, postings & strings follow) */
+typedef struct {
+	char magic[8];
+	int docs;
+	int words;
+	size_t postings;	/* Offset of the postings */
+	size_t strings;		/* Offset of the string pool */
+	size_t size;
+} sidxhead;
+
+/* Indexed document (path is an offset in the string pool) */
+typedef struct {
+	time_t mtime;
+	off_t size;
+	unsigned int path;
+	char type;
+} sidxdoc;
+
+/* Indexed word (postings are varints of document deltas & counts) */
+typedef struct {
+	unsigned int word;
+	unsigned int post;
+	int docs;
+} sidxword;
+
+/* Document & word count */
+typedef struct {
+	unsigned int doc;
+	unsigned int count;
+} sidxpost;
+
+/* Word of an index being built */
+typedef struct {
+	char *word;
+	sidxpost *post;
+	int count;
+	int max;
+} sidxbuild;
+
+/* Index being built */
+typedef struct {
+	sidxbuild *words;
+	int word_count;
+	int word_max;
+	sidxdoc *docs;
+	int doc_count;
+	int doc_max;
+	char *strings;
+	size_t string_size;
+	size_t string_max;
+	smap old;		/* Previous index */
+	int *old_doc;		/* Previous document -> new document */
+	int *old_hash;		/* Previous document paths */
+	int reused;
+	char *buf;
+} sindex;
+
+/* Search result */
+typedef struct {
+	int doc;
+	unsigned int score;
+} sidxhit;
+
+/* Snapshot pack file header (selectors & responses, then the table follow) */
+typedef struct {
+	char magic[8];
+	int slots;	/* Hash table size (a power of two) */
+	int width;	/* Options the menus were rendered with */
+	int port;
+	int iconv;
+	int charset;
+	size_t table;	/* Offset of the hash table */
+	size_t size;
+} spackhead;
+
+/* Packed response (selector & response are offsets in the pack) */
+typedef struct {
+	unsigned long hash;
+	size_t selector;	/* Zero for an empty slot */
+	size_t offset;
+	size_t size;
+	char type;
+	char kind;
+} spackent;
+
+/* Directories watched for changes (paths indexed by watch descriptor) */
+typedef struct {
+	int fd;
+	char **path;
+	int max;
+	int count;
+} swatch;
+
+/* Cache warm-up in progress */
+typedef struct {
+	FILE *null;		/* Rendered menus go here */
+	char **queue;		/* Selectors waiting to be walked */
+	int head;
+	int tail;
+	int max;
+	int walk;		/* Queue the contents of menus */
+	int memo;		/* Selectors left to remember in the memo */
+	int count;
+	int menus;
+	long long start;
+} swarm;
+
+/* Pack being built */
+typedef struct {
+	FILE *fp;
+	size_t size;		/* Bytes written so far */
+	spackent *ents;
+	int count;
+	int max;
+	int hidden;		/* Hides in effect outside of gophermaps */
+	int skipped;		/* Left to the filesystem */
+	char root[BUFSIZE];
+} spackbuild;
+
+/* Prefix trie node for literal rewrites (child & next are indexes) */
+typedef struct {
+	int child;
+	int next;
+	int rule;
+	char c;
+} snode;
+
+/* Shared memory for session & accounting data */
+#ifdef HAVE_SHMEM
+
+#define SHM_KEY		0xbeeb0015	/* Unique identifier + struct version */
+#define SHM_MODE	0600		/* Access mode for the shared memory */
+#define SHM_SESSIONS	256		/* Max amount of user sessions to track */
+#define SHM_HITTERS	64		/* Heavy hitters tracked per sketch */
+#define SHM_VHOSTS	512		/* Max amount of vhosts to index */
+#define SHM_VHOST_CACHE	1024		/* Selector -> vhost cache slots */
+
+#define CACHE_PROBES	4		/* Hash table slots to look at */
+#define VHOST_CACHE_TTL	60		/* Seconds to trust "not in any vhost" */
+#define SHM_USERS	256		/* Max amount of ~userdirs to index */
+#define USER_INDEX_TTL	300		/* Seconds between userdir index refreshes */
+#define SHM_NOTFOUND	1024		/* Negative (not found) cache slots */
+#define NOTFOUND_TTL	60		/* Seconds to trust a cached not found */
+#define SHM_MEMO	512		/* Resolved selector memo slots */
+#define MEMO_TTL	60		/* Seconds to reuse a resolved selector */
+#define SHM_FLIGHTS	64		/* Responses being computed at once */
+
+#define WATCH_BUCKETS	4096		/* Directory generation counters */
+#define WATCH_BEAT	1		/* Seconds between watcher heartbeats */
+#define WATCH_TIMEOUT	5		/* Seconds without a heartbeat until stat() is used again */
+#define WATCH_DEPTH	64		/* Deepest directory watched */
+#define WATCH_READ	16384		/* Bytes of events read at once */
+#define WATCH_EVENTS	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+			 IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#define FLIGHT_IDLE	0	/* Slot is free */
+#define FLIGHT_RUNNING	1	/* Leader is computing the response */
+#define FLIGHT_DONE	2	/* Response is waiting in the cache dir */
+#define FLIGHT_FAILED	3	/* Leader died or the response was too big */
+
+#define FLIGHT_TIMEOUT	10000		/* Milliseconds to wait for the leader */
+#define FLIGHT_POLL	100		/* Milliseconds between leader checks */
+#define FLIGHT_MAX	(8 * 1024 * 1024)	/* Biggest response to share */
+#define FLIGHT_SPINS	10000		/* Check for a dead lock holder this often */
+
+typedef struct {
+	long hits;
+	long long bytes;
+
+	time_t req_atime;
+	char req_selector[128];
+	char req_remote_addr[64];
+	char req_filetype;
+	int session_id;
+
+	char server_host[64];
+	int  server_port;
+} shm_session;
+
+typedef struct {
+	long count;
+	long long usecs;
+	long bucket[HIST_BUCKETS];
+} shm_histogram;
+
+typedef struct {
+	char key[128];
+	long count;
+	long error;
+} shm_hitter;
+
+/* Space-saving sketch for finding the most frequent keys */
+typedef struct {
+	shm_hitter hitter[SHM_HITTERS];
+} shm_sketch;
+
+/* Which vhost a selector was found under (or ERROR for none) */
+typedef struct {
+	unsigned long hash;
+	long generation;
+	time_t ctime;
+	int vhost;
+	char selector[128];
+} shm_vhost_cache;
+
+/* Selector that wasn't found (validated with the parent dir mtime or the watcher) */
+typedef struct {
+	unsigned long hash;
+	time_t ctime;
+	time_t mtime;
+	long watch_epoch;	/* 0 if not watched */
+	long watch_stamp;
+	int watch_dir;
+	int watch_self;
+	char key[128];
+	char parent[256];
+} shm_notfound;
+
+/* Resolved selector (validated with one stat() of the realpath or the watcher) */
+typedef struct {
+	unsigned long hash;
+	time_t ctime;
+	time_t mtime;
+	long watch_epoch;	/* 0 if not watched */
+	long watch_stamp;
+	int watch_dir;
+	int watch_self;
+	time_t file_ctime;
+	off_t size;
+	ino_t ino;
+	dev_t dev;
+	mode_t mode;
+	char filetype;
+	char key[128];
+	char realpath[256];
+	char selector[128];
+	char host[64];
+} shm_memo;
+
+/* Response computed by one process for all concurrent requests */
+typedef struct {
+	pid_t lock;	/* Holder of the slot lock (0 if none) */
+	int state;	/* FLIGHT_xxx (futex word) */
+	int waiters;
+	pid_t pid;
+	long gen;
+	unsigned long hash;
+	char key[256];
+} shm_flight;
+
+/* User with a valid ~/public_gopher */
+typedef struct {
+	time_t mtime;
+	uid_t uid;
+	char name[32];
+	char gecos[64];
+	char dir[128];
+} shm_user;
+
+typedef struct {
+	time_t start_time;
+	long hits;
+	long long bytes;
+	char server_platform[64];
+	char server_description[64];
+	long errors[ERR_TYPES];
+	long throttles;
+	shm_session session[SHM_SESSIONS];
+	shm_histogram latency[KINDS][PHASES];
+	shm_sketch top_selectors;
+	shm_sketch top_clients;
+	shm_sketch top_clients_bytes;
+
+	time_t vhost_mtime;
+	long vhost_generation;
+	int vhost_count;
+	char vhost[SHM_VHOSTS][64];
+	shm_vhost_cache vhost_cache[SHM_VHOST_CACHE];
+
+	time_t user_mtime;
+	time_t user_time;
+	pid_t user_builder;
+	int user_count;		/* ERROR while building or with too many users */
+	char user_dir[64];
+	shm_user user[SHM_USERS];
+
+	long notfound_hits;
+	shm_notfound notfound[SHM_NOTFOUND];
+
+	long memo_hits;
+	shm_memo memo[SHM_MEMO];
+
+	long flight_shared;
+	shm_flight flight[SHM_FLIGHTS];
+
+	off_t proxy_bytes;	/* Cached upstream responses (0 until counted) */
+
+	int tls_ticket_lock;
+	time_t tls_ticket_time;
+	unsigned char tls_ticket_keys[TLS_TICKET_KEYS];
+
+	pid_t watch_pid;	/* Change watcher (0 for none) */
+	time_t watch_time;	/* Last heartbeat of the watcher */
+	long watch_epoch;	/* Changes when a watcher starts or stops */
+	long watch_global;	/* Changes that may affect any path */
+	int watch_dirs;
+	char watch_root[256];
+	long watch_gen[WATCH_BUCKETS];	/* Changes in directories (by path hash) */
+} shm_state;
+
+#endif
+
 /* Struct for keeping the current options & state */
 typedef struct {
 
@@ -277,6 +896,10 @@ typedef struct {
 	char req_realpath[BUFSIZE];
 	char req_query_string[BUFSIZE];
 	char req_referrer[BUFSIZE];
+	char req_key[BUFSIZE];
+	char req_root[BUFSIZE];
+	int root_fd;
+	int req_fd;		/* The file resolve_path() checked (or ERROR) */
 	char req_local_addr[64];
 	char req_remote_addr[64];
 	char req_filetype;
@@ -286,6 +909,7 @@ typedef struct {
 	/* Output */
 	int out_width;
 	int out_charset;
+	off_t out_bytes;
 
 	/* Settings */
 	char server_description[64];
@@ -306,19 +930,72 @@ typedef struct {
 
 	char hidden[MAX_HIDDEN][256];
 	int hidden_count;
+	int page_size;
+	int menu_sort;
 
 	ftype filetype[MAX_FILETYPES];
 	int filetype_count;
 	char filter_dir[64];
+	char cache_dir[256];
+
+	sproxy proxy[MAX_PROXIES];
+	int proxy_count;
 
-	srewrite rewrite[MAX_REWRITE];
+	srewrite *rewrite;
 	int rewrite_count;
+	int rewrite_max;
+	int rewrite_regex;
+	snode *rewrite_trie;
+	int rewrite_nodes;
+	int rewrite_nodes_max;
 
 	/* Session */
 	int session_timeout;
 	int session_max_kbytes;
 	int session_max_hits;
 	int session_id;
+	int log_sample;
+
+	/* Statistics */
+	shm_state *shm;
+	long long req_start;
+	long long req_timer;
+	long req_usecs[PHASES];
+	int req_phases;
+	int req_kind;
+
+	/* Single-flight leader output capture */
+	int flight_slot;
+	long flight_gen;
+	char *flight_buf;
+	size_t flight_size;
+	size_t flight_max;
+	int flight_ok;
+
+	/* HTTP */
+	int http_version;
+	int http_status;
+	int http_keepalive;
+	int http_chunked;
+	int http_html;
+	int http_sent;
+	int http_done;
+	int *http_reuse;
+	off_t http_length;
+	time_t http_since;
+	time_t http_mtime;
+	char http_host[64];
+	char http_match[128];
+	char http_etag[64];
+	char http_mime[64];
+	char http_line[BUFSIZE];
+	size_t http_linelen;
+
+	/* TLS */
+	char tls_file[256];
+	SSL_CTX *tls_ctx;
+	SSL *tls;
+	int tls_ktls;
 
 	/* Feature options */
 	char opt_parent;
@@ -332,42 +1009,18 @@ typedef struct {
 	char opt_query;
 	char opt_caps;
 	char opt_shm;
+	char opt_cache;
 	char opt_root;
+	char opt_beneath;
+	char opt_keepalive;
+	char opt_index;
+	char opt_pack;
+	char opt_watch;
+	char opt_share;
+	char warm_source[256];
 	char debug;
 } state;
 
-/* Shared memory for session & accounting data */
-#ifdef HAVE_SHMEM
-
-#define SHM_KEY		0xbeeb0007	/* Unique identifier + struct version */
-#define SHM_MODE	0600		/* Access mode for the shared memory */
-#define SHM_SESSIONS	256		/* Max amount of user sessions to track */
-
-typedef struct {
-	long hits;
-	long kbytes;
-
-	time_t req_atime;
-	char req_selector[128];
-	char req_remote_addr[64];
-	char req_filetype;
-	int session_id;
-
-	char server_host[64];
-	int  server_port;
-} shm_session;
-
-typedef struct {
-	time_t start_time;
-	long hits;
-	long kbytes;
-	char server_platform[64];
-	char server_description[64];
-	shm_session session[SHM_SESSIONS];
-} shm_state;
-
-#endif
-
 /* Struct for directory sorting */
 typedef struct {
 	char	name[128];	/* Should be 256 but we're saving stack space */
@@ -378,6 +1031,12 @@ typedef struct {
 	time_t	mtime;
 } sdirent;
 
+/* Precomputed collation key for menu sorting */
+typedef struct {
+	unsigned long long key;
+	sdirent *dir;
+} skey;
+
 
 /* File suffix to gopher filetype mappings */
 #define FILETYPES \
@@ -399,6 +1058,22 @@ typedef struct {
 	"avi",";","mp4",";","mpg",";","mov",";","qt",";","asf",";","mpv",";","m4v",";", \
 	NULL, NULL
 
+/* File suffix to HTTP Content-Type mappings */
+#define MIMETYPES \
+	"gif","image/gif","jpg","image/jpeg","jpeg","image/jpeg","png","image/png", \
+	"svg","image/svg+xml","ico","image/x-icon","bmp","image/bmp","webp","image/webp", \
+	"tif","image/tiff","tiff","image/tiff", \
+	"html","text/html","htm","text/html","xhtml","application/xhtml+xml", \
+	"css","text/css","js","text/javascript","xml","application/xml", \
+	"rss","application/rss+xml","rdf","application/rdf+xml", \
+	"pdf","application/pdf","ps","application/postscript", \
+	"zip","application/zip","gz","application/gzip","tgz","application/gzip", \
+	"bz2","application/x-bzip2","tar","application/x-tar", \
+	"mp3","audio/mpeg","ogg","audio/ogg","wav","audio/wav","flac","audio/flac", \
+	"mid","audio/midi","mp4","video/mp4","avi","video/x-msvideo","mpg","video/mpeg", \
+	"mov","video/quicktime", \
+	NULL, NULL
+
 /*
  * Useful macros
  */
@@ -0,0 +1,589 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Take the virtual host from a Host: header or an absolute URL
+ */
+void http_hostname(state *st, char *host)
+{
+	char *c;
+
+	sstrlcpy(st->http_host, host);
+	if ((c = strchr(st->http_host, ':'))) *c = '\0';
+
+	/* Hostnames only - this ends up in a path */
+	for (c = st->http_host; *c; c++) {
+		if (isalnum((unsigned char) *c) || *c == '-' || (*c == '.' && c > st->http_host))
+			*c = tolower((unsigned char) *c);
+		else {
+			strclear(st->http_host);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Parse an HTTP request line & headers (the selector is replaced
+ * with the request target)
+ */
+void http_request(state *st, char *selector, size_t size)
+{
+	char buf[BUFSIZE];
+	char *target;
+	char *version;
+	char *c;
+	size_t bytes;
+	long length;
+	int ch;
+
+	/* Forget the previous request on this connection */
+	st->http_version = HTTP_09;
+	st->http_keepalive = FALSE;
+	st->http_since = 0;
+	strclear(st->http_host);
+	strclear(st->http_match);
+	length = 0;
+
+	/* METHOD target [HTTP/x.y] */
+	if ((target = strchr(selector, ' '))) target++;
+	else target = selector + strlen(selector);
+
+	if ((version = strchr(target, ' '))) {
+		*version++ = '\0';
+		if (sstrncmp(version, "HTTP/") == MATCH)
+			st->http_version = (strcmp(version, "HTTP/1.0") == MATCH) ? HTTP_10 : HTTP_11;
+	}
+
+	/* Proxies send absolute URLs */
+	if (strncasecmp(target, "http://", 7) == MATCH) {
+		target += 7;
+		sstrlcpy(buf, target);
+		if ((c = strchr(buf, '/'))) *c = '\0';
+		http_hostname(st, buf);
+
+		target += strlen(buf);
+		if (!*target) target = "/";
+	}
+	memmove(selector, target, strlen(target) + 1);
+
+	/* Headerless responses for HTTP/0.9 (& without a counting stdout) */
+#ifndef HAVE_SINK
+	st->http_version = HTTP_09;
+#endif
+	if (st->http_version < HTTP_10) return;
+
+	st->http_keepalive = (st->http_version >= HTTP_11);
+
+	/* Headers */
+	while (fgets(buf, sizeof(buf), stdin)) {
+
+		/* Skip the rest of overlong lines */
+		if (!strchr(buf, '\n')) while ((ch = getchar()) != EOF && ch != '\n');
+
+		chomp(buf);
+		if (!*buf) break;
+
+		if ((c = strkey(buf, "Host"))) http_hostname(st, c);
+		else if ((c = strkey(buf, "If-Modified-Since"))) st->http_since = strphttpdate(c);
+		else if ((c = strkey(buf, "If-None-Match"))) sstrlcpy(st->http_match, c);
+		else if ((c = strkey(buf, "Content-Length"))) length = atol(c);
+
+		/* Chunked request bodies can't be skipped */
+		else if ((c = strkey(buf, "Transfer-Encoding"))) st->http_keepalive = FALSE;
+
+		else if ((c = strkey(buf, "Connection"))) {
+			for (c = strtok(c, ", "); c; c = strtok(NULL, ", ")) {
+				if (strcasecmp(c, "close") == MATCH) st->http_keepalive = FALSE;
+				if (strcasecmp(c, "keep-alive") == MATCH) st->http_keepalive = TRUE;
+			}
+		}
+	}
+
+	/* Request bodies aren't used so throw them away */
+	while (length > 0) {
+		if ((bytes = fread(buf, 1, min(length, (long) sizeof(buf)), stdin)) == 0) break;
+		length -= bytes;
+	}
+
+	if (length > 0 || !st->opt_keepalive) st->http_keepalive = FALSE;
+
+	/* Userspace TLS state can't be shared by the per-request processes */
+	if (!sink_direct(st)) st->http_keepalive = FALSE;
+}
+
+
+/*
+ * Serve HTTP keep-alive connections with one child process per
+ * request (returns in the process that handles the request)
+ */
+void http_serve(state *st, char *selector, size_t size)
+{
+	pid_t pid;
+	int requests;
+	int status;
+	int fd;
+	int i;
+
+	http_request(st, selector, size);
+	timer_phase(st, PHASE_READ);
+	if (!st->http_keepalive) return;
+
+	/* Children tell us whether their response left the connection usable */
+#ifdef HAVE_MMAP
+	if ((st->http_reuse = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0)) == MAP_FAILED) {
+		st->http_reuse = NULL;
+		st->http_keepalive = FALSE;
+		return;
+	}
+#else
+	st->http_keepalive = FALSE;
+	return;
+#endif
+
+	/* Small responses shouldn't wait for the client's ACKs */
+#ifdef TCP_NODELAY
+	i = 1;
+	setsockopt(1, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+#endif
+
+	for (requests = 1;; requests++) {
+
+		/* The last request on a connection is served right here */
+		if (requests >= HTTP_REQUESTS) st->http_keepalive = FALSE;
+		if (!st->http_keepalive) return;
+
+		*st->http_reuse = FALSE;
+		fflush(stdout);
+
+		if ((pid = fork()) == 0) {
+
+			/* Scripts mustn't eat the following requests */
+			if ((fd = open("/dev/null", O_RDONLY)) != ERROR) {
+				dup2(fd, 0);
+				close(fd);
+			}
+			return;
+		}
+
+		if (pid == ERROR) {
+			st->http_keepalive = FALSE;
+			return;
+		}
+
+		while (waitpid(pid, &status, 0) == ERROR && errno == EINTR);
+		if (!*st->http_reuse) exit(EXIT_SUCCESS);
+
+		/* Wait for the next request (idle clients get disconnected) */
+		alarm(HTTP_TIMEOUT);
+		do {
+			if (fgets(selector, size - 1, stdin) == NULL) exit(EXIT_SUCCESS);
+			chomp(selector);
+		} while (!*selector);
+		alarm(0);
+
+		/* Time each request on its own */
+		st->req_start = monotime();
+		st->req_timer = st->req_start;
+		for (i = 0; i < PHASES; i++) st->req_usecs[i] = 0;
+		st->req_phases = 0;
+
+		if (st->debug) syslog(LOG_INFO, "client sent us \"%s\" (keep-alive)", selector);
+
+		if (sstrncmp(selector, "GET ") != MATCH &&
+		    sstrncmp(selector, "POST ") != MATCH) exit(EXIT_SUCCESS);
+
+		http_request(st, selector, size);
+		timer_phase(st, PHASE_READ);
+	}
+}
+
+
+/*
+ * Set the Content-Type of the response (before any output)
+ */
+void http_header(state *st, char *mimetype)
+{
+	if (st->http_sent) return;
+	sstrlcpy(st->http_mime, mimetype);
+}
+
+
+/*
+ * Guess the Content-Type from the selector suffix & gopher filetype
+ */
+void http_mimetype(state *st, char *out, size_t outsize)
+{
+	static const char *mimetypes[] = { MIMETYPES };
+	char *c;
+	int i;
+
+	/* Menus are converted to HTML */
+	if (st->req_filetype == TYPE_MENU || st->req_filetype == TYPE_QUERY) {
+		snprintf(out, outsize, "text/html; charset=%s", strcharset(st->out_charset));
+		st->http_html = TRUE;
+		return;
+	}
+
+	/* Known file suffixes */
+	if ((c = strrchr(st->req_selector, '.')) && !strchr(c, '/')) {
+		for (i = 0; mimetypes[i]; i += 2) {
+			if (strcasecmp(c + 1, mimetypes[i]) == MATCH) {
+				strlcpy(out, mimetypes[i + 1], outsize);
+				return;
+			}
+		}
+	}
+
+	/* Fall back to the gopher filetype */
+	if (st->req_filetype == TYPE_TEXT)
+		snprintf(out, outsize, "text/plain; charset=%s", strcharset(st->out_charset));
+	else if (st->req_filetype == TYPE_HTML) strlcpy(out, "text/html", outsize);
+	else if (st->req_filetype == TYPE_GIF) strlcpy(out, "image/gif", outsize);
+	else if (st->req_filetype == TYPE_MIME) strlcpy(out, "message/rfc822", outsize);
+	else strlcpy(out, HTTP_MIME, outsize);
+}
+
+
+/*
+ * Write to the client without stdio (returns ERROR if it went away)
+ */
+int http_writev(state *st, struct iovec *iov, int count)
+{
+	ssize_t bytes;
+
+#ifdef HAVE_TLS
+	if (!sink_direct(st)) return tls_writev(st, iov, count);
+#endif
+	while (count > 0) {
+		if ((bytes = writev(1, iov, count)) == ERROR) {
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+
+		/* Skip what got written & retry the rest */
+		while (count > 0 && (size_t) bytes >= iov->iov_len) {
+			bytes -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + bytes;
+			iov->iov_len -= bytes;
+		}
+	}
+
+	return OK;
+}
+
+
+/*
+ * Send a piece of the body as is or as one chunk
+ */
+size_t http_body(state *st, const char *buf, size_t size)
+{
+	struct iovec iov[3];
+	char head[32];
+
+	if (size == 0) return 0;
+	if (!st->http_chunked) return sink_raw(st, buf, size);
+
+	snprintf(head, sizeof(head), "%lx" CRLF, (unsigned long) size);
+	iov[0].iov_base = head;
+	iov[0].iov_len = strlen(head);
+	iov[1].iov_base = (char *) buf;
+	iov[1].iov_len = size;
+	iov[2].iov_base = CRLF;
+	iov[2].iov_len = 2;
+
+	if (http_writev(st, iov, 3) == ERROR) {
+		st->flight_ok = FALSE;
+		return 0;
+	}
+
+	st->out_bytes += size;
+	return size;
+}
+
+
+/*
+ * Send the response header (once, before the first byte of the body)
+ */
+void http_start(state *st)
+{
+	struct iovec iov;
+	char buf[BUFSIZE * 2];
+	char line[BUFSIZE];
+	char date[64];
+	char *reason;
+
+	if (st->http_version < HTTP_10 || st->http_sent) return;
+	st->http_sent = TRUE;
+
+	if (!*st->http_mime) http_mimetype(st, st->http_mime, sizeof(st->http_mime));
+
+	/* Without a length keep-alive needs chunks, otherwise the connection ends */
+	if (st->http_length == ERROR && st->http_status != HTTP_304) {
+		if (st->http_keepalive && st->http_version >= HTTP_11) st->http_chunked = TRUE;
+		else st->http_keepalive = FALSE;
+	}
+
+	/* Only bodies of unknown length are converted */
+	if (st->http_length != ERROR) st->http_html = FALSE;
+
+	switch (st->http_status) {
+		case HTTP_304: reason = "Not Modified"; break;
+		case HTTP_403: reason = "Forbidden"; break;
+		case HTTP_404: reason = "Not Found"; break;
+		case HTTP_500: reason = "Internal Server Error"; break;
+		default: reason = "OK";
+	}
+
+	strfhttpdate(date, time(NULL), sizeof(date));
+	snprintf(buf, sizeof(buf), "HTTP/1.1 %i %s" CRLF
+		"Date: %s" CRLF
+		"Server: " SERVER_SOFTWARE "/" VERSION CRLF,
+		st->http_status, reason, date);
+
+	if (st->http_status != HTTP_304) {
+		snprintf(line, sizeof(line), "Content-Type: %s" CRLF, st->http_mime);
+		sstrlcat(buf, line);
+
+		if (st->http_chunked) sstrlcat(buf, "Transfer-Encoding: chunked" CRLF);
+		else if (st->http_length != ERROR) {
+			snprintf(line, sizeof(line), "Content-Length: %lld" CRLF, (long long) st->http_length);
+			sstrlcat(buf, line);
+		}
+	}
+
+	/* Cache validators of static files */
+	if (*st->http_etag) {
+		snprintf(line, sizeof(line), "ETag: %s" CRLF, st->http_etag);
+		sstrlcat(buf, line);
+	}
+	if (st->http_mtime) {
+		strfhttpdate(date, st->http_mtime, sizeof(date));
+		snprintf(line, sizeof(line), "Last-Modified: %s" CRLF, date);
+		sstrlcat(buf, line);
+	}
+
+	sstrlcat(buf, st->http_keepalive ? "Connection: keep-alive" CRLF : "Connection: close" CRLF);
+	sstrlcat(buf, CRLF);
+
+	iov.iov_base = buf;
+	iov.iov_len = strlen(buf);
+	http_writev(st, &iov, 1);
+
+	/* Menus turn into a preformatted HTML page */
+	if (st->http_html) {
+		strnhtml(line, st->req_selector, sizeof(line));
+		snprintf(buf, sizeof(buf), "<!DOCTYPE html>\n<html>\n<head>\n"
+			"<meta charset=\"%s\">\n"
+			"<title>%s%s</title>\n"
+			"</head>\n<body>\n<pre>\n",
+			strcharset(st->out_charset), st->server_host, line);
+		http_body(st, buf, strlen(buf));
+	}
+}
+
+
+/*
+ * Convert one gopher menu line to HTML
+ */
+size_t html_line(state *st, char *line, char *out, size_t outsize)
+{
+	char display[BUFSIZE * 2];
+	char href[BUFSIZE * 2];
+	char url[BUFSIZE];
+	char sel[BUFSIZE];
+	char *field[4];
+	char type;
+	int len;
+	int i;
+
+	/* Tdisplay<TAB>selector<TAB>host<TAB>port */
+	chomp(line);
+	if (!*line || strcmp(line, ".") == MATCH) return 0;
+
+	type = *line;
+	field[0] = line + 1;
+	for (i = 1; i < 4; i++) {
+		if ((field[i] = strchr(field[i - 1], '\t'))) *field[i]++ = '\0';
+		else field[i] = EMPTY;
+	}
+
+	strnhtml(display, field[0], sizeof(display));
+
+	/* Plain text */
+	if (type == TYPE_INFO || type == TYPE_ERROR)
+		len = snprintf(out, outsize, "%s\n", display);
+
+	/* Links */
+	else {
+		len = 0;
+
+		if (type == TYPE_HTML && sstrncmp(field[1], "URL:") == MATCH)
+			sstrlcpy(url, field[1] + 4);
+
+		else if (type == '8' || type == 'T')
+			snprintf(url, sizeof(url), "telnet://%s:%i", field[2], atoi(field[3]));
+
+		/* Our own selectors are fetched over HTTP too */
+		else if (strcasecmp(field[2], st->server_host) == MATCH && atoi(field[3]) == st->server_port) {
+			strnurl(sel, field[1], sizeof(sel));
+			len = snprintf(url, sizeof(url), "%s%s", (*sel == '/') ? "" : "/", sel);
+		}
+
+		else {
+			strnurl(sel, field[1], sizeof(sel));
+			len = snprintf(url, sizeof(url), "gopher://%s:%i/%c%s", field[2], atoi(field[3]), type, sel);
+		}
+
+		/* A cut URL would point elsewhere - show the item as text */
+		if (len >= (int) sizeof(url))
+			len = snprintf(out, outsize, "%s\n", display);
+		else {
+			strnhtml(href, url, sizeof(href));
+			len = snprintf(out, outsize, "<a href=\"%s\">%s</a>\n", href, display);
+		}
+	}
+
+	if (len < 0) return 0;
+	return min((size_t) len, outsize - 1);
+}
+
+
+/*
+ * Write the response body, framed & converted for HTTP/1.x clients
+ */
+ssize_t http_write(state *st, const char *buf, size_t size)
+{
+	char out[HTTP_CHUNK];
+	size_t len;
+	size_t i;
+
+	http_start(st);
+	if (!st->http_html) return http_body(st, buf, size);
+
+	/* Menus are converted to HTML a line at a time */
+	for (len = 0, i = 0; i < size; i++) {
+		if (buf[i] != '\n') {
+			if (st->http_linelen < sizeof(st->http_line) - 1)
+				st->http_line[st->http_linelen++] = buf[i];
+			continue;
+		}
+
+		st->http_line[st->http_linelen] = '\0';
+		st->http_linelen = 0;
+
+		/* One chunk per buffer, not per line */
+		if (sizeof(out) - len < BUFSIZE * 6) {
+			if (http_body(st, out, len) < len) return 0;
+			len = 0;
+		}
+		len += html_line(st, st->http_line, out + len, sizeof(out) - len);
+	}
+
+	if (http_body(st, out, len) < len) return 0;
+	return size;
+}
+
+
+/*
+ * Answer conditional requests for unchanged files with 304 Not Modified
+ */
+void http_validate(state *st, struct stat *file)
+{
+	if (st->http_version < HTTP_10) return;
+
+	/* Text is converted to the output charset so that goes in too */
+	snprintf(st->http_etag, sizeof(st->http_etag), "\"%lx-%llx-%lx-%i\"",
+		(unsigned long) file->st_ino, (unsigned long long) file->st_size,
+		(unsigned long) file->st_mtime, st->out_charset);
+	st->http_mtime = file->st_mtime;
+
+	/* If-None-Match wins over If-Modified-Since */
+	if (*st->http_match) {
+		if (!strstr(st->http_match, st->http_etag) && strcmp(st->http_match, "*") != MATCH) return;
+	}
+	else if (st->http_since <= 0 || file->st_mtime > st->http_since) return;
+
+	if (st->debug) syslog(LOG_INFO, "file \"%s\" not modified", st->req_realpath);
+
+	st->http_status = HTTP_304;
+	finish(st);
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Finish the response & tell whether the connection can be reused
+ */
+void http_end(state *st)
+{
+	struct iovec iov;
+	char out[BUFSIZE * 8];
+	size_t len;
+
+	if (st->http_version < HTTP_10 || st->http_done) return;
+	fflush(stdout);
+
+	/* Nothing was sent - an empty body has a known length */
+	if (!st->http_sent && st->http_length == ERROR) st->http_length = 0;
+	http_start(st);
+
+	/* Close the HTML page */
+	if (st->http_html) {
+		len = 0;
+		if (st->http_linelen > 0) {
+			st->http_line[st->http_linelen] = '\0';
+			st->http_linelen = 0;
+			len = html_line(st, st->http_line, out, sizeof(out));
+		}
+
+		strlcpy(out + len, "</pre>\n</body>\n</html>\n", sizeof(out) - len);
+		http_body(st, out, strlen(out));
+	}
+
+	/* Last chunk */
+	if (st->http_chunked) {
+		iov.iov_base = "0" CRLF CRLF;
+		iov.iov_len = 5;
+		if (http_writev(st, &iov, 1) == ERROR) st->http_keepalive = FALSE;
+	}
+
+	/* Can the client send another request on this connection? */
+	if (st->http_reuse) {
+		*st->http_reuse = st->http_keepalive && (st->http_chunked ||
+			st->http_status == HTTP_304 || st->out_bytes == st->http_length);
+	}
+
+	st->http_done = TRUE;
+}
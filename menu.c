@@ -45,63 +45,379 @@ int foldersort(const void *a, const void *b)
 
 
 /*
- * Scan, stat and sort a directory folders first (scandir replacement)
+ * stat() one directory entry into a sdirent (relative to an open dir)
+ */
+int direntry(int fd, struct dirent *d, sdirent *entry)
+{
+	struct stat s;
+
+	if (fstatat(fd, d->d_name, &s, 0) == ERROR) return ERROR;
+
+	if (strlen(d->d_name) > sizeof(entry->name)) return ERROR;
+	sstrlcpy(entry->name, d->d_name);
+
+	entry->mode  = s.st_mode;
+	entry->uid   = s.st_uid;
+	entry->gid   = s.st_gid;
+	entry->size  = s.st_size;
+	entry->mtime = s.st_mtime;
+
+	return OK;
+}
+
+
+/*
+ * Scan and stat() a directory into a growing array (free() it after use)
  */
-int sortdir(char *path, sdirent *list, int max)
+int loaddir(char *path, sdirent **list)
 {
 	DIR *dp;
 	struct dirent *d;
-	struct stat s;
-	char buf[BUFSIZE];
+	sdirent *new;
+	int max;
 	int i;
 
 	/* Try to open the dir */
+	*list = NULL;
 	if ((dp = opendir(path)) == NULL) return 0;
-	i = 0;
+	max = i = 0;
 
 	/* Loop through the directory & stat() everything */
-	while (max--) {
-		if ((d = readdir(dp)) == NULL) break;
+	while ((d = readdir(dp))) {
 
-		snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
-		if (stat(buf, &s) == ERROR) continue;
-
-		if (strlen(d->d_name) > sizeof(list[i].name)) continue;
-		sstrlcpy(list[i].name, d->d_name);
+		/* Grow the array (out of memory truncates the listing) */
+		if (i == max) {
+			if (!(new = realloc(*list, sizeof(sdirent) * (max ? max * 2 : SDIRENT_ALLOC)))) break;
+			*list = new;
+			max = max ? max * 2 : SDIRENT_ALLOC;
+		}
 
-		list[i].mode  = s.st_mode;
-		list[i].uid   = s.st_uid;
-		list[i].gid   = s.st_gid;
-		list[i].size  = s.st_size;
-		list[i].mtime = s.st_mtime;
-		i++;
+		if (direntry(dirfd(dp), d, &(*list)[i]) == OK) i++;
 	}
 	closedir(dp);
 
+	/* Return number of entries found */
+	return i;
+}
+
+
+/*
+ * Scan, stat and sort a directory folders first (scandir replacement)
+ */
+int sortdir(char *path, sdirent **list)
+{
+	int num;
+
 	/* Sort the entries */
-	if (i > 1) qsort(list, i, sizeof(sdirent), foldersort);
+	num = loaddir(path, list);
+	if (num > 1) qsort(*list, num, sizeof(sdirent), foldersort);
 
 	/* Return number of entries found */
-	return i;
+	return num;
 }
 
 
 /*
- * Print a list of users with ~/public_gopher
+ * Compute the precomputed collation key of a directory entry
+ */
+unsigned long long dirkey(sdirent *dir, int order)
+{
+	unsigned long long key;
+	unsigned char *c;
+	int len;
+	int i;
+
+	/* Folders first */
+	key = ((dir->mode & S_IFMT) == S_IFDIR) ? 0 : SORT_KEY_FILE;
+
+	/* Newest first */
+	if (order == SORT_MTIME) {
+		if (dir->mtime <= 0) return key | SORT_KEY_MAX;
+		return key | (SORT_KEY_MAX - (unsigned long long) dir->mtime);
+	}
+
+	/* Smallest first */
+	if (order == SORT_SIZE) return key | (unsigned long long) dir->size;
+
+	/* Name prefix */
+	c = (unsigned char *) dir->name;
+
+	for (i = SORT_KEY_BYTES - 1; i >= 0 && *c; i--, c++) {
+
+		/* Natural order: the first number is '0', its length & digits */
+		if (order == SORT_NATURAL && *c >= '0' && *c <= '9') {
+			key |= (unsigned long long) '0' << (i * 8);
+
+			while (*c == '0') c++;
+			for (len = 0; c[len] >= '0' && c[len] <= '9'; len++);
+
+			if (--i >= 0) key |= (unsigned long long) (len > 255 ? 255 : len) << (i * 8);
+			while (--i >= 0 && *c >= '0' && *c <= '9')
+				key |= (unsigned long long) *c++ << (i * 8);
+			break;
+		}
+
+		key |= (unsigned long long) *c << (i * 8);
+	}
+
+	return key;
+}
+
+
+/*
+ * Compare sort keys (ties sorted by name)
+ */
+int keysort(const void *a, const void *b)
+{
+	const skey *ka = a;
+	const skey *kb = b;
+
+	if (ka->key < kb->key) return -1;
+	if (ka->key > kb->key) return 1;
+
+	return strcmp(ka->dir->name, kb->dir->name);
+}
+
+
+/*
+ * Compare sort keys (ties sorted by name in natural order)
+ */
+int keysort_natural(const void *a, const void *b)
+{
+	const skey *ka = a;
+	const skey *kb = b;
+	int i;
+
+	if (ka->key < kb->key) return -1;
+	if (ka->key > kb->key) return 1;
+
+	/* "file010" & "file10" are equal - keep the order stable */
+	if ((i = strnatcmp(ka->dir->name, kb->dir->name)) != 0) return i;
+	return strcmp(ka->dir->name, kb->dir->name);
+}
+
+
+/*
+ * LSD radix sort of sort keys (ties are left in input order)
+ */
+int radixsort(skey *list, int num)
+{
+	skey *tmp;
+	skey *src;
+	skey *dst;
+	skey *swap;
+	int count[256];
+	int shift;
+	int sum;
+	int n;
+	int i;
+
+	if (!(tmp = malloc(sizeof(skey) * num))) return ERROR;
+	src = list;
+	dst = tmp;
+
+	for (shift = 0; shift < 64; shift += 8) {
+
+		/* Count keys per byte value */
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < num; i++) count[(src[i].key >> shift) & 0xff]++;
+
+		/* Skip bytes that are the same for every key */
+		if (count[(src[0].key >> shift) & 0xff] == num) continue;
+
+		/* Convert counts to offsets & scatter */
+		for (sum = i = 0; i < 256; i++) {
+			n = count[i];
+			count[i] = sum;
+			sum += n;
+		}
+
+		for (i = 0; i < num; i++) dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != list) memcpy(list, src, sizeof(skey) * num);
+	free(tmp);
+	return OK;
+}
+
+
+/*
+ * Sort keys with radix sort and then resolve ties
+ */
+void keyradixsort(skey *list, int num, int (*cmp)(const void *, const void *))
+{
+	int first;
+	int i;
+
+	/* Out of memory - fall back to qsort() */
+	if (radixsort(list, num) == ERROR) {
+		qsort(list, num, sizeof(skey), cmp);
+		return;
+	}
+
+	/* Sort runs of equal keys by name */
+	for (first = 0, i = 1; i <= num; i++) {
+		if (i < num && list[i].key == list[first].key) continue;
+		if ((i - first) > 1) qsort(list + first, i - first, sizeof(skey), cmp);
+		first = i;
+	}
+}
+
+
+/*
+ * Swap two sort keys
+ */
+void keyswap(skey *a, skey *b)
+{
+	skey tmp;
+
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+
+/*
+ * Move the kth key in sort order to list[k] (quickselect)
+ */
+void keyselect(skey *list, int num, int k, int (*cmp)(const void *, const void *))
+{
+	int left;
+	int right;
+	int mid;
+	int i;
+	int j;
+
+	left = 0;
+	right = num - 1;
+
+	while (right > left) {
+
+		/* Median of three as the pivot (moved to list[left]) */
+		mid = left + (right - left) / 2;
+		if (cmp(&list[mid], &list[right]) > 0) keyswap(&list[mid], &list[right]);
+		if (cmp(&list[left], &list[right]) > 0) keyswap(&list[left], &list[right]);
+		if (cmp(&list[mid], &list[left]) > 0) keyswap(&list[mid], &list[left]);
+
+		/* Partition around the pivot */
+		i = left;
+		j = right + 1;
+
+		for (;;) {
+			while (cmp(&list[++i], &list[left]) < 0) if (i == right) break;
+			while (cmp(&list[left], &list[--j]) < 0) if (j == left) break;
+			if (i >= j) break;
+
+			keyswap(&list[i], &list[j]);
+		}
+
+		keyswap(&list[left], &list[j]);
+
+		/* Continue on the side with the kth key */
+		if (j == k) return;
+		if (j > k) right = j - 1;
+		else left = j + 1;
+	}
+}
+
+
+/*
+ * Sort only keys first..last-1 into their final positions
+ */
+void sortrange(skey *list, int num, int first, int last, int (*cmp)(const void *, const void *))
+{
+	/* Full sorts of big dirs are done in linear time */
+	if (first == 0 && last == num && num >= RADIX_MIN) {
+		keyradixsort(list, num, cmp);
+		return;
+	}
+
+	/* Everything before first is smaller, everything after last bigger */
+	if (first > 0 && first < num) keyselect(list, num, first, cmp);
+	if (last < num && last > first) keyselect(list + first, num - first, last - first, cmp);
+
+	/* Then sort the page itself */
+	if ((last - first) > 1) qsort(list + first, last - first, sizeof(skey), cmp);
+}
+
+
+/*
+ * Handle a gophermap @option=value line
+ */
+void menu_option(state *st, char *option)
+{
+	if (sstrncmp(option, "pagesize=") == MATCH) {
+		st->page_size = abs(atoi(option + 9));
+		return;
+	}
+
+	if (sstrncmp(option, "sort=") == MATCH) {
+		if (strcmp(option + 5, "none") == MATCH) st->menu_sort = SORT_NONE;
+		if (strcmp(option + 5, "name") == MATCH) st->menu_sort = SORT_NAME;
+		if (strcmp(option + 5, "natural") == MATCH) st->menu_sort = SORT_NATURAL;
+		if (strcmp(option + 5, "mtime") == MATCH) st->menu_sort = SORT_MTIME;
+		if (strcmp(option + 5, "size") == MATCH) st->menu_sort = SORT_SIZE;
+		return;
+	}
+}
+
+
+/*
+ * Print one user with ~/public_gopher
  */
 #ifdef HAVE_PASSWD
-void userlist(state *st)
+void userlist_item(state *st, struct passwd *pwd, time_t mtime)
 {
-	struct passwd *pwd;
-	struct stat dir;
 	char buf[BUFSIZE];
-	struct tm *ltime;
 	char timestr[20];
 	int width;
 
 	/* Width of filenames for fancy listing */
 	width = st->out_width - DATE_WIDTH - 15;
 
+	snprintf(buf, sizeof(buf), USERDIR_FORMAT);
+
+	if (st->opt_date) {
+		strfdate(timestr, mtime, sizeof(timestr));
+
+		printf("1%-*.*s   %s        -  \t/~%s/\t%s\t%i" CRLF,
+			width, width, buf, timestr, pwd->pw_name,
+			st->server_host, st->server_port);
+	}
+	else {
+		printf("1%.*s\t/~%s/\t%s\t%i" CRLF, st->out_width, buf,
+			pwd->pw_name, st->server_host_default, st->server_port);
+	}
+}
+#endif
+
+
+/*
+ * Print a list of users with ~/public_gopher
+ */
+#ifdef HAVE_PASSWD
+void userlist(state *st)
+{
+	struct passwd *pwd;
+	struct stat dir;
+	char buf[BUFSIZE];
+#ifdef HAVE_SHMEM
+	int i;
+
+	/* Use the shared userdir index if possible */
+	if (st->shm && user_index_ok(st, st->shm)) {
+		for (i = 0; i < st->shm->user_count; i++) {
+			pwd = user_entry(st->shm, i);
+			userlist_item(st, pwd, st->shm->user[i].mtime);
+		}
+		return;
+	}
+#endif
+
 	/* Loop through all users */
 	setpwent();
 	while ((pwd = getpwent())) {
@@ -116,20 +432,7 @@ void userlist(state *st)
 		if (dir.st_uid != pwd->pw_uid) continue;
 
 		/* Found one */
-		snprintf(buf, sizeof(buf), USERDIR_FORMAT);
-
-		if (st->opt_date) {
-			ltime = localtime(&dir.st_mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
-
-			printf("1%-*.*s   %s        -  \t/~%s/\t%s\t%i" CRLF,
-				width, width, buf, timestr, pwd->pw_name,
-				st->server_host, st->server_port);
-		}
-		else {
-			printf("1%.*s\t/~%s/\t%s\t%i" CRLF, st->out_width, buf,
-				pwd->pw_name, st->server_host_default, st->server_port);
-		}
+		userlist_item(st, pwd, dir.st_mtime);
 	}
 
 	endpwent();
@@ -142,8 +445,7 @@ void userlist(state *st)
  */
 void vhostlist(state *st)
 {
-	sdirent dir[MAX_SDIRENT];
-	struct tm *ltime;
+	sdirent *dir;
 	char timestr[20];
 	char buf[BUFSIZE];
 	int width;
@@ -151,7 +453,7 @@ void vhostlist(state *st)
 	int i;
 
 	/* Scan the root dir for vhost dirs */
-	num = sortdir(st->server_root, dir, MAX_SDIRENT);
+	num = sortdir(st->server_root, &dir);
 	if (num < 0) die(st, ERR_NOTFOUND, "WTF?");
 
 	/* Width of filenames for fancy listing */
@@ -175,8 +477,7 @@ void vhostlist(state *st)
 
 		/* Fancy listing */
 		if (st->opt_date) {
-			ltime = localtime(&dir[i].mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
+			strfdate(timestr, dir[i].mtime, sizeof(timestr));
 
 			printf("1%-*.*s   %s        -  \t/;%s\t%s\t%i" CRLF,
 				width, width, buf, timestr, dir[i].name, 
@@ -189,6 +490,8 @@ void vhostlist(state *st)
 				dir[i].name, dir[i].name, st->server_port);
 		}
 	}
+
+	free(dir);
 }
 
 
@@ -262,202 +565,782 @@ char gopher_filetype(state *st, char *file, char magic)
 
 
 /*
- * Handle gophermaps
+ * Reserve an aligned record at the end of a compiled gophermap buffer
  */
-int gophermap(state *st, char *mapfile, int depth)
+void *map_alloc(state *st, smap *map, size_t len)
 {
-	FILE *fp;
-	struct stat file;
-	char line[BUFSIZE];
-#ifdef HAVE_POPEN
-	char command[BUFSIZE];
+	char *data;
+	size_t max;
+
+	len = (len + MAP_ALIGN - 1) & ~((size_t) MAP_ALIGN - 1);
+
+	/* Grow the buffer */
+	if (map->size + len > map->max) {
+		for (max = map->max ? map->max : MAP_ALLOC; max < map->size + len; max *= 2);
+
+		if (!(data = realloc(map->data, max))) die(st, ERR_NOTFOUND, NULL);
+		map->data = data;
+		map->max = max;
+	}
+
+	data = map->data + map->size;
+	memset(data, 0, len);
+	map->size += len;
+	return data;
+}
+
+
+/*
+ * Append one instruction with up to three strings to a compiled gophermap
+ */
+void map_op(state *st, smap *map, char op, char type, char flags, int port, char *a, char *b, char *c)
+{
+	smaprec *rec;
+	char *str[3];
+	size_t len[3];
+	size_t size;
+	char *out;
+	int i;
+
+	str[0] = a;
+	str[1] = b;
+	str[2] = c;
+
+	size = sizeof(smaprec);
+	for (i = 0; i < 3; i++) size += (len[i] = str[i] ? strlen(str[i]) + 1 : 0);
+
+	/* Store the strings right after the record */
+	rec = map_alloc(st, map, size);
+	rec->len = (char *) map->data + map->size - (char *) rec;
+	rec->port = port;
+	rec->op = op;
+	rec->type = type;
+	rec->flags = flags;
+
+	out = (char *) (rec + 1);
+	for (i = 0; i < 3; i++) {
+		if (len[i]) memcpy(out, str[i], len[i]);
+		out += len[i];
+	}
+}
+
+
+/*
+ * Remember a file a compiled gophermap depends on
+ */
+void map_dep(state *st, smap *map, char *path, struct stat *file)
+{
+	smapdep *dep;
+	size_t len;
+
+	len = strlen(path) + 1;
+	dep = map_alloc(st, map, sizeof(smapdep) + len);
+	dep->len = (char *) map->data + map->size - (char *) dep;
+
+	dep->mtime = file->st_mtime;
+	dep->ctime = file->st_ctime;
+	dep->size = file->st_size;
+	dep->ino = file->st_ino;
+	dep->dev = file->st_dev;
+	memcpy(dep + 1, path, len);
+}
+
+
+/*
+ * Free a compiled or mapped gophermap
+ */
+void map_free(smap *map)
+{
+	if (!map->data) return;
+
+#ifdef HAVE_MMAP
+	if (map->mapped) munmap(map->data, map->size);
+	else
 #endif
+		free(map->data);
+
+	map->data = NULL;
+}
+
+
+/*
+ * Compile one gophermap line, return QUIT at the end of the map
+ */
+int map_line(state *st, char *line, smap *ops, smap *deps, int depth, int top)
+{
+	FILE *inc;
+	struct stat file;
+	char path[PATH_MAX];
 	char *selector;
 	char *name;
 	char *host;
 	char *c;
+	char flags;
 	char type;
 	int port;
-	int exe;
 
-	/* Prevent include loops */
-	if (depth > 4) return OK;
+	/* Parse type & name */
+	chomp(line);
+	type = line[0];
+	name = line + 1;
 
-	/* Try to figure out whether the map is executable */
-	if (stat(mapfile, &file) == OK) {
-		if ((file.st_mode & S_IXOTH)) {
-#ifdef HAVE_POPEN
-			/* Quote the command in case path has spaces */
-			snprintf(command, sizeof(command), "'%s'", mapfile);
-#endif
-			exe = TRUE;
-		}
-		else exe = FALSE;
+	/* Ignore #comments */
+	if (type == '#') return OK;
+
+	/* Stop handling gophermap? (an include just ends) */
+	if (type == '*' || type == '.') {
+		if (top) map_op(st, ops, (type == '*') ? MAP_STOP : MAP_QUIT, 0, 0, 0, NULL, NULL, NULL);
+		return QUIT;
 	}
 
-	/* This must be a shell include */
-	else {
-#ifdef HAVE_POPEN
-		/* Let's assume the shell command runs as is without quoting */
-		sstrlcpy(command, mapfile);
-#endif
-		exe = TRUE;
+	/* Print a list of users with public_gopher */
+	if (type == '~') {
+		map_op(st, ops, MAP_USERS, 0, 0, 0, NULL, NULL, NULL);
+		return OK;
 	}
 
-	/* Debug output */
-	if (st->debug) {
-		if (exe) syslog(LOG_INFO, "parsing executable gophermap \"%s\"", mapfile);
-		else syslog(LOG_INFO, "parsing static gophermap \"%s\"", mapfile);
+	/* Print a list of available virtual hosts */
+	if (type == '%') {
+		map_op(st, ops, MAP_VHOSTS, 0, 0, 0, NULL, NULL, NULL);
+		return OK;
 	}
 
-	/* Try to execute or open the mapfile */
-#ifdef HAVE_POPEN
-	if (exe) {
-		setenv_cgi(st, mapfile);
-		if ((fp = popen(command, "r")) == NULL) return OK;
+	/* Hide files in menus */
+	if (type == '-') {
+		map_op(st, ops, MAP_HIDE, 0, 0, 0, name, NULL, NULL);
+		return OK;
 	}
-	else
-#endif
-		if ((fp = fopen(mapfile, "r")) == NULL) return OK;
 
-	/* Read lines one by one */
-	while (fgets(line, sizeof(line) - 1, fp)) {
+	/* Override filetype mappings */
+	if (type == ':') {
+		map_op(st, ops, MAP_FTYPE, 0, 0, 0, name, NULL, NULL);
+		return OK;
+	}
 
-		/* Parse type & name */
-		chomp(line);
-		type = line[0];
-		name = line + 1;
+	/* Menu options */
+	if (type == '@') {
+		map_op(st, ops, MAP_OPTION, 0, 0, 0, name, NULL, NULL);
+		return OK;
+	}
 
-		/* Ignore #comments */
-		if (type == '#') continue;
+	/* Include gophermap or shell exec */
+	if (type == '=') {
+		if (depth + 1 > MAP_DEPTH) return OK;
 
-		/* Stop handling gophermap? */
-		if (type == '*') return OK;
-		if (type == '.') return QUIT;
+		/* Static gophermaps are compiled in place */
+		if (stat(name, &file) == OK && !(file.st_mode & S_IXOTH)) {
+			if (st->debug) syslog(LOG_INFO, "compiling static gophermap \"%s\"", name);
 
-		/* Print a list of users with public_gopher */
-		if (type == '~') {
-#ifdef HAVE_PASSWD
-			userlist(st);
-#endif
-			continue;
-		}
+			if (!realpath(name, path)) sstrlcpy(path, name);
+			map_dep(st, deps, path, &file);
 
-		/* Print a list of available virtual hosts */
-		if (type == '%') {
-			if (st->opt_vhost) vhostlist(st);
-			continue;
+			if ((inc = fopen(name, "r"))) {
+				map_compile(st, inc, ops, deps, depth + 1, FALSE);
+				fclose(inc);
+			}
 		}
 
-		/* Hide files in menus */
-		if (type == '-') {
-			if (st->hidden_count < MAX_HIDDEN)
-				sstrlcpy(st->hidden[st->hidden_count++], name);
-			continue;
-		}
+		/* Executables & shell commands run at request time */
+		else map_op(st, ops, MAP_EXEC, 0, 0, depth + 1, name, NULL, NULL);
+		return OK;
+	}
 
-		/* Override filetype mappings */
-		if (type == ':') {
-			add_ftype_mapping(st, name);
-			continue;
-		}
+	/* Title resource */
+	if (type == TYPE_TITLE) {
+		map_op(st, ops, MAP_TITLE, 0, 0, 0, name, NULL, NULL);
+		return OK;
+	}
 
-		/* Include gophermap or shell exec */
-		if (type == '=') {
-			gophermap(st, name, depth + 1);
-			continue;
-		}
+	/* Print out non-resources as info text */
+	if (!strchr(line, '\t')) {
+		map_op(st, ops, MAP_INFO, 0, 0, 0, line, NULL, NULL);
+		return OK;
+	}
 
-		/* Title resource */
-		if (type == TYPE_TITLE) {
-			info(st, name, TYPE_TITLE);
-			continue;
-		}
+	/* Parse selector */
+	selector = EMPTY;
+	if ((c = strchr(name, '\t'))) {
+		*c = '\0';
+		selector = c + 1;
+	}
+	if (!*selector) selector = name;
+
+	/* Parse host */
+	flags = 0;
+	host = EMPTY;
+	if ((c = strchr(selector, '\t'))) {
+		*c = '\0';
+		host = c + 1;
+		flags |= MAP_HOST;
+	}
 
-		/* Print out non-resources as info text */
-		if (!strchr(line, '\t')) {
-			info(st, line, TYPE_INFO);
-			continue;
-		}
+	/* Parse port */
+	port = 0;
+	if ((c = strchr(host, '\t'))) {
+		*c = '\0';
+		port = atoi(c + 1);
+		flags |= MAP_PORT;
+	}
 
-		/* Parse selector */
-		selector = EMPTY;
-		if ((c = strchr(name, '\t'))) {
-			*c = '\0';
-			selector = c + 1;
-		}
-		if (!*selector) selector = name;
+	/* Remote, absolute and hURL gopher resources are output as is */
+	if (sstrncmp(selector, "URL:") == MATCH ||
+	    selector[0] == '/' ||
+	    (flags & MAP_HOST)) flags |= MAP_ABSOLUTE;
 
-		/* Parse host */
-		host = st->server_host;
-		if ((c = strchr(selector, '\t'))) {
-			*c = '\0';
-			host = c + 1;
-		}
+	map_op(st, ops, MAP_ITEM, type, flags, port, name, selector, host);
+	return OK;
+}
 
-		/* Parse port */
-		port = st->server_port;
-		if ((c = strchr(host, '\t'))) {
-			*c = '\0'; 
-			port = atoi(c + 1);
-		}
 
-		/* Handle remote, absolute and hURL gopher resources */
-		if (sstrncmp(selector, "URL:") == MATCH ||
-		    selector[0] == '/' ||
-		    host != st->server_host) {
+/*
+ * Compile a gophermap into instructions, inlining static includes
+ */
+void map_compile(state *st, FILE *fp, smap *ops, smap *deps, int depth, int top)
+{
+	char line[BUFSIZE];
+
+	while (fgets(line, sizeof(line) - 1, fp))
+		if (map_line(st, line, ops, deps, depth, top) == QUIT) return;
+}
 
-			printf("%c%s\t%s\t%s\t%i" CRLF, type, name,
-				selector, host, port);
-		}
 
-		/* Handle relative resources */
-		else {
-			printf("%c%s\t%s%s\t%s\t%i" CRLF, type, name,
-				st->req_selector, selector, host, port);
+/*
+ * Output a compiled gophermap
+ */
+int map_run(state *st, char *data, size_t size)
+{
+	smaprec *rec;
+	char buf[BUFSIZE];
+	char *selector;
+	char *name;
+	char *host;
+	char *end;
+	int port;
+
+	for (end = data + size; data < end; data += rec->len) {
+		rec = (smaprec *) data;
+		name = (char *) (rec + 1);
+
+		switch (rec->op) {
+			case MAP_INFO: info(st, name, TYPE_INFO); break;
+			case MAP_TITLE: info(st, name, TYPE_TITLE); break;
+#ifdef HAVE_PASSWD
+			case MAP_USERS: userlist(st); break;
+#endif
+			case MAP_VHOSTS: if (st->opt_vhost) vhostlist(st); break;
+			case MAP_OPTION: menu_option(st, name); break;
+			case MAP_EXEC: gophermap(st, name, rec->port); break;
+			case MAP_STOP: return OK;
+			case MAP_QUIT: return QUIT;
+
+			/* Hide files in menus */
+			case MAP_HIDE:
+				if (st->hidden_count < MAX_HIDDEN)
+					sstrlcpy(st->hidden[st->hidden_count++], name);
+				break;
+
+			/* Override filetype mappings (modifies its argument) */
+			case MAP_FTYPE:
+				sstrlcpy(buf, name);
+				add_ftype_mapping(st, buf);
+				break;
+
+			/* Resources */
+			case MAP_ITEM:
+				selector = name + strlen(name) + 1;
+				host = selector + strlen(selector) + 1;
+
+				if (!(rec->flags & MAP_HOST)) host = st->server_host;
+				port = (rec->flags & MAP_PORT) ? rec->port : st->server_port;
+
+				/* Handle remote, absolute and hURL gopher resources */
+				if (rec->flags & MAP_ABSOLUTE) {
+					printf("%c%s\t%s\t%s\t%i" CRLF, rec->type, name,
+						selector, host, port);
+					break;
+				}
+
+				/* Handle relative resources */
+				printf("%c%s\t%s%s\t%s\t%i" CRLF, rec->type, name,
+					st->req_selector, selector, host, port);
 
-			/* Automatically hide manually defined selectors */
+				/* Automatically hide manually defined selectors */
 #ifdef ENABLE_AUTOHIDING
-			if (st->hidden_count < MAX_HIDDEN)
-				sstrlcpy(st->hidden[st->hidden_count++], selector);
+				if (st->hidden_count < MAX_HIDDEN)
+					sstrlcpy(st->hidden[st->hidden_count++], selector);
 #endif
+				break;
 		}
 	}
 
-	/* Clean up & return */
+	return QUIT;
+}
+
+
+/*
+ * Output a gophermap while reading it, a line at a time (for maps that aren't reused)
+ */
+int map_stream(state *st, FILE *fp, int depth)
+{
+	char line[BUFSIZE];
+	smap ops;
+	smap deps;
+	int end;
+	int ret;
+
+	memset(&ops, 0, sizeof(ops));
+	memset(&deps, 0, sizeof(deps));
+	ret = QUIT;
+
+	while (fgets(line, sizeof(line) - 1, fp)) {
+		ops.size = deps.size = 0;
+		end = map_line(st, line, &ops, &deps, depth, TRUE);
+
+		/* The end of the map leaves a MAP_STOP or MAP_QUIT to run */
+		if (ops.size) ret = map_run(st, ops.data, ops.size);
+		if (end == QUIT) break;
+		ret = QUIT;
+	}
+
+	map_free(&ops);
+	map_free(&deps);
+	return ret;
+}
+
+
+/*
+ * Load or compile a static gophermap, return ERROR if it can't be read
+ */
+int map_get(state *st, char *mapfile, struct stat *file, int depth, smap *ops)
+{
+	FILE *fp;
+	smap deps;
+	int cache;
+
+	/* Top-level maps can be compiled once & reused */
+	cache = (depth == 0 && *st->cache_dir && *mapfile == '/');
+
+	if (cache && map_load(st, mapfile, file, ops) == OK) {
+		if (st->debug) syslog(LOG_INFO, "using compiled gophermap \"%s\"", mapfile);
+		return OK;
+	}
+
+	if (st->debug) syslog(LOG_INFO, "parsing static gophermap \"%s\"", mapfile);
+	if ((fp = fopen(mapfile, "r")) == NULL) return ERROR;
+
+	/* Compile the map (the map itself is the first dependency) */
+	memset(ops, 0, sizeof(smap));
+	memset(&deps, 0, sizeof(deps));
+
+	if (cache) map_dep(st, &deps, mapfile, file);
+	map_compile(st, fp, ops, &deps, depth, TRUE);
+	fclose(fp);
+
+	if (cache) map_save(st, mapfile, &deps, ops);
+	map_free(&deps);
+
+	return OK;
+}
+
+
+/*
+ * Apply the hides of a static gophermap without outputting anything,
+ * return ERROR if a program decides some of them at request time
+ */
+int map_hidden(state *st, char *mapfile)
+{
+	struct stat file;
+	smaprec *rec;
+	smap ops;
+	char *end;
+	char *c;
+	int ret;
+
+	if (stat(mapfile, &file) == ERROR) return OK;
+	if ((file.st_mode & S_IXOTH)) return ERROR;
+	if (map_get(st, mapfile, &file, 0, &ops) == ERROR) return OK;
+
+	ret = OK;
+	end = ops.data + ops.size;
+	for (c = ops.data + ops.start; c < end; c += rec->len) {
+		rec = (smaprec *) c;
+
+		if (rec->op == MAP_HIDE && st->hidden_count < MAX_HIDDEN)
+			sstrlcpy(st->hidden[st->hidden_count++], (char *) (rec + 1));
+		if (rec->op == MAP_EXEC) ret = ERROR;
+	}
+
+	map_free(&ops);
+	return ret;
+}
+
+
+/*
+ * Handle gophermaps
+ */
+int gophermap(state *st, char *mapfile, int depth)
+{
+	struct stat file;
+	smap ops;
+	FILE *fp;
 #ifdef HAVE_POPEN
-	if (exe) pclose(fp);
-	else
+	char command[BUFSIZE];
+#endif
+	int exe;
+	int ret;
+
+	/* Prevent include loops */
+	if (depth > MAP_DEPTH) return OK;
+
+	/* Try to figure out whether the map is executable */
+	if (stat(mapfile, &file) == OK) {
+		if ((file.st_mode & S_IXOTH)) {
+#ifdef HAVE_POPEN
+			/* Quote the command in case path has spaces */
+			snprintf(command, sizeof(command), "'%s'", mapfile);
+#endif
+			exe = TRUE;
+		}
+		else exe = FALSE;
+	}
+
+	/* This must be a shell include */
+	else {
+#ifdef HAVE_POPEN
+		/* Let's assume the shell command runs as is without quoting */
+		sstrlcpy(command, mapfile);
+#endif
+		exe = TRUE;
+	}
+
+	/* Executable maps are output as they run */
+#ifdef HAVE_POPEN
+	if (exe) {
+		if (st->debug) syslog(LOG_INFO, "parsing executable gophermap \"%s\"", mapfile);
+		setenv_cgi(st, mapfile);
+
+		/* Output of programs may differ per client */
+#ifdef HAVE_SHMEM
+		flight_abandon(st);
+#endif
+
+		/* Scripts expect the default SIGPIPE behaviour */
+		signal(SIGPIPE, SIG_DFL);
+		fp = popen(command, "r");
+		signal(SIGPIPE, SIG_IGN);
+
+		if (fp == NULL) return OK;
+
+		ret = map_stream(st, fp, depth);
+		pclose(fp);
+		return ret;
+	}
 #endif
+
+	/* Without a compiled copy to keep, compiling it all first is just overhead */
+	if (depth > 0 || !*st->cache_dir || *mapfile != '/') {
+		if (st->debug) syslog(LOG_INFO, "parsing static gophermap \"%s\"", mapfile);
+		if ((fp = fopen(mapfile, "r")) == NULL) return OK;
+
+		ret = map_stream(st, fp, depth);
 		fclose(fp);
+		return ret;
+	}
 
-	return QUIT;
+	if (map_get(st, mapfile, &file, depth, &ops) == ERROR) return OK;
+
+	/* Output it */
+	ret = map_run(st, ops.data + ops.start, ops.size - ops.start);
+	map_free(&ops);
+
+	return ret;
 }
 
 
 /*
- * Handle gopher menus
+ * Read the first line of a gophertag through an open directory
  */
-void gopher_menu(state *st)
+int dirtag(state *st, int fd, char *name, char *out, size_t outsize)
 {
-	FILE *fp;
-	sdirent dir[MAX_SDIRENT];
-	struct tm *ltime;
 	struct stat file;
+	char buf[BUFSIZE];
+	char *c;
+	int tag;
+	int n;
+
+	/* Most folders have no tag - make that a single failing openat() */
+	snprintf(buf, sizeof(buf), "%s/%s", name, st->tag_file);
+	if ((tag = openat(fd, buf, O_RDONLY | O_NONBLOCK | O_NOCTTY)) == ERROR) return ERROR;
+
+	/* Only regular files are tags */
+	if (fstat(tag, &file) == ERROR || (file.st_mode & S_IFMT) != S_IFREG) {
+		close(tag);
+		return ERROR;
+	}
+
+	n = read(tag, buf, sizeof(buf) - 1);
+	close(tag);
+	if (n < 0) return ERROR;
+
+	/* Keep the first line only */
+	buf[n] = '\0';
+	if ((c = strchr(buf, '\n'))) *c = '\0';
+	chomp(buf);
+
+	strlcpy(out, buf, outsize);
+	return OK;
+}
+
+
+/*
+ * Check whether a directory entry should be listed in menus
+ */
+int menu_visible(state *st, sdirent *dir)
+{
+	int n;
+
+	/* Skip dotfiles and non world-readables */
+	if (dir->name[0] == '.') return FALSE;
+	if ((dir->mode & S_IROTH) == 0) return FALSE;
+
+	/* Skip gophermaps and tags (but not dirs) */
+	if ((dir->mode & S_IFMT) != S_IFDIR) {
+		if (strcmp(dir->name, st->map_file) == MATCH) return FALSE;
+		if (strcmp(dir->name, st->tag_file) == MATCH) return FALSE;
+	}
+
+	/* Skip files marked for hiding */
+	for (n = 0; n < st->hidden_count; n++)
+		if (strcmp(dir->name, st->hidden[n]) == MATCH) break;
+	if (n < st->hidden_count) return FALSE;	/* Cruel hack... */
+
+	/* Skip special files (sockets, fifos etc) */
+	if ((dir->mode & S_IFMT) != S_IFDIR &&
+	    (dir->mode & S_IFMT) != S_IFREG) return FALSE;
+
+	return TRUE;
+}
+
+
+/*
+ * Print one directory entry as a menu item
+ */
+void menu_item(state *st, int fd, sdirent *dir, int width)
+{
 	char buf[BUFSIZE];
 	char pathname[BUFSIZE];
 	char displayname[BUFSIZE];
 	char encodedname[BUFSIZE];
 	char timestr[20];
 	char sizestr[20];
+	char type;
+	int n;
+
+
+	/* Get full path+name (items that don't fit are left out) */
+	if (snprintf(pathname, sizeof(pathname), "%s/%s",
+		st->req_realpath, dir->name) >= (int) sizeof(pathname)) return;
+
+	/* Generate display name with correct output charset */
+	if (st->opt_iconv)
+		sstrniconv(st->out_charset, displayname, dir->name);
+	else
+		sstrlcpy(displayname, dir->name);
+
+	/* #OCT-encode filename */
+	strnencode(encodedname, dir->name, sizeof(encodedname));
+
+	/* Handle inline .gophermap */
+	if (strstr(displayname, st->map_file) > displayname) {
+		gophermap(st, pathname, 0);
+		return;
+	}
+
+	/* Handle directories */
+	if ((dir->mode & S_IFMT) == S_IFDIR) {
+
+		/* Use a non-empty gophertag as displayname */
+		if (dirtag(st, fd, dir->name, buf, sizeof(buf)) == OK && *buf) {
+
+			/* Convert to output charset */
+			if (st->opt_iconv) sstrniconv(st->out_charset, displayname, buf);
+			else sstrlcpy(displayname, buf);
+		}
+
+		/* Dir listing with dates */
+		if (st->opt_date) {
+			strfdate(timestr, dir->mtime, sizeof(timestr));
+
+			/* Hack to get around UTF-8 byte != char */
+			n = width - strcut(displayname, width);
+			strrepeat(buf, ' ', n);
+
+			printf("1%s%s   %s        -  \t%s%s/\t%s\t%i" CRLF,
+				displayname,
+				buf,
+				timestr,
+				st->req_selector,
+				encodedname,
+				st->server_host,
+				st->server_port);
+		}
+
+		/* Regular dir listing */
+		else {
+			strcut(displayname, st->out_width);
+			printf("1%s\t%s%s/\t%s\t%i" CRLF,
+				displayname,
+				st->req_selector,
+				encodedname,
+				st->server_host,
+				st->server_port);
+		}
+
+		return;
+	}
+
+	/* Get file type */
+	type = gopher_filetype(st, pathname, st->opt_magic);
+
+	/* File listing with dates & sizes */
+	if (st->opt_date) {
+		strfdate(timestr, dir->mtime, sizeof(timestr));
+		strfsize(sizestr, dir->size, sizeof(sizestr));
+
+		/* Hack to get around UTF-8 byte != char */
+		n = width - strcut(displayname, width);
+		strrepeat(buf, ' ', n);
+
+		printf("%c%s%s   %s %s\t%s%s\t%s\t%i" CRLF, type,
+			displayname,
+			buf,
+			timestr,
+			sizestr,
+			st->req_selector,
+			encodedname,
+			st->server_host,
+			st->server_port);
+	}
+
+	/* Regular file listing */
+	else {
+		strcut(displayname, st->out_width);
+		printf("%c%s\t%s%s\t%s\t%i" CRLF, type,
+			displayname,
+			st->req_selector,
+			encodedname,
+			st->server_host,
+			st->server_port);
+	}
+}
+
+
+/*
+ * Print menu items straight from readdir() without sorting
+ */
+void menu_stream(state *st, int width)
+{
+	DIR *dp;
+	struct dirent *d;
+	sdirent dir;
+	long n;
+	int first;
+	int last;
+	int page;
+	int i;
+
+	if ((dp = opendir(st->req_realpath)) == NULL) return;
+
+	/* Figure out which entries go on the requested page */
+	page = 1;
+	first = 0;
+	last = INT_MAX;
+
+	if (st->page_size > 0 && st->opt_query) {
+		if (sstrncmp(st->req_query_string, "page=") == MATCH)
+			n = strtol(st->req_query_string + 5, NULL, 10);
+		else n = 1;
+
+		/* The page count is unknown so keep the last entry within an int */
+		if (n > INT_MAX / st->page_size - 1) n = INT_MAX / st->page_size - 1;
+		page = (n < 1) ? 1 : (int) n;
+
+		first = (page - 1) * st->page_size;
+		last = first + st->page_size;
+	}
+
+	/* Output entries as they come */
+	for (i = 0; (d = readdir(dp));) {
+		if (direntry(dirfd(dp), d, &dir) == ERROR) continue;
+		if (!menu_visible(st, &dir)) continue;
+
+		/* One more after the page means there's a next page */
+		if (i++ == last) break;
+		if (i > first) menu_item(st, dirfd(dp), &dir, width);
+	}
+	closedir(dp);
+
+	/* Links to other pages (total count is unknown) */
+	if (page > 1 || d) menu_pages(st, page, d ? page + 1 : page, FALSE);
+}
+
+
+/*
+ * Print links to the previous & next pages of a menu
+ */
+void menu_pages(state *st, int page, int pages, int exact)
+{
+	char buf[BUFSIZE];
+
+	info(st, EMPTY, TYPE_INFO);
+
+	if (page > 1) {
+		printf("1" PAGE_PREV "\t%s?page=%i\t%s\t%i" CRLF,
+			st->req_selector, page - 1, st->server_host, st->server_port);
+	}
+
+	if (page < pages) {
+		printf("1" PAGE_NEXT "\t%s?page=%i\t%s\t%i" CRLF,
+			st->req_selector, page + 1, st->server_host, st->server_port);
+	}
+
+	if (exact) snprintf(buf, sizeof(buf), PAGE_FORMAT, page, pages);
+	else snprintf(buf, sizeof(buf), PAGE_FORMAT_STREAM, page);
+	info(st, buf, TYPE_INFO);
+}
+
+
+/*
+ * Handle gopher menus
+ */
+void gopher_menu(state *st)
+{
+	sdirent *dir;
+	skey *keys;
+	struct stat file;
+	char buf[BUFSIZE];
+	char pathname[BUFSIZE];
+	char displayname[BUFSIZE];
 	char *parent;
 	char *c;
-	char type;
 	int width;
+	int pages;
+	int page;
+	int first;
+	int last;
 	int num;
+	int fd;
 	int i;
 	int n;
 
+	/* Let concurrent requests for the same menu wait for this one */
+#ifdef HAVE_SHMEM
+	flight_begin(st);
+#endif
+
+	/* Tags are looked up relative to the directory (unreadable lists nothing) */
+	fd = open(st->req_realpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
 	/* Check for a gophermap */
 	snprintf(pathname, sizeof(pathname), "%s/%s",
 		st->req_realpath, st->map_file);
@@ -467,29 +1350,17 @@ void gopher_menu(state *st)
 
 		/* Parse gophermap */
 		if (gophermap(st, pathname, 0) == QUIT) {
+			if (fd != ERROR) close(fd);
 			footer(st);
 			return;
 		}
 	}
 
 	else {
-		/* Check for a gophertag */
-		snprintf(pathname, sizeof(pathname), "%s/%s",
-			st->req_realpath, st->tag_file);
-
-		if (stat(pathname, &file) == OK &&
-		    (file.st_mode & S_IFMT) == S_IFREG) {
-
-			/* Read & output gophertag */
-			if ((fp = fopen(pathname , "r"))) {
-
-				fgets(buf, sizeof(buf), fp);
-				chomp(buf);
-
-				info(st, buf, TYPE_TITLE);
-				info(st, EMPTY, TYPE_INFO);
-				fclose(fp);
-			}
+		/* Check for a gophertag & output it */
+		if (dirtag(st, fd, ".", buf, sizeof(buf)) == OK) {
+			info(st, buf, TYPE_TITLE);
+			info(st, EMPTY, TYPE_INFO);
 		}
 
 		/* No gophermap or tag found - print default header */
@@ -513,9 +1384,8 @@ void gopher_menu(state *st)
 		}
 	}
 
-	/* Scan the directory */
-	num = sortdir(st->req_realpath, dir, MAX_SDIRENT);
-	if (num < 0) die(st, ERR_NOTFOUND, "WTF?");
+	/* Width of filenames for fancy listing */
+	width = st->out_width - DATE_WIDTH - 15;
 
 	/* Create link to parent directory */
 	if (st->opt_parent) {
@@ -535,145 +1405,62 @@ void gopher_menu(state *st)
 		}
 	}
 
-	/* Width of filenames for fancy listing */
-	width = st->out_width - DATE_WIDTH - 15;
-
-	/* Loop through the directory entries */
-	for (i = 0; i < num; i++) {
-
-		/* Get full path+name */
-		snprintf(pathname, sizeof(pathname), "%s/%s",
-			st->req_realpath, dir[i].name);
-
-		/* Skip dotfiles and non world-readables */
-		if (dir[i].name[0] == '.') continue;
-		if ((dir[i].mode & S_IROTH) == 0) continue;
-
-		/* Skip gophermaps and tags (but not dirs) */
-		if ((dir[i].mode & S_IFMT) != S_IFDIR) {
-			if (strcmp(dir[i].name, st->map_file) == MATCH) continue;
-			if (strcmp(dir[i].name, st->tag_file) == MATCH) continue;
-		}
-
-		/* Skip files marked for hiding */
-		for (n = 0; n < st->hidden_count; n++)
-			if (strcmp(dir[i].name, st->hidden[n]) == MATCH) break;
-		if (n < st->hidden_count) continue;	/* Cruel hack... */
-
-		/* Generate display name with correct output charset */
-		if (st->opt_iconv)
-			sstrniconv(st->out_charset, displayname, dir[i].name);
-		else
-			sstrlcpy(displayname, dir[i].name);
-
-		/* #OCT-encode filename */
-		strnencode(encodedname, dir[i].name, sizeof(encodedname));
-
-		/* Handle inline .gophermap */
-		if (strstr(displayname, st->map_file) > displayname) {
-			gophermap(st, pathname, 0);
-			continue;
-		}
-
-		/* Handle directories */
-		if ((dir[i].mode & S_IFMT) == S_IFDIR) {
-
-			/* Check for a gophertag */
-			snprintf(buf, sizeof(buf), "%s/%s",
-				pathname, st->tag_file);
-
-			if (stat(buf, &file) == OK &&
-			    (file.st_mode & S_IFMT) == S_IFREG) {
-
-				/* Use the gophertag as displayname */
-				if ((fp = fopen(buf , "r"))) {
-
-					fgets(buf, sizeof(buf), fp);
-					chomp(buf);
-					fclose(fp);
+	/* Stream unsorted menus while reading the directory */
+	if (st->menu_sort == SORT_NONE) {
+		menu_stream(st, width);
+		if (fd != ERROR) close(fd);
+		footer(st);
+		return;
+	}
 
-					/* Skip empty gophertags */
-					if (*buf) {
+	/* Scan the directory */
+	num = loaddir(st->req_realpath, &dir);
+	keys = NULL;
+	if (num < 0) die(st, ERR_NOTFOUND, "WTF?");
 
-						/* Convert to output charset */
-						if (st->opt_iconv) sstrniconv(st->out_charset, displayname, buf);
-						else sstrlcpy(displayname, buf);
-					}
+	/* Collation keys for the listed entries (so that pages are full) */
+	if (num > 0 && !(keys = malloc(sizeof(skey) * num))) die(st, ERR_NOTFOUND, NULL);
 
-				}
-			}
+	for (i = n = 0; i < num; i++) {
+		if (!menu_visible(st, &dir[i])) continue;
 
-			/* Dir listing with dates */
-			if (st->opt_date) {
-				ltime = localtime(&dir[i].mtime);
-				strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
-
-				/* Hack to get around UTF-8 byte != char */
-				n = width - strcut(displayname, width);
-				strrepeat(buf, ' ', n);
-
-				printf("1%s%s   %s        -  \t%s%s/\t%s\t%i" CRLF,
-					displayname,
-					buf,
-					timestr,
-					st->req_selector,
-					encodedname,
-					st->server_host,
-					st->server_port);
-			}
+		keys[n].key = dirkey(&dir[i], st->menu_sort);
+		keys[n].dir = &dir[i];
+		n++;
+	}
+	num = n;
 
-			/* Regular dir listing */
-			else {
-				strcut(displayname, st->out_width);
-				printf("1%s\t%s%s/\t%s\t%i" CRLF,
-					displayname,
-					st->req_selector,
-					encodedname,
-					st->server_host,
-					st->server_port);
-			}
+	/* Figure out which entries go on the requested page */
+	page = pages = 1;
+	first = 0;
+	last = num;
 
-			continue;
-		}
+	if (st->page_size > 0 && st->opt_query && num > st->page_size) {
+		pages = (num + st->page_size - 1) / st->page_size;
 
-		/* Skip special files (sockets, fifos etc) */
-		if ((dir[i].mode & S_IFMT) != S_IFREG) continue;
+		if (sstrncmp(st->req_query_string, "page=") == MATCH)
+			page = atoi(st->req_query_string + 5);
+		if (page < 1) page = 1;
+		if (page > pages) page = pages;
 
-		/* Get file type */
-		type = gopher_filetype(st, pathname, st->opt_magic);
+		first = (page - 1) * st->page_size;
+		if ((last = first + st->page_size) > num) last = num;
+	}
 
-		/* File listing with dates & sizes */
-		if (st->opt_date) {
-			ltime = localtime(&dir[i].mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
-			strfsize(sizestr, dir[i].size, sizeof(sizestr));
+	/* Sort only what's going to be shown */
+	sortrange(keys, num, first, last,
+		st->menu_sort == SORT_NATURAL ? keysort_natural : keysort);
 
-			/* Hack to get around UTF-8 byte != char */
-			n = width - strcut(displayname, width);
-			strrepeat(buf, ' ', n);
+	/* Loop through the directory entries */
+	for (i = first; i < last; i++)
+		menu_item(st, fd, keys[i].dir, width);
 
-			printf("%c%s%s   %s %s\t%s%s\t%s\t%i" CRLF, type,
-				displayname,
-				buf,
-				timestr,
-				sizestr,
-				st->req_selector,
-				encodedname,
-				st->server_host,
-				st->server_port);
-		}
+	if (keys) free(keys);
+	free(dir);
+	if (fd != ERROR) close(fd);
 
-		/* Regular file listing */
-		else {
-			strcut(displayname, st->out_width);
-			printf("%c%s\t%s%s\t%s\t%i" CRLF, type,
-				displayname,
-				st->req_selector,
-				encodedname,
-				st->server_host,
-				st->server_port);
-		}
-	}
+	/* Links to other pages */
+	if (pages > 1) menu_pages(st, page, pages, TRUE);
 
 	/* Print footer */
 	footer(st);
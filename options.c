@@ -61,29 +61,6 @@ void add_ftype_mapping(state *st, char *suffix)
 }
 
 
-/*
- * Add one selector rewrite mapping to the array
- */
-void add_rewrite_mapping(state *st, char *match)
-{
-	char *replace;
-
-	/* Check input and split it into match & replace */
-	if (!*match) return;
-	if (!(replace = strchr(match, '='))) return;
-
-	*replace++ = '\0';
-	if (!*replace) return;
-
-	/* Insert match/replace values into the array */
-	if (st->rewrite_count < MAX_REWRITE) {
-		sstrlcpy(st->rewrite[st->rewrite_count].match, match);
-		sstrlcpy(st->rewrite[st->rewrite_count].replace, replace);
-		st->rewrite_count++;
-	}
-}
-
-
 /*
  * Parse command-line arguments
  */
@@ -97,7 +74,7 @@ void parse_args(state *st, int argc, char *argv[])
 	int opt;
 
 	/* Parse args */
-	while ((opt = getopt(argc, argv, "h:p:r:t:g:a:c:u:m:l:w:o:s:i:k:f:e:R:D:L:A:P:n:db?-")) != ERROR) {
+	while ((opt = getopt(argc, argv, "h:p:r:t:g:a:c:u:m:l:w:o:s:i:k:E:f:e:R:D:L:A:P:C:T:U:n:H:IKWSBdb?-")) != ERROR) {
 		switch(opt) {
 			case 'h': sstrlcpy(st->server_host, optarg); break;
 			case 'p': st->server_port = atoi(optarg); break;
@@ -111,6 +88,7 @@ void parse_args(state *st, int argc, char *argv[])
 			case 'l': sstrlcpy(st->log_file, optarg);  break;
 
 			case 'w': st->out_width = atoi(optarg); break;
+			case 'P': st->page_size = abs(atoi(optarg)); break;
 			case 'o':
 				if (sstrncasecmp(optarg, "UTF-8") == MATCH) st->out_charset = UTF_8;
 				if (sstrncasecmp(optarg, "ISO-8859-1") == MATCH) st->out_charset = ISO_8859_1;
@@ -119,11 +97,19 @@ void parse_args(state *st, int argc, char *argv[])
 			case 's': st->session_timeout = atoi(optarg); break;
 			case 'i': st->session_max_kbytes = abs(atoi(optarg)); break;
 			case 'k': st->session_max_hits = abs(atoi(optarg)); break;
+			case 'E': st->log_sample = abs(atoi(optarg)); break;
 
 			case 'f': sstrlcpy(st->filter_dir, optarg); break;
+			case 'C': sstrlcpy(st->cache_dir, optarg); break;
+			case 'T': sstrlcpy(st->tls_file, optarg); break;
+			case 'U': add_proxy(st, optarg); break;
 			case 'e': add_ftype_mapping(st, optarg); break;
 
-			case 'R': add_rewrite_mapping(st, optarg); break;
+			case 'R':
+				/* If -R arg looks like a file load the rules from it */
+				if (*optarg == '/' && !strchr(optarg, '=')) load_rewrite_file(st, optarg);
+				else add_rewrite_mapping(st, optarg);
+				break;
 			case 'D': sstrlcpy(st->server_description, optarg); break;
 			case 'L': sstrlcpy(st->server_location, optarg); break;
 			case 'A': sstrlcpy(st->server_admin, optarg); break;
@@ -140,9 +126,18 @@ void parse_args(state *st, int argc, char *argv[])
 				if (*optarg == 's') { st->opt_syslog = FALSE; break; }
 				if (*optarg == 'a') { st->opt_caps = FALSE; break; }
 				if (*optarg == 'm') { st->opt_shm = FALSE; break; }
+				if (*optarg == 'x') { st->opt_cache = FALSE; break; }
+				if (*optarg == 'u') { st->menu_sort = SORT_NONE; break; }
 				if (*optarg == 'r') { st->opt_root = FALSE; break; }
+				if (*optarg == 'k') { st->opt_keepalive = FALSE; break; }
 				break;
 
+			case 'B': st->opt_beneath = TRUE; break;
+			case 'I': st->opt_index = TRUE; break;
+			case 'K': st->opt_pack = TRUE; break;
+			case 'W': st->opt_watch = TRUE; break;
+			case 'S': st->opt_share = TRUE; break;
+			case 'H': sstrlcpy(st->warm_source, optarg); break;
 			case 'd': st->debug = TRUE; break;
 			case 'b': puts(license); exit(EXIT_SUCCESS);
 			default : puts(readme); exit(EXIT_SUCCESS);
@@ -154,6 +149,7 @@ void parse_args(state *st, int argc, char *argv[])
 	if (st->out_width < MIN_WIDTH) st->out_width = MIN_WIDTH;
 	if (st->out_width < MIN_WIDTH + DATE_WIDTH) st->opt_date = FALSE;
 	if (!st->opt_syslog) st->debug = FALSE;
+	if (st->log_sample < 1) st->log_sample = 1;
 
 	/* Primary vhost directory must exist or we disable vhosting */
 	if (st->opt_vhost) {
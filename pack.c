@@ -0,0 +1,521 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Append bytes to a pack being built
+ */
+void pack_write(spackbuild *pack, const void *data, size_t size)
+{
+	if (size) fwrite(data, size, 1, pack->fp);
+	pack->size += size;
+}
+
+
+/*
+ * Remember a packed response
+ */
+void pack_add(state *st, spackbuild *pack, size_t selector, char *str, char type, char kind, size_t offset, size_t size)
+{
+	spackent *ents;
+	int max;
+
+	if (pack->count == pack->max) {
+		max = pack->max ? pack->max * 2 : MAP_ALLOC;
+		if (!(ents = realloc(pack->ents, sizeof(spackent) * max))) die(st, ERR_NOTFOUND, "Out of memory");
+		pack->ents = ents;
+		pack->max = max;
+	}
+
+	ents = &pack->ents[pack->count++];
+	ents->hash = strhash(str);
+	ents->selector = selector;
+	ents->offset = offset;
+	ents->size = size;
+	ents->type = type;
+	ents->kind = kind;
+}
+
+
+/*
+ * Render a menu or a text file the way the server would send it
+ */
+char *pack_render(state *st, spackbuild *pack, char *selector, char *path, char type, size_t *size)
+{
+	state copy;
+	FILE *save;
+	FILE *fp;
+	char *buf;
+
+	/* Gophermaps change the state they run on */
+	memcpy(&copy, st, sizeof(state));
+	sstrlcpy(copy.req_selector, selector);
+	sstrlcpy(copy.req_realpath, path);
+	copy.req_filetype = type;
+	copy.hidden_count = pack->hidden;
+
+	buf = NULL;
+	*size = 0;
+	if (!(fp = open_memstream(&buf, size))) die(st, ERR_NOTFOUND, "Out of memory");
+
+	fflush(stdout);
+	save = stdout;
+	stdout = fp;
+
+	if (type == TYPE_MENU) gopher_menu(&copy);
+	else send_text_file(&copy);
+
+	stdout = save;
+	fclose(fp);
+	return buf;
+}
+
+
+/*
+ * Pack a menu or a text file rendered in the output charset
+ */
+void pack_rendered(state *st, spackbuild *pack, char *selector, char *path, char type, char kind)
+{
+	size_t size;
+	size_t sel;
+	char *buf;
+
+	buf = pack_render(st, pack, selector, path, type, &size);
+
+	sel = pack->size;
+	pack_write(pack, selector, strlen(selector) + 1);
+
+	pack_add(st, pack, sel, selector, type, kind, pack->size, size);
+	pack_write(pack, buf, size);
+	free(buf);
+}
+
+
+/*
+ * Pack a file as is
+ */
+void pack_copy(state *st, spackbuild *pack, char *selector, char *path, char type)
+{
+	FILE *fp;
+	char buf[BUFSIZE];
+	size_t offset;
+	size_t sel;
+	size_t bytes;
+
+	if ((fp = fopen(path, "r")) == NULL) return;
+
+	sel = pack->size;
+	pack_write(pack, selector, strlen(selector) + 1);
+
+	offset = pack->size;
+	while ((bytes = fread(buf, 1, sizeof(buf), fp)) > 0)
+		pack_write(pack, buf, bytes);
+	fclose(fp);
+
+	pack_add(st, pack, sel, selector, type, KIND_BINARY, offset, pack->size - offset);
+}
+
+
+/*
+ * Check whether a gophermap runs something at request time
+ */
+int pack_dynamic(state *st, char *mapfile)
+{
+	struct stat file;
+	smaprec *rec;
+	smap ops;
+	char *end;
+	char *c;
+	int dynamic;
+
+	if (stat(mapfile, &file) == ERROR) return FALSE;
+	if ((file.st_mode & S_IXOTH)) return TRUE;
+	if (map_get(st, mapfile, &file, 0, &ops) == ERROR) return FALSE;
+
+	dynamic = FALSE;
+	end = ops.data + ops.size;
+	for (c = ops.data + ops.start; c < end; c += rec->len) {
+		rec = (smaprec *) c;
+
+		if (rec->op == MAP_EXEC || rec->op == MAP_USERS || rec->op == MAP_VHOSTS)
+			dynamic = TRUE;
+	}
+
+	map_free(&ops);
+	return dynamic;
+}
+
+
+/*
+ * Check whether a menu looks the same every time (nothing in it runs)
+ */
+int pack_static(state *st, char *realpath, sdirent *dir, int num)
+{
+	char buf[BUFSIZE];
+	int i;
+
+	snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file);
+	if (pack_dynamic(st, buf)) return FALSE;
+
+	/* Inline gophermaps */
+	for (i = 0; i < num; i++) {
+		if (strstr(dir[i].name, st->map_file) > dir[i].name) {
+			snprintf(buf, sizeof(buf), "%s%s", realpath, dir[i].name);
+			if (pack_dynamic(st, buf)) return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Check whether a file is run or filtered at request time
+ */
+int pack_filtered(state *st, char *path, char type)
+{
+	struct stat file;
+	char buf[BUFSIZE];
+	char *c;
+
+	if (strstr(path, st->cgi_file) || type == TYPE_QUERY) return TRUE;
+	if (!*st->filter_dir) return FALSE;
+
+	if ((c = strrchr(path, '.'))) {
+		snprintf(buf, sizeof(buf), "%s/%s", st->filter_dir, c + 1);
+		if (stat(buf, &file) == OK && (file.st_mode & S_IXOTH)) return TRUE;
+	}
+
+	snprintf(buf, sizeof(buf), "%s/%c", st->filter_dir, type);
+	if (stat(buf, &file) == OK && (file.st_mode & S_IXOTH)) return TRUE;
+
+	return FALSE;
+}
+
+
+/*
+ * Pack a directory & everything listed under it
+ */
+void pack_walk(state *st, spackbuild *pack, char *selector, int depth)
+{
+	struct stat file;
+	sdirent *dir;
+	char realpath[BUFSIZE];
+	char path[BUFSIZE];
+	char buf[BUFSIZE];
+	char type;
+	int visible;
+	int hidden;
+	int num;
+	int i;
+
+	if (depth > PACK_DEPTH) return;
+	if (snprintf(realpath, sizeof(realpath), "%s%s", pack->root, selector) >= (int) sizeof(realpath)) {
+		pack->skipped++;
+		return;
+	}
+
+	/* Relative gophermap includes are relative to the menu */
+	if (stat(realpath, &file) == ERROR || chdir(realpath) == ERROR) return;
+	num = sortdir(realpath, &dir);
+
+	/* The menu itself, unless a gophermap runs something */
+	if (pack_static(st, realpath, dir, num) &&
+	    (file.st_mode & S_IROTH) && !(file.st_mode & S_IWOTH))
+		pack_rendered(st, pack, selector, realpath, TYPE_MENU, KIND_MENU);
+	else pack->skipped++;
+
+	/* Files hidden by the gophermap are left to the filesystem (all if a program decides) */
+	hidden = st->hidden_count;
+	if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) >= (int) sizeof(buf) ||
+	    map_hidden(st, buf) == ERROR) {
+		st->hidden_count = hidden;
+		pack->skipped++;
+		if (dir) free(dir);
+		return;
+	}
+
+	/* The hides apply to this directory only */
+	for (i = visible = 0; i < num; i++)
+		if (menu_visible(st, &dir[i])) dir[visible++] = dir[i];
+	st->hidden_count = hidden;
+
+	for (i = 0; i < visible; i++) {
+
+		/* Names that don't fit would pack the wrong file */
+		if (snprintf(path, sizeof(path), "%s%s", realpath, dir[i].name) >= (int) sizeof(path) ||
+		    snprintf(buf, sizeof(buf), "%s%s", selector, dir[i].name) >= (int) sizeof(buf) - 1) {
+			pack->skipped++;
+			continue;
+		}
+
+		/* Symlinks out of the root aren't served with -B */
+		if (st->opt_beneath && !search_beneath(st, path)) continue;
+
+		if ((dir[i].mode & S_IFMT) == S_IFDIR) {
+			sstrlcat(buf, "/");
+			pack_walk(st, pack, buf, depth + 1);
+			continue;
+		}
+
+		/* Files the server would refuse or run stay out */
+		type = gopher_filetype(st, path, st->opt_magic);
+		if ((dir[i].mode & S_IWOTH) || pack_filtered(st, path, type)) {
+			pack->skipped++;
+			continue;
+		}
+
+		if (type == TYPE_TEXT || type == TYPE_MIME)
+			pack_rendered(st, pack, buf, path, type, KIND_TEXT);
+		else pack_copy(st, pack, buf, path, type);
+	}
+
+	if (dir) free(dir);
+}
+
+
+/*
+ * Build a snapshot pack of the vhost
+ */
+void pack_build(state *st)
+{
+	spackhead head;
+	spackent *slots;
+	spackbuild pack;
+	char path[BUFSIZE];
+	char tmp[BUFSIZE];
+	char pad[sizeof(size_t)];
+	unsigned long h;
+	pid_t pid;
+	int status;
+	int fd;
+	int ok;
+	int i;
+
+	if (!*st->cache_dir) {
+		fprintf(stderr, "Packing needs a cache directory (-C)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Menu footers name the platform */
+	platform(st);
+
+	memset(&pack, 0, sizeof(pack));
+	pack.hidden = st->hidden_count;
+
+	if (st->opt_vhost) snprintf(pack.root, sizeof(pack.root), "%s/%s", st->server_root, st->server_host);
+	else sstrlcpy(pack.root, st->server_root);
+
+	/* Write to a temporary file & rename it in place */
+	if (snprintf(path, sizeof(path), "%s/" PACK_FILE "%s", st->cache_dir, st->server_host) >= (int) sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s.%i", path, (int) getpid()) >= (int) sizeof(tmp) ||
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, CACHE_MODE)) == ERROR ||
+	    !(pack.fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "Couldn't write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Build in a child so that a die() while rendering can't leave the file behind */
+	if ((pid = fork()) == ERROR) {
+		unlink(tmp);
+		fprintf(stderr, "Couldn't fork()\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0) {
+		fclose(pack.fp);
+		while (waitpid(pid, &status, 0) == ERROR && errno == EINTR);
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			unlink(tmp);
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	memset(&head, 0, sizeof(head));
+	pack_write(&pack, &head, sizeof(head));
+	pack_walk(st, &pack, ROOT, 0);
+
+	/* Hash table at least twice the size of the entries */
+	for (head.slots = 1; head.slots < pack.count * 2; head.slots *= 2);
+	if (!(slots = calloc(head.slots, sizeof(spackent)))) die(st, ERR_NOTFOUND, "Out of memory");
+
+	for (i = 0; i < pack.count; i++) {
+		for (h = pack.ents[i].hash & (head.slots - 1); slots[h].selector;
+			h = (h + 1) & (head.slots - 1));
+		slots[h] = pack.ents[i];
+	}
+
+	/* The table is read in place */
+	memset(pad, 0, sizeof(pad));
+	pack_write(&pack, pad, (sizeof(pad) - pack.size % sizeof(pad)) % sizeof(pad));
+
+	memcpy(head.magic, PACK_MAGIC, sizeof(head.magic));
+	head.width = st->out_width;
+	head.port = st->server_port;
+	head.iconv = st->opt_iconv;
+	head.charset = st->out_charset;
+	head.table = pack.size;
+	head.size = pack.size + head.slots * sizeof(spackent);
+	pack_write(&pack, slots, head.slots * sizeof(spackent));
+
+	rewind(pack.fp);
+	fwrite(&head, sizeof(head), 1, pack.fp);
+
+	ok = !ferror(pack.fp);
+	if (fclose(pack.fp) != OK) ok = FALSE;
+	if (!ok || rename(tmp, path) == ERROR) {
+		unlink(tmp);
+		fprintf(stderr, "Couldn't write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Packed %i responses (%i left to the filesystem) into %s\n",
+		pack.count, pack.skipped, path);
+
+	free(slots);
+	if (pack.ents) free(pack.ents);
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Look up a selector from a mapped pack
+ */
+spackent *pack_find(char *data, char *selector)
+{
+	spackhead *head;
+	spackent *slots;
+	unsigned long hash;
+	unsigned long h;
+	size_t sel;
+	int n;
+
+	head = (spackhead *) data;
+	slots = (spackent *) (data + head->table);
+	hash = strhash(selector);
+
+	for (h = hash & (head->slots - 1), n = 0; n < head->slots && slots[h].selector;
+		h = (h + 1) & (head->slots - 1), n++) {
+
+		sel = slots[h].selector;
+		if (slots[h].hash != hash || sel >= head->table ||
+		    slots[h].offset > head->table || slots[h].size > head->table - slots[h].offset) continue;
+
+		if (memchr(data + sel, '\0', head->table - sel) &&
+		    strcmp(data + sel, selector) == MATCH) return &slots[h];
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Serve a request from the snapshot pack of the vhost
+ */
+void pack_request(state *st)
+{
+#ifdef HAVE_MMAP
+	spackhead *head;
+	spackent *ent;
+	struct stat file;
+	char path[BUFSIZE];
+	char *data;
+	int fd;
+
+	/* Only plain gopher requests look like what was rendered */
+	if (!*st->cache_dir || !st->opt_cache || st->req_protocol != PROTO_GOPHER ||
+	    *st->req_query_string || st->rewrite_count > 0 || strchr(st->server_host, '/')) return;
+
+	snprintf(path, sizeof(path), "%s/" PACK_FILE "%s", st->cache_dir, st->server_host);
+	if ((fd = open(path, O_RDONLY)) == ERROR) return;
+
+	if (fstat(fd, &file) == ERROR || file.st_size < (off_t) sizeof(spackhead) ||
+	    (data = mmap(NULL, file.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	/* The pack must be whole & rendered with our options */
+	head = (spackhead *) data;
+	ent = NULL;
+
+	if (memcmp(head->magic, PACK_MAGIC, sizeof(head->magic)) == MATCH &&
+	    head->size == (size_t) file.st_size && head->slots > 0 &&
+	    (head->slots & (head->slots - 1)) == 0 &&
+	    head->table + head->slots * sizeof(spackent) == head->size &&
+	    head->width == st->out_width && head->port == st->server_port &&
+	    head->iconv == st->opt_iconv && head->charset == st->out_charset)
+		ent = pack_find(data, st->req_selector);
+
+	if (!ent) {
+		munmap(data, file.st_size);
+		close(fd);
+		return;
+	}
+
+	st->req_filetype = ent->type;
+	st->req_kind = ent->kind;
+	st->req_filesize = ent->size;
+	timer_phase(st, PHASE_RESOLVE);
+
+	/* Keep count of hits like for local files */
+#ifdef HAVE_SHMEM
+	if (st->shm) {
+		st->shm->hits++;
+		update_shm_hitters(st, st->shm);
+		update_shm_session(st, st->shm);
+	}
+#endif
+
+	if (st->opt_syslog) {
+		syslog(LOG_INFO, "request for \"gopher://%s:%i/%c%s\" from %s (packed)",
+			st->server_host,
+			st->server_port,
+			st->req_filetype,
+			st->req_selector,
+			st->req_remote_addr);
+	}
+	timer_phase(st, PHASE_LOG);
+
+	/* Straight from the pack file to the socket */
+#ifdef HAVE_SENDFILE
+	if (sink_direct(st)) send_file_range(st, fd, ent->offset, ent->size);
+	else
+#endif
+		fwrite(data + ent->offset, ent->size, 1, stdout);
+
+	munmap(data, file.st_size);
+	close(fd);
+
+	finish(st);
+	exit(EXIT_SUCCESS);
+#endif
+}
@@ -286,3 +286,70 @@ float loadavg(void)
 }
 
 
+/*
+ * Return monotonic time in microseconds
+ */
+long long monotime(void)
+{
+	struct timeval tv;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == OK)
+		return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+
+	/* Fallback to wall clock time */
+	gettimeofday(&tv, NULL);
+	return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * Open a path beneath a directory (O_PATH) using openat2()
+ */
+#ifdef HAVE_OPENAT2
+int open_beneath(state *st, int dirfd, char *path, int flags)
+{
+	struct open_how how;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	how.resolve = RESOLVE_NO_MAGICLINKS;
+
+	/* Symlinks out of the root are fine unless disabled with -B */
+	if (st->opt_beneath) how.resolve |= RESOLVE_BENEATH;
+
+	return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+#endif
+
+
+/*
+ * Sleep until a word in shared memory is no longer val (or msec passes)
+ */
+void futex_wait(int *word, int val, int msec)
+{
+#ifdef HAVE_FUTEX
+	struct timespec ts;
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000L;
+	syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	/* Poll without futexes */
+	for (; msec > 0 && *(volatile int *) word == val; msec -= 10)
+		usleep(10000);
+#endif
+}
+
+
+/*
+ * Wake up everyone sleeping on a word in shared memory
+ */
+void futex_wake(int *word)
+{
+#ifdef HAVE_FUTEX
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
@@ -0,0 +1,490 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Add an upstream gopher server for a selector prefix (/prefix=host[:port])
+ */
+void add_proxy(state *st, char *mapping)
+{
+	sproxy *proxy;
+	char *host;
+	char *c;
+
+	if (st->proxy_count >= MAX_PROXIES) return;
+	if (*mapping != '/' || !(host = strchr(mapping, '='))) return;
+	*host++ = '\0';
+
+	proxy = &st->proxy[st->proxy_count];
+	sstrlcpy(proxy->prefix, mapping);
+	sstrlcpy(proxy->host, host);
+	proxy->port = PROXY_PORT;
+
+	/* Prefixes are matched without the trailing slash */
+	while (strlast(proxy->prefix) == '/')
+		proxy->prefix[strlen(proxy->prefix) - 1] = '\0';
+
+	/* [ipv6]:port or host:port */
+	if (*proxy->host == '[' && (c = strchr(proxy->host, ']'))) {
+		*c++ = '\0';
+		if (*c == ':') proxy->port = atoi(c + 1);
+		memmove(proxy->host, proxy->host + 1, strlen(proxy->host));
+	}
+	else if ((c = strchr(proxy->host, ':')) && !strchr(c + 1, ':')) {
+		*c++ = '\0';
+		proxy->port = atoi(c);
+	}
+
+	if (!*proxy->host || proxy->port <= 0) return;
+	st->proxy_count++;
+}
+
+
+/*
+ * Find the upstream server of the request selector (ERROR if none)
+ */
+int proxy_match(state *st)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < st->proxy_count; i++) {
+		len = strlen(st->proxy[i].prefix);
+
+		if (strncmp(st->req_selector, st->proxy[i].prefix, len) == MATCH &&
+		    (st->req_selector[len] == '/' || st->req_selector[len] == '\0')) return i;
+	}
+
+	return ERROR;
+}
+
+
+/*
+ * Connect to an upstream server (returns the socket or ERROR)
+ */
+int proxy_connect(sproxy *proxy)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	struct timeval tv;
+	char port[16];
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%i", proxy->port);
+
+	if (getaddrinfo(proxy->host, port, &hints, &res) != OK) return ERROR;
+
+	/* A dead upstream mustn't hang the client (Linux times out connect() too) */
+	tv.tv_sec = PROXY_TIMEOUT;
+	tv.tv_usec = 0;
+
+	for (fd = ERROR, ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == ERROR) continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == OK) break;
+
+		close(fd);
+		fd = ERROR;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+
+/*
+ * Send a menu line with the links to the upstream server pointing
+ * back through us
+ */
+void proxy_line(state *st, sproxy *proxy, char *line)
+{
+	char sel[BUFSIZE];
+	char *field[4];
+	char *extra;
+	char *out;
+	char type;
+	int i;
+
+	/* Tdisplay<TAB>selector<TAB>host<TAB>port[<TAB>gopher+] */
+	chomp(line);
+	type = *line;
+	field[0] = line + 1;
+	for (i = 1; i < 4; i++) {
+		if ((field[i] = strchr(field[i - 1], '\t'))) *field[i]++ = '\0';
+		else break;
+	}
+
+	/* Info lines, the end marker & links elsewhere go out as they are */
+	if (i < 4 || type == TYPE_INFO || type == TYPE_ERROR ||
+	    strcasecmp(field[2], proxy->host) != MATCH || atoi(field[3]) != proxy->port) {
+		for (i--; i > 0; i--) *(field[i] - 1) = '\t';
+		printf("%s" CRLF, line);
+		return;
+	}
+
+	if (!(extra = strchr(field[3], '\t'))) extra = EMPTY;
+
+	/* Encode what our selector parsing would eat */
+	for (out = sel; *field[1] && out < sel + sizeof(sel) - 4; field[1]++) {
+		if ((unsigned char) *field[1] <= ' ' || strchr("%?;", *field[1])) {
+			snprintf(out, 4, "%%%02X", (unsigned char) *field[1]);
+			out += 3;
+		}
+		else *out++ = *field[1];
+	}
+	*out = '\0';
+
+	printf("%c%s\t%s/%c%s\t%s\t%i%s" CRLF, type, field[0], proxy->prefix,
+		type, sel, st->server_host, st->server_port, extra);
+}
+
+
+/*
+ * Copy an upstream response to the client & the cache (returns ERROR
+ * if reading it failed)
+ */
+int proxy_send(state *st, sproxy *proxy, char type, FILE *in, FILE *save)
+{
+	char buf[BUFSIZE];
+	size_t bytes;
+	int start;
+	int end;
+
+	/* Menus are rewritten a line at a time */
+	if (type == TYPE_MENU || type == TYPE_QUERY) {
+		for (start = TRUE; fgets(buf, sizeof(buf), in); start = end) {
+			bytes = strlen(buf);
+			end = (buf[bytes - 1] == '\n');
+			if (save && ftell(save) <= PROXY_OBJECT_MAX) fwrite(buf, bytes, 1, save);
+
+			/* Pieces of overlong lines go out untouched */
+			if (start && end) proxy_line(st, proxy, buf);
+			else fwrite(buf, bytes, 1, stdout);
+		}
+	}
+
+	else {
+		while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
+			if (save && ftell(save) <= PROXY_OBJECT_MAX) fwrite(buf, bytes, 1, save);
+			fwrite(buf, bytes, 1, stdout);
+		}
+	}
+
+	return ferror(in) ? ERROR : OK;
+}
+
+
+/*
+ * Generate the cache key & file name of an upstream response
+ */
+void proxy_cache_file(state *st, sproxy *proxy, char type, char *selector, char *key, size_t keysize, char *out, size_t outsize)
+{
+	snprintf(key, keysize, "%s:%i\t%c%s\t%s", proxy->host, proxy->port,
+		type, selector, st->req_query_string);
+	snprintf(out, outsize, "%s/" PROXY_FILE "%08lx", st->cache_dir, strhash(key));
+}
+
+
+/*
+ * Open a cached upstream response (returns NULL if there's none)
+ */
+FILE *proxy_cache_open(char *path, char *key, struct stat *file)
+{
+	char buf[BUFSIZE * 2];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) return NULL;
+
+	/* The first line tells which response it is (file names are hashes) */
+	if (fstat(fileno(fp), file) == ERROR || !fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return NULL;
+	}
+
+	chomp(buf);
+	if (strcmp(buf, key) != MATCH) {
+		fclose(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+
+/*
+ * Send a cached upstream response & quit
+ */
+void proxy_cached(state *st, sproxy *proxy, char type, FILE *fp, char *path, struct stat *file)
+{
+	struct timeval tv[2];
+
+	if (st->debug) syslog(LOG_INFO, "sending cached upstream response \"%s\"", path);
+
+	/* Remember the use for LRU (the mtime is when it was fetched) */
+	gettimeofday(&tv[0], NULL);
+	tv[1].tv_sec = file->st_mtime;
+	tv[1].tv_usec = 0;
+	utimes(path, tv);
+
+	if (type != TYPE_MENU && type != TYPE_QUERY)
+		st->http_length = file->st_size - ftell(fp);
+
+	proxy_send(st, proxy, type, fp, NULL);
+	fclose(fp);
+
+	finish(st);
+	exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Sort cached upstream responses least recently used first
+ */
+int proxysort(const void *a, const void *b)
+{
+	const sproxyfile *x = (const sproxyfile *) a;
+	const sproxyfile *y = (const sproxyfile *) b;
+
+	if (x->atime < y->atime) return -1;
+	if (x->atime > y->atime) return 1;
+	return 0;
+}
+
+
+/*
+ * Keep the cached upstream responses under PROXY_CACHE_MAX bytes by
+ * dropping the least recently used ones (this reads the whole cache dir)
+ */
+void proxy_evict(state *st)
+{
+	struct dirent *dir;
+	struct stat file;
+	sproxyfile *list;
+	sproxyfile *tmp;
+	char buf[BUFSIZE];
+	off_t total;
+	int num;
+	int max;
+	int i;
+	DIR *dp;
+
+	if ((dp = opendir(st->cache_dir)) == NULL) return;
+
+	list = NULL;
+	total = 0;
+	num = max = 0;
+
+	while ((dir = readdir(dp))) {
+
+		/* Skip other cached things & unfinished responses */
+		if (sstrncmp(dir->d_name, PROXY_FILE) != MATCH ||
+		    strchr(dir->d_name + strlen(PROXY_FILE), '.') ||
+		    strlen(dir->d_name) >= sizeof(list->name)) continue;
+
+		snprintf(buf, sizeof(buf), "%s/%s", st->cache_dir, dir->d_name);
+		if (stat(buf, &file) == ERROR) continue;
+
+		if (num == max) {
+			if (!(tmp = realloc(list, sizeof(sproxyfile) * (max + SDIRENT_ALLOC)))) break;
+			list = tmp;
+			max += SDIRENT_ALLOC;
+		}
+
+		sstrlcpy(list[num].name, dir->d_name);
+		list[num].atime = file.st_atime;
+		list[num].size = file.st_size;
+		total += file.st_size;
+		num++;
+	}
+	closedir(dp);
+
+	if (total > PROXY_CACHE_MAX) {
+		qsort(list, num, sizeof(sproxyfile), proxysort);
+
+		for (i = 0; i < num && total > PROXY_CACHE_MAX; i++) {
+			snprintf(buf, sizeof(buf), "%s/%s", st->cache_dir, list[i].name);
+			if (unlink(buf) == OK) total -= list[i].size;
+		}
+	}
+
+	if (list) free(list);
+
+	/* Start the running total over from what's really there */
+#ifdef HAVE_SHMEM
+	if (st->shm) st->shm->proxy_bytes = total;
+#endif
+}
+
+
+/*
+ * Account for a newly cached upstream response & evict others only
+ * when the cache may have grown too big
+ */
+void proxy_stored(state *st, off_t size)
+{
+#ifdef HAVE_SHMEM
+	if (st->shm && st->shm->proxy_bytes > 0 &&
+	    __sync_add_and_fetch(&st->shm->proxy_bytes, size) <= PROXY_CACHE_MAX) return;
+#endif
+	proxy_evict(st);
+}
+
+
+/*
+ * Serve a selector from an upstream gopher server through the cache
+ */
+void proxy_request(state *st, int i)
+{
+	struct stat file;
+	sproxy *proxy;
+	char selector[BUFSIZE];
+	char key[BUFSIZE * 2];
+	char path[BUFSIZE];
+	char tmp[BUFSIZE];
+	char buf[BUFSIZE * 2 + 4];
+	FILE *stale;
+	FILE *save;
+	FILE *fp;
+	off_t size;
+	char type;
+	char *c;
+	int fd;
+	int ok;
+
+	proxy = &st->proxy[i];
+
+	/* /prefix/<type><upstream selector> (just /prefix is the root menu) */
+	c = st->req_selector + strlen(proxy->prefix);
+	if (*c == '/') c++;
+	type = *c ? *c++ : TYPE_MENU;
+	sstrlcpy(selector, c);
+
+	/* Decoded CR, LF or TAB would smuggle more requests to the upstream */
+	for (c = selector; *c; c++)
+		if ((unsigned char) *c < ' ' || *c == 127) die(st, ERR_ACCESS, "Refusing to proxy control characters");
+	for (c = st->req_query_string; *c; c++)
+		if ((unsigned char) *c < ' ' || *c == 127) die(st, ERR_ACCESS, "Refusing to proxy control characters");
+
+	st->req_filetype = type;
+	if (type == TYPE_MENU || type == TYPE_QUERY) st->req_kind = KIND_MENU;
+	else if (type == TYPE_TEXT) st->req_kind = KIND_TEXT;
+	else st->req_kind = KIND_BINARY;
+	timer_phase(st, PHASE_RESOLVE);
+
+	/* Keep count of hits like for local files */
+#ifdef HAVE_SHMEM
+	if (st->shm) {
+		st->shm->hits++;
+		update_shm_hitters(st, st->shm);
+		update_shm_session(st, st->shm);
+	}
+#endif
+
+	if (st->opt_syslog) {
+		syslog(LOG_INFO, "request for \"gopher://%s:%i/%c%s\" from %s (proxied to %s:%i)",
+			st->server_host,
+			st->server_port,
+			st->req_filetype,
+			st->req_selector,
+			st->req_remote_addr,
+			proxy->host,
+			proxy->port);
+	}
+	timer_phase(st, PHASE_LOG);
+
+	/* Fresh responses come from the cache */
+	stale = NULL;
+	if (*st->cache_dir && st->opt_cache) {
+		proxy_cache_file(st, proxy, type, selector, key, sizeof(key), path, sizeof(path));
+
+		if ((fp = proxy_cache_open(path, key, &file))) {
+			if ((time(NULL) - file.st_mtime) < PROXY_TTL)
+				proxy_cached(st, proxy, type, fp, path, &file);
+			stale = fp;
+		}
+	}
+
+	/* Let concurrent misses wait for one fetch */
+#ifdef HAVE_SHMEM
+	flight_begin(st);
+#endif
+
+	/* A stale copy beats no answer at all */
+	if ((fd = proxy_connect(proxy)) == ERROR) {
+		if (st->opt_syslog) syslog(LOG_ERR, "couldn't connect to upstream %s:%i", proxy->host, proxy->port);
+		if (stale) proxy_cached(st, proxy, type, stale, path, &file);
+		die(st, ERR_NOTFOUND, "Upstream server not responding");
+	}
+	if (stale) fclose(stale);
+
+	snprintf(buf, sizeof(buf), "%s%s%s" CRLF, selector,
+		*st->req_query_string ? "\t" : "", st->req_query_string);
+
+	if (write(fd, buf, strlen(buf)) != (ssize_t) strlen(buf) || !(fp = fdopen(fd, "r"))) {
+		close(fd);
+		die(st, ERR_NOTFOUND, "Upstream server not responding");
+	}
+
+	/* Store a copy while sending it (unless the temporary name is cut) */
+	save = NULL;
+	if (*st->cache_dir && st->opt_cache &&
+	    snprintf(tmp, sizeof(tmp), "%s.%i", path, (int) getpid()) < (int) sizeof(tmp)) {
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, CACHE_MODE)) != ERROR) {
+			if ((save = fdopen(fd, "w"))) fprintf(save, "%s\n", key);
+			else close(fd);
+		}
+	}
+
+	ok = proxy_send(st, proxy, type, fp, save);
+	fclose(fp);
+
+	/* Only complete responses that aren't too big are kept */
+	if (save) {
+		size = ftell(save);
+		if (size > PROXY_OBJECT_MAX) ok = ERROR;
+		if (fclose(save) != OK) ok = ERROR;
+
+		/* A refetched response replaces the old copy */
+		if (stat(path, &file) == OK) size -= file.st_size;
+
+		if (ok == OK && rename(tmp, path) == OK) proxy_stored(st, size);
+		else unlink(tmp);
+	}
+
+	/* Nor should a broken response be shared */
+	if (ok == ERROR) st->flight_ok = FALSE;
+
+	finish(st);
+	exit(EXIT_SUCCESS);
+}
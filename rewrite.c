@@ -0,0 +1,265 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Find or add a child node for a character in the rewrite trie
+ */
+int rewrite_node(state *st, int parent, char c)
+{
+	snode *trie;
+	int i;
+
+	/* Look for an existing child */
+	for (i = st->rewrite_trie[parent].child; i; i = st->rewrite_trie[i].next)
+		if (st->rewrite_trie[i].c == c) return i;
+
+	/* Grow the node array if needed */
+	if (st->rewrite_nodes == st->rewrite_nodes_max) {
+		if (!(trie = realloc(st->rewrite_trie,
+			sizeof(snode) * st->rewrite_nodes_max * 2))) return ERROR;
+
+		st->rewrite_trie = trie;
+		st->rewrite_nodes_max *= 2;
+	}
+
+	/* Link the new node as the first child */
+	i = st->rewrite_nodes++;
+	st->rewrite_trie[i].c = c;
+	st->rewrite_trie[i].rule = ERROR;
+	st->rewrite_trie[i].child = 0;
+	st->rewrite_trie[i].next = st->rewrite_trie[parent].child;
+	st->rewrite_trie[parent].child = i;
+
+	return i;
+}
+
+
+/*
+ * Add one selector rewrite mapping
+ */
+void add_rewrite_mapping(state *st, char *match)
+{
+	srewrite *rule;
+	regex_t *regex;
+	char *replace;
+	char *c;
+	int node;
+
+	/* Check input and split it into match & replace */
+	if (!*match) return;
+	if (!(replace = strchr(match, '='))) return;
+
+	*replace++ = '\0';
+	if (!*replace) return;
+
+	/* Initialize the trie root on first use */
+	if (!st->rewrite_trie) {
+		if (!(st->rewrite_trie = malloc(sizeof(snode) * REWRITE_NODES))) return;
+
+		st->rewrite_nodes_max = REWRITE_NODES;
+		st->rewrite_nodes = 1;
+		st->rewrite_trie[0].child = 0;
+		st->rewrite_trie[0].next = 0;
+		st->rewrite_trie[0].rule = ERROR;
+	}
+
+	/* Grow the rule array if needed */
+	if (st->rewrite_count == st->rewrite_max) {
+		if (!(rule = realloc(st->rewrite, sizeof(srewrite) *
+			(st->rewrite_max ? st->rewrite_max * 2 : REWRITE_RULES)))) return;
+
+		st->rewrite = rule;
+		st->rewrite_max = st->rewrite_max ? st->rewrite_max * 2 : REWRITE_RULES;
+	}
+
+	rule = &st->rewrite[st->rewrite_count];
+	if (!(rule->match = strdup(match))) return;
+	if (!(rule->replace = strdup(replace))) return;
+	rule->regex = NULL;
+
+	/* Rules starting with ^ are regular expressions */
+	if (*match == '^') {
+		if (!(regex = malloc(sizeof(regex_t)))) return;
+
+		if (regcomp(regex, match, REG_EXTENDED) != OK) {
+			if (st->opt_syslog) syslog(LOG_ERR, "invalid rewrite regex \"%s\"", match);
+			free(rule->replace);
+			free(rule->match);
+			free(regex);
+			return;
+		}
+
+		rule->regex = regex;
+		st->rewrite_regex++;
+		st->rewrite_count++;
+		return;
+	}
+
+	/* Literal prefixes go into the trie */
+	for (node = 0, c = match; *c; c++)
+		if ((node = rewrite_node(st, node, *c)) == ERROR) return;
+
+	/* First rule for a prefix wins */
+	if (st->rewrite_trie[node].rule == ERROR)
+		st->rewrite_trie[node].rule = st->rewrite_count;
+	st->rewrite_count++;
+}
+
+
+/*
+ * Load selector rewrite mappings from a file (one old=new per line)
+ */
+void load_rewrite_file(state *st, char *file)
+{
+	FILE *fp;
+	char buf[BUFSIZE * 2];
+
+	if (!(fp = fopen(file, "r"))) {
+		if (st->opt_syslog) syslog(LOG_ERR, "couldn't open rewrite file \"%s\"", file);
+		return;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		chomp(buf);
+
+		/* Skip comments and empty lines */
+		if (*buf == '#' || !*buf) continue;
+		add_rewrite_mapping(st, buf);
+	}
+
+	fclose(fp);
+}
+
+
+/*
+ * Expand regex captures (\0 - \9) in a replacement string
+ */
+void rewrite_expand(char *out, size_t outsize, char *replace, char *in, regmatch_t *match)
+{
+	size_t len;
+	size_t i;
+	int n;
+
+	for (i = 0; *replace && i < (outsize - 1); replace++) {
+
+		/* Plain character */
+		if (*replace != '\\' || replace[1] < '0' || replace[1] > '9') {
+			out[i++] = *replace;
+			continue;
+		}
+
+		/* Copy the captured substring */
+		n = *++replace - '0';
+		if (match[n].rm_so == -1) continue;
+
+		len = match[n].rm_eo - match[n].rm_so;
+		if (len > (outsize - 1 - i)) len = outsize - 1 - i;
+
+		memcpy(out + i, in + match[n].rm_so, len);
+		i += len;
+	}
+
+	out[i] = '\0';
+}
+
+
+/*
+ * Rewrite the request selector
+ */
+void rewrite_selector(state *st)
+{
+	regmatch_t match[REWRITE_CAPTURES];
+	srewrite *rule;
+	char buf[BUFSIZE];
+	char tmp[BUFSIZE];
+	char *c;
+	int node;
+	int found;
+	int len;
+	int i;
+
+	if (!st->rewrite_count) return;
+
+	/* Walk the trie to find the longest matching prefix */
+	found = ERROR;
+	len = 0;
+
+	if (st->rewrite_trie) {
+		for (node = 0, c = st->req_selector; *c; c++) {
+
+			for (i = st->rewrite_trie[node].child; i; i = st->rewrite_trie[i].next)
+				if (st->rewrite_trie[i].c == *c) break;
+
+			if (!i) break;
+			node = i;
+
+			if (st->rewrite_trie[node].rule != ERROR) {
+				found = st->rewrite_trie[node].rule;
+				len = (c - st->req_selector) + 1;
+			}
+		}
+	}
+
+	/* Replace the prefix with a new string */
+	if (found != ERROR) {
+		snprintf(buf, sizeof(buf), "%s%s",
+			st->rewrite[found].replace, st->req_selector + len);
+
+		if (st->debug) {
+			syslog(LOG_INFO, "rewriting selector \"%s\" -> \"%s\"",
+				st->req_selector, buf);
+		}
+
+		sstrlcpy(st->req_selector, buf);
+	}
+
+	/* Apply the first matching regex rule */
+	if (!st->rewrite_regex) return;
+
+	for (i = 0; i < st->rewrite_count; i++) {
+		rule = &st->rewrite[i];
+
+		if (!rule->regex) continue;
+		if (regexec(rule->regex, st->req_selector, REWRITE_CAPTURES, match, 0) != OK) continue;
+
+		/* Replace the matched part of the selector (unless the result would be cut) */
+		rewrite_expand(tmp, sizeof(tmp), rule->replace, st->req_selector, match);
+		if (snprintf(buf, sizeof(buf), "%.*s%s%s",
+			(int) match[0].rm_so, st->req_selector,
+			tmp, st->req_selector + match[0].rm_eo) >= (int) sizeof(buf)) return;
+
+		if (st->debug) {
+			syslog(LOG_INFO, "rewriting selector \"%s\" -> \"%s\" (regex \"%s\")",
+				st->req_selector, buf, rule->match);
+		}
+
+		sstrlcpy(st->req_selector, buf);
+		return;
+	}
+}
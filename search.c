@@ -0,0 +1,862 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Append a string to the string pool of an index being built
+ */
+unsigned int search_string(state *st, sindex *idx, const char *str)
+{
+	size_t len;
+	size_t max;
+	char *data;
+	unsigned int off;
+
+	len = strlen(str) + 1;
+
+	if (idx->string_size + len > idx->string_max) {
+		for (max = idx->string_max ? idx->string_max : MAP_ALLOC; max < idx->string_size + len; max *= 2);
+		if (!(data = realloc(idx->strings, max))) die(st, ERR_NOTFOUND, "Out of memory");
+		idx->strings = data;
+		idx->string_max = max;
+	}
+
+	off = idx->string_size;
+	memcpy(idx->strings + off, str, len);
+	idx->string_size += len;
+	return off;
+}
+
+
+/*
+ * Find the hash slot of a word
+ */
+sidxbuild *search_slot(sindex *idx, const char *word)
+{
+	unsigned long i;
+
+	for (i = strhash(word) % idx->word_max;; i = (i + 1) % idx->word_max) {
+		if (!idx->words[i].word || strcmp(idx->words[i].word, word) == MATCH)
+			return &idx->words[i];
+	}
+}
+
+
+/*
+ * Count a word in a document
+ */
+void search_add(state *st, sindex *idx, const char *word, int doc, int count)
+{
+	sidxbuild *words;
+	sidxbuild *w;
+	sidxpost *post;
+	int max;
+	int i;
+
+	/* Keep the hash at most half full */
+	if (idx->word_count * 2 >= idx->word_max) {
+		words = idx->words;
+		max = idx->word_max;
+
+		idx->word_max = max ? max * 2 : SEARCH_WORDS;
+		if (!(idx->words = calloc(idx->word_max, sizeof(sidxbuild))))
+			die(st, ERR_NOTFOUND, "Out of memory");
+
+		for (i = 0; i < max; i++)
+			if (words[i].word) *search_slot(idx, words[i].word) = words[i];
+		if (words) free(words);
+	}
+
+	w = search_slot(idx, word);
+	if (!w->word) {
+		if (!(w->word = strdup(word))) die(st, ERR_NOTFOUND, "Out of memory");
+		idx->word_count++;
+	}
+
+	/* Documents are indexed one at a time */
+	if (w->count > 0 && w->post[w->count - 1].doc == (unsigned int) doc) {
+		w->post[w->count - 1].count += count;
+		return;
+	}
+
+	if (w->count == w->max) {
+		max = w->max ? w->max * 2 : 4;
+		if (!(post = realloc(w->post, sizeof(sidxpost) * max))) die(st, ERR_NOTFOUND, "Out of memory");
+		w->post = post;
+		w->max = max;
+	}
+
+	w->post[w->count].doc = doc;
+	w->post[w->count].count = count;
+	w->count++;
+}
+
+
+/*
+ * Split text into lowercase words & count them in a document
+ */
+void search_text(state *st, sindex *idx, int doc, const char *text, size_t len)
+{
+	char word[SEARCH_WORD + 1];
+	unsigned char c;
+	size_t i;
+	int n;
+
+	for (n = 0, i = 0; i <= len; i++) {
+		c = (i < len) ? text[i] : ' ';
+
+		/* Letters, numbers & anything UTF-8 make up words */
+		if (isalnum(c) || c >= 0x80) {
+			if (n < SEARCH_WORD) word[n] = tolower(c);
+			n++;
+			continue;
+		}
+
+		if (n >= SEARCH_MIN && n <= SEARCH_WORD) {
+			word[n] = '\0';
+			search_add(st, idx, word, doc, 1);
+		}
+		n = 0;
+	}
+}
+
+
+/*
+ * Index the descriptions of a static gophermap
+ */
+void search_map(state *st, sindex *idx, int doc, char *mapfile)
+{
+	char buf[BUFSIZE];
+	char *c;
+	FILE *fp;
+
+	if ((fp = fopen(mapfile, "r")) == NULL) return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		chomp(buf);
+
+		/* Resources: Tdisplay<TAB>selector... */
+		if ((c = strchr(buf, '\t'))) {
+			*c = '\0';
+			if (*buf) search_text(st, idx, doc, buf + 1, strlen(buf + 1));
+			continue;
+		}
+
+		/* Titles & info text (skip the other gophermap commands) */
+		if (*buf == '!') search_text(st, idx, doc, buf + 1, strlen(buf + 1));
+		else if (!strchr("#-:=~%*.", *buf)) search_text(st, idx, doc, buf, strlen(buf));
+	}
+
+	fclose(fp);
+}
+
+
+/*
+ * Find a document of the previous index (ERROR if it's gone)
+ */
+int search_old(sindex *idx, char *path)
+{
+	sidxhead *head;
+	sidxdoc *docs;
+	unsigned long i;
+	int n;
+
+	if (!idx->old_hash) return ERROR;
+
+	head = (sidxhead *) idx->old.data;
+	docs = (sidxdoc *) (head + 1);
+
+	for (i = strhash(path) % (head->docs * 2);; i = (i + 1) % (head->docs * 2)) {
+		if ((n = idx->old_hash[i]) == ERROR) return ERROR;
+		if (strcmp(idx->old.data + head->strings + docs[n].path, path) == MATCH) return n;
+	}
+}
+
+
+/*
+ * Add one document to the index (unchanged ones come from the
+ * previous index without reading them again)
+ */
+void search_doc(state *st, sindex *idx, char *path, char *name, sdirent *dir)
+{
+	struct stat file;
+	sidxdoc *docs;
+	sidxdoc *doc;
+	sidxdoc *old;
+	char realpath[BUFSIZE];
+	char buf[BUFSIZE];
+	off_t size;
+	time_t mtime;
+	int bytes;
+	int fd;
+	int i;
+
+	if (snprintf(realpath, sizeof(realpath), "%s%s", st->server_root, path) >= (int) sizeof(realpath)) return;
+	mtime = dir->mtime;
+	size = dir->size;
+
+	/* Menus change with their gophermap & gophertag (if their paths fit) */
+	if ((dir->mode & S_IFMT) == S_IFDIR) {
+		size = 0;
+		if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) < (int) sizeof(buf) &&
+		    stat(buf, &file) == OK) {
+			if (file.st_mtime > mtime) mtime = file.st_mtime;
+			size += file.st_size;
+		}
+
+		if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->tag_file) < (int) sizeof(buf) &&
+		    stat(buf, &file) == OK) {
+			if (file.st_mtime > mtime) mtime = file.st_mtime;
+			size += file.st_size;
+		}
+	}
+
+	if (idx->doc_count == idx->doc_max) {
+		i = idx->doc_max ? idx->doc_max * 2 : SDIRENT_ALLOC;
+		if (!(docs = realloc(idx->docs, sizeof(sidxdoc) * i))) die(st, ERR_NOTFOUND, "Out of memory");
+		idx->docs = docs;
+		idx->doc_max = i;
+	}
+
+	doc = &idx->docs[idx->doc_count];
+	doc->mtime = mtime;
+	doc->size = size;
+	doc->path = search_string(st, idx, path);
+
+	/* Reuse what the previous index knew about unchanged documents */
+	if ((i = search_old(idx, path)) != ERROR) {
+		old = (sidxdoc *) ((sidxhead *) idx->old.data + 1) + i;
+
+		if (old->mtime == mtime && old->size == size) {
+			doc->type = old->type;
+			idx->old_doc[i] = idx->doc_count++;
+			idx->reused++;
+			return;
+		}
+	}
+
+	i = idx->doc_count++;
+	search_text(st, idx, i, name, strlen(name));
+
+	/* Menus: gophertag & gophermap descriptions */
+	if ((dir->mode & S_IFMT) == S_IFDIR) {
+		doc->type = TYPE_MENU;
+
+		if (dirtag(st, AT_FDCWD, realpath, buf, sizeof(buf)) == OK)
+			search_text(st, idx, i, buf, strlen(buf));
+
+		if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) < (int) sizeof(buf) &&
+		    stat(buf, &file) == OK && (file.st_mode & S_IFMT) == S_IFREG &&
+		    !(file.st_mode & S_IXOTH)) search_map(st, idx, i, buf);
+		return;
+	}
+
+	/* Text files: the contents (but never run or read scripts) */
+	doc->type = gopher_filetype(st, realpath, st->opt_magic);
+	if (doc->type != TYPE_TEXT || (dir->mode & (S_IXUSR | S_IXGRP | S_IXOTH))) return;
+
+	if ((fd = open(realpath, O_RDONLY)) == ERROR) return;
+	if ((bytes = read(fd, idx->buf, SEARCH_READ)) > 0) search_text(st, idx, i, idx->buf, bytes);
+	close(fd);
+}
+
+
+/*
+ * Check that a path doesn't lead out of the gopher root (for -B)
+ */
+int search_beneath(state *st, char *path)
+{
+	char root[PATH_MAX];
+	char real[PATH_MAX];
+	size_t len;
+
+	if (!realpath(st->server_root, root) || !realpath(path, real)) return FALSE;
+
+	len = strlen(root);
+	return (strncmp(real, root, len) == MATCH && (real[len] == '/' || real[len] == '\0' || len == 1));
+}
+
+
+/*
+ * Index a directory & everything under it that menus would list
+ */
+void search_walk(state *st, sindex *idx, char *path, int depth)
+{
+	sdirent *dir;
+	char realpath[BUFSIZE];
+	char buf[BUFSIZE];
+	int visible;
+	int hidden;
+	int num;
+	int i;
+
+	/* Paths that don't fit couldn't be served either */
+	if (depth > SEARCH_DEPTH) return;
+	if (snprintf(realpath, sizeof(realpath), "%s%s", st->server_root, path) >= (int) sizeof(realpath)) return;
+
+	/* Files hidden by the gophermap stay hidden (nothing is if a program decides) */
+	hidden = st->hidden_count;
+	if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) >= (int) sizeof(buf) ||
+	    map_hidden(st, buf) == ERROR) {
+		st->hidden_count = hidden;
+		return;
+	}
+
+	/* The hides apply to this directory only */
+	num = sortdir(realpath, &dir);
+	for (i = visible = 0; i < num; i++)
+		if (menu_visible(st, &dir[i])) dir[visible++] = dir[i];
+	st->hidden_count = hidden;
+
+	for (i = 0; i < visible; i++) {
+
+		/* Symlinks out of the root aren't served with -B */
+		if (snprintf(buf, sizeof(buf), "%s%s", realpath, dir[i].name) >= (int) sizeof(buf)) continue;
+		if (st->opt_beneath && !search_beneath(st, buf)) continue;
+
+		if ((dir[i].mode & S_IFMT) == S_IFDIR) {
+			if (snprintf(buf, sizeof(buf), "%s%s/", path, dir[i].name) >= (int) sizeof(buf)) continue;
+			search_doc(st, idx, buf, dir[i].name, &dir[i]);
+			search_walk(st, idx, buf, depth + 1);
+		}
+		else {
+			if (snprintf(buf, sizeof(buf), "%s%s", path, dir[i].name) >= (int) sizeof(buf)) continue;
+			search_doc(st, idx, buf, dir[i].name, &dir[i]);
+		}
+	}
+
+	if (dir) free(dir);
+}
+
+
+/*
+ * Map a search index & make sure it's sane (ERROR if it isn't)
+ */
+int search_open(state *st, char *file, smap *map)
+{
+	sidxhead *head;
+	sidxdoc *docs;
+	sidxword *words;
+	struct stat s;
+	int fd;
+	int i;
+	int j;
+
+	memset(map, 0, sizeof(smap));
+	if ((fd = open(file, O_RDONLY)) == ERROR) return ERROR;
+
+	if (fstat(fd, &s) == ERROR || s.st_size < (off_t) sizeof(sidxhead)) {
+		close(fd);
+		return ERROR;
+	}
+	map->size = s.st_size;
+
+#ifdef HAVE_MMAP
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map->data == MAP_FAILED) {
+		map->data = NULL;
+		return ERROR;
+	}
+	map->mapped = TRUE;
+#else
+	if (!(map->data = malloc(map->size))) {
+		close(fd);
+		return ERROR;
+	}
+	if (read(fd, map->data, map->size) != (ssize_t) map->size) {
+		close(fd);
+		map_free(map);
+		return ERROR;
+	}
+	close(fd);
+#endif
+
+	head = (sidxhead *) map->data;
+	if (memcmp(head->magic, SEARCH_MAGIC, sizeof(head->magic)) != MATCH ||
+	    head->size != map->size || head->docs < 0 || head->words < 0 ||
+	    head->postings != sizeof(sidxhead) + head->docs * sizeof(sidxdoc) + head->words * sizeof(sidxword) ||
+	    head->strings < head->postings || head->strings >= map->size ||
+	    map->data[map->size - 1] != '\0') {
+		map_free(map);
+		return ERROR;
+	}
+
+	/* Every string & posting list must be inside the file */
+	docs = (sidxdoc *) (head + 1);
+	words = (sidxword *) (docs + head->docs);
+
+	for (i = 0; i < head->docs; i++)
+		if (docs[i].path >= map->size - head->strings) break;
+	for (j = 0; j < head->words; j++)
+		if (words[j].word >= map->size - head->strings ||
+		    words[j].post > head->strings - head->postings) break;
+
+	if (i < head->docs || j < head->words) {
+		map_free(map);
+		return ERROR;
+	}
+
+	return OK;
+}
+
+
+/*
+ * Read a varint from the postings
+ */
+unsigned int search_varint(unsigned char **c, unsigned char *end)
+{
+	unsigned int val;
+	int shift;
+
+	for (val = 0, shift = 0; *c < end && shift < 32; shift += 7) {
+		val |= (unsigned int) (**c & 0x7f) << shift;
+		if (!(*(*c)++ & 0x80)) break;
+	}
+	return val;
+}
+
+
+/*
+ * Append a varint to a buffer
+ */
+size_t search_putvarint(unsigned char *out, unsigned int val)
+{
+	size_t len;
+
+	for (len = 0; val >= 0x80; val >>= 7) out[len++] = (val & 0x7f) | 0x80;
+	out[len++] = val;
+	return len;
+}
+
+
+/*
+ * Sort words of an index being built alphabetically
+ */
+int search_wordsort(const void *a, const void *b)
+{
+	return strcmp((*(sidxbuild **) a)->word, (*(sidxbuild **) b)->word);
+}
+
+
+/*
+ * Sort postings by document
+ */
+int search_postsort(const void *a, const void *b)
+{
+	const sidxpost *x = (const sidxpost *) a;
+	const sidxpost *y = (const sidxpost *) b;
+
+	if (x->doc < y->doc) return -1;
+	if (x->doc > y->doc) return 1;
+	return 0;
+}
+
+
+/*
+ * Write a built index into a file
+ */
+int search_write(state *st, sindex *idx, char *file)
+{
+	sidxhead head;
+	sidxword *words;
+	sidxbuild **list;
+	sidxbuild *w;
+	unsigned char *post;
+	unsigned char *data;
+	size_t post_size;
+	size_t post_max;
+	unsigned int prev;
+	char tmp[BUFSIZE];
+	FILE *fp;
+	int num;
+	int fd;
+	int ok;
+	int i;
+	int j;
+
+	/* Words in order */
+	list = malloc(sizeof(sidxbuild *) * (idx->word_count + 1));
+	words = malloc(sizeof(sidxword) * (idx->word_count + 1));
+	if (!list || !words) die(st, ERR_NOTFOUND, "Out of memory");
+
+	for (num = 0, i = 0; i < idx->word_max; i++)
+		if (idx->words[i].word) list[num++] = &idx->words[i];
+	if (num > 1) qsort(list, num, sizeof(sidxbuild *), search_wordsort);
+
+	/* Delta-encode the postings */
+	post = NULL;
+	post_size = post_max = 0;
+
+	for (i = 0; i < num; i++) {
+		w = list[i];
+		if (w->count > 1) qsort(w->post, w->count, sizeof(sidxpost), search_postsort);
+
+		/* Two varints take at most ten bytes */
+		if (post_size + w->count * 10 > post_max) {
+			for (post_max = post_max ? post_max : MAP_ALLOC; post_size + w->count * 10 > post_max; post_max *= 2);
+			if (!(data = realloc(post, post_max))) die(st, ERR_NOTFOUND, "Out of memory");
+			post = data;
+		}
+
+		words[i].post = post_size;
+		words[i].docs = w->count;
+
+		for (prev = 0, j = 0; j < w->count; prev = w->post[j].doc, j++) {
+			post_size += search_putvarint(post + post_size, w->post[j].doc - prev);
+			post_size += search_putvarint(post + post_size, w->post[j].count);
+		}
+	}
+
+	/* Word strings go after the paths */
+	for (i = 0; i < num; i++) words[i].word = search_string(st, idx, list[i]->word);
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, SEARCH_MAGIC, sizeof(head.magic));
+	head.docs = idx->doc_count;
+	head.words = num;
+	head.postings = sizeof(head) + idx->doc_count * sizeof(sidxdoc) + num * sizeof(sidxword);
+	head.strings = head.postings + post_size;
+	head.size = head.strings + idx->string_size;
+
+	/* Write to a temporary file & rename it in place */
+	snprintf(tmp, sizeof(tmp), "%s.%i", file, (int) getpid());
+	ok = FALSE;
+
+	fp = NULL;
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, CACHE_MODE)) != ERROR &&
+	    !(fp = fdopen(fd, "w"))) close(fd);
+
+	if (fp) {
+		fwrite(&head, sizeof(head), 1, fp);
+		fwrite(idx->docs, sizeof(sidxdoc), idx->doc_count, fp);
+		fwrite(words, sizeof(sidxword), num, fp);
+		if (post_size) fwrite(post, post_size, 1, fp);
+		fwrite(idx->strings, idx->string_size, 1, fp);
+
+		ok = !ferror(fp);
+		if (fclose(fp) != OK) ok = FALSE;
+		if (!ok || rename(tmp, file) == ERROR) {
+			unlink(tmp);
+			ok = FALSE;
+		}
+	}
+
+	free(list);
+	free(words);
+	if (post) free(post);
+	return ok ? OK : ERROR;
+}
+
+
+/*
+ * Build or update the search index of the gopher root (-I)
+ */
+void search_index(state *st)
+{
+	sidxhead *head;
+	sidxdoc *docs;
+	sidxword *words;
+	sdirent root;
+	struct stat file;
+	unsigned char *c;
+	unsigned char *end;
+	char path[BUFSIZE];
+	unsigned int doc;
+	unsigned int count;
+	unsigned long h;
+	sindex idx;
+	int i;
+	int j;
+
+	if (!*st->cache_dir) {
+		fprintf(stderr, "Indexing needs a cache directory (-C)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&idx, 0, sizeof(idx));
+	if (!(idx.buf = malloc(SEARCH_READ))) die(st, ERR_NOTFOUND, "Out of memory");
+	snprintf(path, sizeof(path), "%s/" SEARCH_FILE, st->cache_dir);
+
+	/* Remember where the documents of the previous index were */
+	if (search_open(st, path, &idx.old) == OK && ((sidxhead *) idx.old.data)->docs > 0) {
+		head = (sidxhead *) idx.old.data;
+		docs = (sidxdoc *) (head + 1);
+
+		idx.old_doc = malloc(sizeof(int) * head->docs);
+		idx.old_hash = malloc(sizeof(int) * head->docs * 2);
+		if (!idx.old_doc || !idx.old_hash) die(st, ERR_NOTFOUND, "Out of memory");
+
+		for (i = 0; i < head->docs * 2; i++) idx.old_hash[i] = ERROR;
+		for (i = 0; i < head->docs; i++) {
+			idx.old_doc[i] = ERROR;
+
+			for (h = strhash((char *) idx.old.data + head->strings + docs[i].path) % (head->docs * 2);
+				idx.old_hash[h] != ERROR; h = (h + 1) % (head->docs * 2));
+			idx.old_hash[h] = i;
+		}
+	}
+
+	/* The root menu & everything under it */
+	if (stat(st->server_root, &file) == ERROR) {
+		fprintf(stderr, "Couldn't index %s\n", st->server_root);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&root, 0, sizeof(root));
+	root.mode = file.st_mode;
+	root.mtime = file.st_mtime;
+	search_doc(st, &idx, "/", EMPTY, &root);
+	search_walk(st, &idx, "/", 0);
+
+	/* Carry over the words of unchanged documents */
+	if (idx.old_doc) {
+		head = (sidxhead *) idx.old.data;
+		words = (sidxword *) ((sidxdoc *) (head + 1) + head->docs);
+		end = (unsigned char *) idx.old.data + head->strings;
+
+		for (i = 0; i < head->words; i++) {
+			c = (unsigned char *) idx.old.data + head->postings + words[i].post;
+
+			for (doc = 0, j = 0; j < words[i].docs && c < end; j++) {
+				doc += search_varint(&c, end);
+				count = search_varint(&c, end);
+
+				if (doc < (unsigned int) head->docs && idx.old_doc[doc] != ERROR) {
+					search_add(st, &idx, idx.old.data + head->strings + words[i].word,
+						idx.old_doc[doc], count);
+				}
+			}
+		}
+	}
+
+	if (search_write(st, &idx, path) == ERROR) {
+		fprintf(stderr, "Couldn't write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Indexed %i documents (%i unchanged) and %i words into %s\n",
+		idx.doc_count, idx.reused, idx.word_count, path);
+}
+
+
+/*
+ * Find the first word of the index that is >= the given one
+ */
+int search_find(smap *map, char *word)
+{
+	sidxhead *head;
+	sidxword *words;
+	int first;
+	int last;
+	int mid;
+
+	head = (sidxhead *) map->data;
+	words = (sidxword *) ((sidxdoc *) (head + 1) + head->docs);
+
+	for (first = 0, last = head->words; first < last;) {
+		mid = (first + last) / 2;
+		if (strcmp(map->data + head->strings + words[mid].word, word) < 0) first = mid + 1;
+		else last = mid;
+	}
+
+	return first;
+}
+
+
+/*
+ * Sort search results best first
+ */
+int search_hitsort(const void *a, const void *b)
+{
+	const sidxhit *x = (const sidxhit *) a;
+	const sidxhit *y = (const sidxhit *) b;
+
+	if (x->score > y->score) return -1;
+	if (x->score < y->score) return 1;
+	return x->doc - y->doc;
+}
+
+
+/*
+ * Handle /server-search (words ending with * match as prefixes)
+ */
+void server_search(state *st)
+{
+	sidxhead *head;
+	sidxdoc *docs;
+	sidxword *words;
+	sidxhit *hits;
+	smap map;
+	struct stat file;
+	unsigned char *c;
+	unsigned char *end;
+	unsigned int *score;
+	unsigned char *seen;
+	char term[SEARCH_TERMS][SEARCH_WORD + 2];
+	char buf[BUFSIZE];
+	char root[BUFSIZE];
+	char display[BUFSIZE];
+	char encoded[BUFSIZE];
+	char *path;
+	unsigned int doc;
+	unsigned int count;
+	size_t len;
+	int terms;
+	int found;
+	int prefix;
+	int i;
+	int j;
+	int k;
+	int n;
+
+	st->req_filetype = TYPE_QUERY;
+	st->req_kind = KIND_MENU;
+
+	snprintf(buf, sizeof(buf), "%s/" SEARCH_FILE, st->cache_dir);
+	if (!*st->cache_dir || search_open(st, buf, &map) == ERROR)
+		die(st, ERR_NOTFOUND, "No search index");
+
+	head = (sidxhead *) map.data;
+	docs = (sidxdoc *) (head + 1);
+	words = (sidxword *) (docs + head->docs);
+	end = (unsigned char *) map.data + head->strings;
+
+	/* Split the query into words like the indexer does */
+	for (terms = 0, n = 0, path = st->req_query_string;; path++) {
+		if (*path && (isalnum((unsigned char) *path) || (unsigned char) *path >= 0x80)) {
+			if (n < SEARCH_WORD && terms < SEARCH_TERMS) term[terms][n] = tolower((unsigned char) *path);
+			n++;
+			continue;
+		}
+
+		/* Prefixes can be shorter than indexed words */
+		prefix = (*path == '*');
+		if (terms < SEARCH_TERMS && n <= SEARCH_WORD && (n >= SEARCH_MIN || (prefix && n > 0))) {
+			term[terms][n] = prefix ? '*' : '\0';
+			term[terms][n + 1] = '\0';
+			terms++;
+		}
+		n = 0;
+		if (!*path) break;
+	}
+
+	/* Only show documents of the current virtual host (hosts without one get the default) */
+	strclear(root);
+	if (st->opt_vhost) {
+		snprintf(buf, sizeof(buf), "%s/%s", st->server_root, st->server_host);
+		if (stat(buf, &file) == OK && (file.st_mode & S_IFMT) == S_IFDIR)
+			snprintf(root, sizeof(root), "/%s", st->server_host);
+		else snprintf(root, sizeof(root), "/%s", st->server_host_default);
+	}
+	len = strlen(root);
+
+	/* Documents having all the words, best first */
+	found = 0;
+	hits = NULL;
+
+	if (terms > 0 && head->docs > 0) {
+		score = calloc(head->docs, sizeof(unsigned int));
+		seen = calloc(head->docs, sizeof(unsigned char));
+		if (!score || !seen) die(st, ERR_NOTFOUND, "Out of memory");
+
+		for (i = 0; i < terms; i++) {
+			prefix = (strlast(term[i]) == '*');
+			if (prefix) term[i][strlen(term[i]) - 1] = '\0';
+
+			for (j = search_find(&map, term[i]); j < head->words; j++) {
+				path = map.data + head->strings + words[j].word;
+				if (prefix ? strncmp(path, term[i], strlen(term[i])) != MATCH : strcmp(path, term[i]) != MATCH) break;
+
+				/* Rare words weigh more */
+				c = (unsigned char *) map.data + head->postings + words[j].post;
+				for (doc = 0, k = 0; k < words[j].docs && c < end; k++) {
+					doc += search_varint(&c, end);
+					count = search_varint(&c, end);
+					if (doc >= (unsigned int) head->docs || seen[doc] < i) continue;
+
+					seen[doc] = i + 1;
+					score[doc] += count * (1 + head->docs / words[j].docs);
+				}
+			}
+		}
+
+		for (i = 0; i < head->docs; i++) {
+			if (seen[i] != terms) continue;
+			path = map.data + head->strings + docs[i].path;
+			if (len && (strncmp(path, root, len) != MATCH || path[len] != '/')) continue;
+
+			if (found % SDIRENT_ALLOC == 0 &&
+			    !(hits = realloc(hits, sizeof(sidxhit) * (found + SDIRENT_ALLOC))))
+				die(st, ERR_NOTFOUND, "Out of memory");
+			hits[found].doc = i;
+			hits[found].score = score[i];
+			found++;
+		}
+
+		free(score);
+		free(seen);
+		if (found > 1) qsort(hits, found, sizeof(sidxhit), search_hitsort);
+	}
+
+	/* Output the results as a menu */
+	if (terms > 0) {
+		if (snprintf(buf, sizeof(buf), "%i documents found for \"%s\"", found,
+		    st->req_query_string) >= (int) sizeof(buf))
+			snprintf(buf, sizeof(buf), "%i documents found", found);
+		info(st, buf, TYPE_TITLE);
+		info(st, EMPTY, TYPE_INFO);
+	}
+
+	for (i = 0; i < found && i < SEARCH_RESULTS; i++) {
+		path = map.data + head->strings + docs[hits[i].doc].path + len;
+
+		if (st->opt_iconv) sstrniconv(st->out_charset, display, path);
+		else sstrlcpy(display, path);
+		strcut(display, st->out_width);
+		strnencode(encoded, path, sizeof(encoded));
+
+		printf("%c%s\t%s\t%s\t%i" CRLF, docs[hits[i].doc].type, display,
+			encoded, st->server_host, st->server_port);
+	}
+
+	if (found > SEARCH_RESULTS) {
+		snprintf(buf, sizeof(buf), "(%i more not shown)", found - SEARCH_RESULTS);
+		info(st, buf, TYPE_INFO);
+	}
+	if (terms > 0) info(st, EMPTY, TYPE_INFO);
+
+	printf("%cSearch this server\t" SERVER_SEARCH "\t%s\t%i" CRLF, TYPE_QUERY,
+		st->server_host, st->server_port);
+	footer(st);
+
+	if (hits) free(hits);
+	map_free(&map);
+	finish(st);
+}
@@ -79,6 +79,7 @@ void update_shm_session(state *st, shm_state *shm)
 {
 	time_t now;
 	char buf[BUFSIZE];
+	long kbytes;
 	int delay;
 	int i;
 
@@ -96,7 +97,7 @@ void update_shm_session(state *st, shm_state *shm)
 				/* Found slot -> initialize it */
 				sstrlcpy(shm->session[i].req_remote_addr, st->req_remote_addr);
 				shm->session[i].hits = 0;
-				shm->session[i].kbytes = 0;
+				shm->session[i].bytes = 0;
 				shm->session[i].session_id = rand();
 				break;
 			}
@@ -128,17 +129,19 @@ void update_shm_session(state *st, shm_state *shm)
 	shm->session[i].req_atime = now;
 
 	shm->session[i].hits++;
-	shm->session[i].kbytes += st->req_filesize / 1024;
 
-	/* Transfer limits exceeded? */
-	if ((st->session_max_kbytes && shm->session[i].kbytes > st->session_max_kbytes) ||
+	/* Transfer limits exceeded? (bytes are from the previous requests) */
+	kbytes = (long) (shm->session[i].bytes / 1024);
+
+	if ((st->session_max_kbytes && kbytes > st->session_max_kbytes) ||
 	    (st->session_max_hits && shm->session[i].hits > st->session_max_hits)) {
 
 		/* Calculate throttle delay */
-		delay = max(shm->session[i].kbytes / st->session_max_kbytes,
+		delay = max(kbytes / st->session_max_kbytes,
 			shm->session[i].hits / st->session_max_hits);
 
 		/* Throttle user */
+		shm->throttles++;
 		syslog(LOG_INFO, "throttling user from %s for %i seconds",
 			st->req_remote_addr, delay);
 		sleep(delay);
@@ -146,3 +149,28 @@ void update_shm_session(state *st, shm_state *shm)
 }
 #endif
 
+
+
+/*
+ * Add the bytes sent to the client to shared memory accounting
+ */
+#ifdef HAVE_SHMEM
+void update_shm_bytes(state *st, shm_state *shm)
+{
+	int i;
+
+	/* Without a counting stdout we only know the file size */
+#ifndef HAVE_SINK
+	if (st->out_bytes < st->req_filesize) st->out_bytes = st->req_filesize;
+#endif
+
+	/* Global & heavy hitter accounting */
+	shm->bytes += st->out_bytes;
+	if (st->out_bytes > 0)
+		sketch_update(&shm->top_clients_bytes, st->req_remote_addr, (long) st->out_bytes);
+
+	/* User session */
+	if ((i = get_shm_session_id(st, shm)) != ERROR)
+		shm->session[i].bytes += st->out_bytes;
+}
+#endif
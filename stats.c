@@ -0,0 +1,597 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Mark the end of a request phase
+ */
+void timer_phase(state *st, int phase)
+{
+	long long now;
+
+	now = monotime();
+	st->req_usecs[phase] += (long) (now - st->req_timer);
+	st->req_phases |= (1 << phase);
+	st->req_timer = now;
+}
+
+
+/*
+ * Map microseconds to a log-bucketed histogram slot
+ */
+int hist_bucket(long usecs)
+{
+	int shift;
+
+	/* Small values get a bucket of their own */
+	if (usecs < 0) usecs = 0;
+	if (usecs < (1 << HIST_SUB_BITS)) return (int) usecs;
+
+	/* Find the power of two, keep HIST_SUB_BITS of precision below it */
+	for (shift = 0; (usecs >> shift) >= (2 << HIST_SUB_BITS); shift++);
+
+	return min(((shift + 1) << HIST_SUB_BITS) +
+		(int) (usecs >> shift) - (1 << HIST_SUB_BITS), HIST_BUCKETS - 1);
+}
+
+
+/*
+ * Return the highest microsecond value that maps to a histogram slot
+ */
+long hist_value(int bucket)
+{
+	int shift;
+	long mantissa;
+
+	if (bucket < (1 << HIST_SUB_BITS)) return bucket;
+
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+	mantissa = (bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+
+/*
+ * Return a percentile (in permilles) from a latency histogram
+ */
+#ifdef HAVE_SHMEM
+long hist_percentile(shm_histogram *hist, int permille)
+{
+	long target;
+	long seen;
+	int i;
+
+	/* Empty histogram */
+	if (hist->count <= 0) return 0;
+
+	/* Rank of the wanted sample, rounded up */
+	target = (long) (((long long) hist->count * permille + 999) / 1000);
+	if (target < 1) target = 1;
+
+	/* Walk the buckets until we've seen enough samples */
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target) return hist_value(i);
+	}
+
+	/* Concurrent updates may leave count ahead of the buckets */
+	return hist_value(HIST_BUCKETS - 1);
+}
+#endif
+
+
+/*
+ * Add request timings to the shared memory histograms
+ */
+void update_shm_stats(state *st)
+{
+#ifdef HAVE_SHMEM
+	shm_histogram *hist;
+	long usecs;
+	int phase;
+
+	/* Requests that were accounted for already (like a failed exec()) */
+	if (!st->shm || !st->req_start) return;
+
+	/* Whole request */
+	st->req_usecs[PHASE_TOTAL] = (long) (monotime() - st->req_start);
+	st->req_phases |= (1 << PHASE_TOTAL);
+
+	/* Only account for the phases the request went through */
+	for (phase = 0; phase < PHASES; phase++) {
+		if ((st->req_phases & (1 << phase)) == 0) continue;
+
+		usecs = st->req_usecs[phase];
+		hist = &st->shm->latency[st->req_kind][phase];
+
+		hist->count++;
+		hist->usecs += usecs;
+		hist->bucket[hist_bucket(usecs)]++;
+	}
+
+	/* Don't count the same request twice */
+	st->req_phases = 0;
+	st->req_start = 0;
+#endif
+}
+
+
+/*
+ * Print latency percentiles for /server-status
+ */
+#ifdef HAVE_SHMEM
+void latency_status(shm_state *shm)
+{
+	static const char *kinds[] = { KIND_NAMES };
+	static const char *phases[] = { PHASE_NAMES };
+	shm_histogram *hist;
+	int kind;
+	int phase;
+
+	for (kind = 0; kind < KINDS; kind++) {
+		for (phase = 0; phase < PHASES; phase++) {
+
+			/* Skip unused histograms */
+			hist = &shm->latency[kind][phase];
+			if (hist->count <= 0) continue;
+
+			printf("Latency: %-6s %-7s %-8li %-8li %-8li %-8li %li" CRLF,
+				kinds[kind],
+				phases[phase],
+				hist->count,
+				hist_percentile(hist, 500),
+				hist_percentile(hist, 900),
+				hist_percentile(hist, 990),
+				hist_percentile(hist, 999));
+		}
+	}
+}
+#endif
+
+
+/*
+ * Add weight to a key in a space-saving sketch
+ */
+#ifdef HAVE_SHMEM
+void sketch_update(shm_sketch *sketch, char *key, long weight)
+{
+	shm_hitter *h;
+	int low;
+	int i;
+
+	/* Look for an existing counter, remember the smallest one */
+	low = 0;
+	for (i = 0; i < SHM_HITTERS; i++) {
+		h = &sketch->hitter[i];
+
+		if (h->count > 0 && strcmp(h->key, key) == MATCH) {
+			h->count += weight;
+			return;
+		}
+
+		if (h->count < sketch->hitter[low].count) low = i;
+	}
+
+	/* Not found - the smallest counter inherits its count as error */
+	h = &sketch->hitter[low];
+	h->error = h->count;
+	h->count += weight;
+	sstrlcpy(h->key, key);
+}
+#endif
+
+
+/*
+ * Heaviest first sort for sketch_sort()
+ */
+#ifdef HAVE_SHMEM
+int hittersort(const void *a, const void *b)
+{
+	long acount = (*(shm_hitter *) a).count;
+	long bcount = (*(shm_hitter *) b).count;
+
+	if (acount > bcount) return -1;
+	if (acount < bcount) return 1;
+	return strcmp((*(shm_hitter *) a).key, (*(shm_hitter *) b).key);
+}
+#endif
+
+
+/*
+ * Copy & sort the used counters of a sketch, return the count
+ */
+#ifdef HAVE_SHMEM
+int sketch_sort(shm_sketch *sketch, shm_hitter *list)
+{
+	int num;
+	int i;
+
+	for (num = i = 0; i < SHM_HITTERS; i++)
+		if (sketch->hitter[i].count > 0) list[num++] = sketch->hitter[i];
+
+	if (num > 1) qsort(list, num, sizeof(shm_hitter), hittersort);
+	return num;
+}
+#endif
+
+
+/*
+ * Update the heavy hitter sketches
+ */
+#ifdef HAVE_SHMEM
+void update_shm_hitters(state *st, shm_state *shm)
+{
+	char key[BUFSIZE];
+
+	/* One sketch for all vhosts, keyed by vhost (unless too long to tell apart) */
+	if (snprintf(key, sizeof(key), "%s:%i/%c%s",
+		st->server_host,
+		st->server_port,
+		st->req_filetype,
+		st->req_selector) < (int) sizeof(shm->top_selectors.hitter[0].key))
+		sketch_update(&shm->top_selectors, key, 1);
+
+	/* Clients by hits (bytes are counted after sending) */
+	sketch_update(&shm->top_clients, st->req_remote_addr, 1);
+}
+#endif
+
+
+/*
+ * Print heavy hitters for /server-status
+ */
+#ifdef HAVE_SHMEM
+void sketch_status(char *name, shm_sketch *sketch)
+{
+	shm_hitter list[SHM_HITTERS];
+	int num;
+	int i;
+
+	num = sketch_sort(sketch, list);
+	for (i = 0; i < num; i++)
+		printf("%s: %-10li %-10li %s" CRLF, name, list[i].count, list[i].error, list[i].key);
+}
+#endif
+
+
+/*
+ * Print heavy hitters as a JSON array
+ */
+#ifdef HAVE_SHMEM
+void sketch_json(char *name, shm_sketch *sketch)
+{
+	shm_hitter list[SHM_HITTERS];
+	char key[BUFSIZE];
+	int num;
+	int i;
+
+	printf("  \"%s\": [", name);
+	num = sketch_sort(sketch, list);
+
+	for (i = 0; i < num; i++) {
+		strnjson(key, list[i].key, sizeof(key));
+		printf("%s\n    { \"key\": \"%s\", \"count\": %li, \"error\": %li }",
+			i ? "," : "", key, list[i].count, list[i].error);
+	}
+	printf("%s],\n", num ? "\n  " : "");
+}
+#endif
+
+
+/*
+ * Print Prometheus metric metadata
+ */
+void prom_metric(char *name, char *type, char *help)
+{
+	printf("# HELP " STATUS_PREFIX "%s %s\n", name, help);
+	printf("# TYPE " STATUS_PREFIX "%s %s\n", name, type);
+}
+
+
+/*
+ * Print heavy hitters as Prometheus gauges (count & overestimation)
+ */
+#ifdef HAVE_SHMEM
+void sketch_prometheus(char *name, char *label, char *help, shm_sketch *sketch)
+{
+	shm_hitter list[SHM_HITTERS];
+	char key[BUFSIZE];
+	char buf[BUFSIZE];
+	int num;
+	int i;
+
+	num = sketch_sort(sketch, list);
+
+	prom_metric(name, "gauge", help);
+	for (i = 0; i < num; i++) {
+		strnprom(key, list[i].key, sizeof(key));
+		printf(STATUS_PREFIX "%s{%s=\"%s\"} %li\n", name, label, key, list[i].count);
+	}
+
+	snprintf(buf, sizeof(buf), "%s_error", name);
+	prom_metric(buf, "gauge", "Maximum overestimation of the count above.");
+	for (i = 0; i < num; i++) {
+		strnprom(key, list[i].key, sizeof(key));
+		printf(STATUS_PREFIX "%s{%s=\"%s\"} %li\n", buf, label, key, list[i].error);
+	}
+}
+#endif
+
+
+/*
+ * Print /server-status in Prometheus text exposition format
+ */
+#ifdef HAVE_SHMEM
+void status_prometheus(state *st, shm_state *snap, int uptime, int sessions, int busy)
+{
+	static const char *kinds[] = { KIND_NAMES };
+	static const char *phases[] = { PHASE_NAMES };
+	static const char *errors[] = { ERR_TYPE_NAMES };
+	static const int quantiles[] = { 500, 900, 990, 999 };
+	shm_histogram *hist;
+	long seen;
+	int kind;
+	int phase;
+	int bucket;
+	int i;
+
+	http_header(st, "text/plain; version=0.0.4");
+
+	/* Counters */
+	prom_metric("requests_total", "counter", "Total number of requests.");
+	printf(STATUS_PREFIX "requests_total %li\n", snap->hits);
+
+	prom_metric("sent_bytes_total", "counter", "Total number of bytes sent to clients.");
+	printf(STATUS_PREFIX "sent_bytes_total %lli\n", snap->bytes);
+
+	prom_metric("errors_total", "counter", "Total number of errors by type.");
+	for (i = 0; i < ERR_TYPES; i++)
+		printf(STATUS_PREFIX "errors_total{type=\"%s\"} %li\n", errors[i], snap->errors[i]);
+
+	prom_metric("throttles_total", "counter", "Total number of throttled requests.");
+	printf(STATUS_PREFIX "throttles_total %li\n", snap->throttles);
+
+	prom_metric("notfound_cache_hits_total", "counter", "Total number of requests answered from the not found cache.");
+	printf(STATUS_PREFIX "notfound_cache_hits_total %li\n", snap->notfound_hits);
+
+	prom_metric("memo_hits_total", "counter", "Total number of requests using a memoized selector resolution.");
+	printf(STATUS_PREFIX "memo_hits_total %li\n", snap->memo_hits);
+
+	prom_metric("shared_responses_total", "counter", "Total number of requests answered with a response computed by a concurrent request.");
+	printf(STATUS_PREFIX "shared_responses_total %li\n", snap->flight_shared);
+
+	/* Gauges */
+	prom_metric("uptime_seconds", "gauge", "Seconds since the shared memory was initialized.");
+	printf(STATUS_PREFIX "uptime_seconds %i\n", uptime);
+
+	prom_metric("sessions", "gauge", "Number of active user sessions.");
+	printf(STATUS_PREFIX "sessions %i\n", sessions);
+
+	prom_metric("busy_servers", "gauge", "Number of server processes attached to the shared memory.");
+	printf(STATUS_PREFIX "busy_servers %i\n", busy);
+
+	prom_metric("load_average", "gauge", "System load average.");
+	printf(STATUS_PREFIX "load_average %.2f\n", loadavg());
+
+	prom_metric("vhosts", "gauge", "Number of indexed virtual hosts (-1 if not indexed).");
+	printf(STATUS_PREFIX "vhosts %i\n", snap->vhost_count);
+
+	prom_metric("vhost_cache_entries", "gauge", "Number of valid selector to vhost cache entries.");
+	printf(STATUS_PREFIX "vhost_cache_entries %i\n", vhost_cache_used(snap));
+
+	prom_metric("userdirs", "gauge", "Number of indexed ~userdirs (-1 if not indexed).");
+	printf(STATUS_PREFIX "userdirs %i\n", snap->user_count);
+
+	prom_metric("notfound_cache_entries", "gauge", "Number of valid not found cache entries.");
+	printf(STATUS_PREFIX "notfound_cache_entries %i\n", notfound_used(snap));
+
+	prom_metric("memo_entries", "gauge", "Number of valid resolved selector memo entries.");
+	printf(STATUS_PREFIX "memo_entries %i\n", memo_used(snap));
+
+	prom_metric("watched_dirs", "gauge", "Number of directories watched for changes (0 if no watcher).");
+	printf(STATUS_PREFIX "watched_dirs %i\n", watch_active(snap) ? snap->watch_dirs : 0);
+
+	/* Heavy hitters */
+	sketch_prometheus("top_selector_hits", "selector", "Hits of the hottest selectors (host:port/type+selector).", &snap->top_selectors);
+	sketch_prometheus("top_client_hits", "client", "Hits of the busiest clients.", &snap->top_clients);
+	sketch_prometheus("top_client_bytes", "client", "Bytes sent to the busiest clients.", &snap->top_clients_bytes);
+
+	/* Whole request latencies as histograms with power-of-two buckets */
+	prom_metric("request_duration_seconds", "histogram", "Request latency by request kind.");
+	for (kind = 0; kind < KINDS; kind++) {
+		hist = &snap->latency[kind][PHASE_TOTAL];
+		if (hist->count <= 0) continue;
+
+		seen = 0;
+		bucket = 0;
+		for (i = (1 << HIST_SUB_BITS) * 2; i <= (1 << 27); i <<= 1) {
+
+			/* Sum up all slots that are below the boundary */
+			while (bucket < HIST_BUCKETS && hist_value(bucket) < i)
+				seen += hist->bucket[bucket++];
+
+			printf(STATUS_PREFIX "request_duration_seconds_bucket{kind=\"%s\",le=\"%.6f\"} %li\n",
+				kinds[kind], (double) i / 1000000, seen);
+		}
+
+		printf(STATUS_PREFIX "request_duration_seconds_bucket{kind=\"%s\",le=\"+Inf\"} %li\n",
+			kinds[kind], hist->count);
+		printf(STATUS_PREFIX "request_duration_seconds_sum{kind=\"%s\"} %.6f\n",
+			kinds[kind], (double) hist->usecs / 1000000);
+		printf(STATUS_PREFIX "request_duration_seconds_count{kind=\"%s\"} %li\n",
+			kinds[kind], hist->count);
+	}
+
+	/* Per-phase latencies as summaries */
+	prom_metric("phase_duration_seconds", "summary", "Request phase latency by request kind.");
+	for (kind = 0; kind < KINDS; kind++) {
+		for (phase = 0; phase < PHASE_TOTAL; phase++) {
+			hist = &snap->latency[kind][phase];
+			if (hist->count <= 0) continue;
+
+			for (i = 0; i < (int) (sizeof(quantiles) / sizeof(quantiles[0])); i++) {
+				printf(STATUS_PREFIX "phase_duration_seconds{kind=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+					kinds[kind], phases[phase], (double) quantiles[i] / 1000,
+					(double) hist_percentile(hist, quantiles[i]) / 1000000);
+			}
+
+			printf(STATUS_PREFIX "phase_duration_seconds_sum{kind=\"%s\",phase=\"%s\"} %.6f\n",
+				kinds[kind], phases[phase], (double) hist->usecs / 1000000);
+			printf(STATUS_PREFIX "phase_duration_seconds_count{kind=\"%s\",phase=\"%s\"} %li\n",
+				kinds[kind], phases[phase], hist->count);
+		}
+	}
+}
+#endif
+
+
+/*
+ * Print /server-status as JSON
+ */
+#ifdef HAVE_SHMEM
+void status_json(state *st, shm_state *snap, int uptime, int sessions, int busy)
+{
+	static const char *kinds[] = { KIND_NAMES };
+	static const char *phases[] = { PHASE_NAMES };
+	static const char *errors[] = { ERR_TYPE_NAMES };
+	shm_histogram *hist;
+	char selector[BUFSIZE];
+	char host[BUFSIZE];
+	char addr[BUFSIZE];
+	time_t now;
+	int kind;
+	int phase;
+	int first;
+	int i;
+
+	http_header(st, "application/json");
+
+	/* Counters & gauges */
+	printf("{\n"
+		"  \"uptime\": %i,\n"
+		"  \"hits\": %li,\n"
+		"  \"bytes\": %lli,\n"
+		"  \"throttles\": %li,\n"
+		"  \"sessions\": %i,\n"
+		"  \"busy_servers\": %i,\n"
+		"  \"load_average\": %.2f,\n"
+		"  \"vhosts\": %i,\n"
+		"  \"vhost_cache_entries\": %i,\n"
+		"  \"userdirs\": %i,\n"
+		"  \"notfound_cache_entries\": %i,\n"
+		"  \"notfound_cache_hits\": %li,\n"
+		"  \"memo_entries\": %i,\n"
+		"  \"memo_hits\": %li,\n"
+		"  \"watched_dirs\": %i,\n"
+		"  \"shared_responses\": %li,\n",
+			uptime,
+			snap->hits,
+			snap->bytes,
+			snap->throttles,
+			sessions,
+			busy,
+			loadavg(),
+			snap->vhost_count,
+			vhost_cache_used(snap),
+			snap->user_count,
+			notfound_used(snap),
+			snap->notfound_hits,
+			memo_used(snap),
+			snap->memo_hits,
+			watch_active(snap) ? snap->watch_dirs : 0,
+			snap->flight_shared);
+
+	printf("  \"errors\": {");
+	for (i = 0; i < ERR_TYPES; i++)
+		printf("%s\"%s\": %li", i ? ", " : " ", errors[i], snap->errors[i]);
+	printf(" },\n");
+
+	/* Latencies in microseconds */
+	printf("  \"latency\": {");
+	first = TRUE;
+
+	for (kind = 0; kind < KINDS; kind++) {
+		if (snap->latency[kind][PHASE_TOTAL].count <= 0) continue;
+
+		printf("%s\n    \"%s\": {", first ? "" : ",", kinds[kind]);
+		first = FALSE;
+
+		for (i = 0, phase = 0; phase < PHASES; phase++) {
+			hist = &snap->latency[kind][phase];
+			if (hist->count <= 0) continue;
+
+			printf("%s\n      \"%s\": { \"count\": %li, \"usecs\": %lli, "
+				"\"p50\": %li, \"p90\": %li, \"p99\": %li, \"p999\": %li }",
+				i++ ? "," : "",
+				phases[phase],
+				hist->count,
+				hist->usecs,
+				hist_percentile(hist, 500),
+				hist_percentile(hist, 900),
+				hist_percentile(hist, 990),
+				hist_percentile(hist, 999));
+		}
+		printf("\n    }");
+	}
+	printf("%s},\n", first ? " " : "\n  ");
+
+	/* Heavy hitters */
+	sketch_json("top_selectors", &snap->top_selectors);
+	sketch_json("top_clients", &snap->top_clients);
+	sketch_json("top_clients_bytes", &snap->top_clients_bytes);
+
+	/* Active sessions */
+	printf("  \"session_list\": [");
+	now = time(NULL);
+	first = TRUE;
+
+	for (i = 0; i < SHM_SESSIONS; i++) {
+		if ((now - snap->session[i].req_atime) >= st->session_timeout) continue;
+
+		strnjson(addr, snap->session[i].req_remote_addr, sizeof(addr));
+		strnjson(host, snap->session[i].server_host, sizeof(host));
+		strnjson(selector, snap->session[i].req_selector, sizeof(selector));
+
+		printf("%s\n    { \"idle\": %i, \"remote_addr\": \"%s\", \"hits\": %li, \"bytes\": %lli, "
+			"\"url\": \"gopher://%s:%i/%c%s\" }",
+			first ? "" : ",",
+			(int) (now - snap->session[i].req_atime),
+			addr,
+			snap->session[i].hits,
+			snap->session[i].bytes,
+			host,
+			snap->session[i].server_port,
+			snap->session[i].req_filetype,
+			selector);
+		first = FALSE;
+	}
+	printf("%s]\n}\n", first ? "" : "\n  ");
+}
+#endif
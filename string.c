@@ -88,7 +88,7 @@ char *strkey(char *header, char *key)
 
 	if (strncasecmp(header, key, len) == MATCH) {
 		c = header + len;
-		do { c++; } while (*c == ' ' || *c == '\t');
+		while (*c == ' ' || *c == '\t') c++;
 
 		if (*c != ':') return NULL;
 
@@ -305,6 +305,399 @@ void strndecode(char *out, char *in, size_t outsize)
 }
 
 
+/*
+ * Compare strings so that runs of digits compare numerically
+ */
+int strnatcmp(const char *a, const char *b)
+{
+	const unsigned char *ua = (const unsigned char *) a;
+	const unsigned char *ub = (const unsigned char *) b;
+	int la;
+	int lb;
+	int i;
+
+	while (*ua && *ub) {
+
+		/* Compare non-digits as characters */
+		if (!(*ua >= '0' && *ua <= '9') || !(*ub >= '0' && *ub <= '9')) {
+			if (*ua != *ub) return *ua - *ub;
+			ua++;
+			ub++;
+			continue;
+		}
+
+		/* Skip leading zeros */
+		while (*ua == '0') ua++;
+		while (*ub == '0') ub++;
+
+		/* Longer number is bigger */
+		for (la = 0; ua[la] >= '0' && ua[la] <= '9'; la++);
+		for (lb = 0; ub[lb] >= '0' && ub[lb] <= '9'; lb++);
+		if (la != lb) return la - lb;
+
+		/* Same length - compare digit by digit */
+		for (i = 0; i < la; i++)
+			if (ua[i] != ub[i]) return ua[i] - ub[i];
+
+		ua += la;
+		ub += lb;
+	}
+
+	return *ua - *ub;
+}
+
+
+/*
+ * Hash a string (32-bit FNV-1a)
+ */
+unsigned long strhash(const char *str)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	return hash;
+}
+
+
+/*
+ * Escape a string for use inside JSON double quotes
+ */
+void strnjson(char *out, const char *in, size_t outsize)
+{
+	char buf[8];
+	size_t len;
+
+	while (*in && outsize > 1) {
+
+		/* Escape quotes, backslashes and control chars */
+		if (*in == '"' || *in == '\\') snprintf(buf, sizeof(buf), "\\%c", *in);
+		else if ((unsigned char) *in < 0x20) snprintf(buf, sizeof(buf), "\\u%04x", *in);
+		else { buf[0] = *in; buf[1] = '\0'; }
+
+		/* Never output partial escapes */
+		if ((len = strlen(buf)) >= outsize) break;
+
+		memcpy(out, buf, len);
+		out += len;
+		outsize -= len;
+		in++;
+	}
+
+	*out = '\0';
+}
+
+
+/*
+ * Escape a string for use as a Prometheus label value
+ */
+void strnprom(char *out, const char *in, size_t outsize)
+{
+	char buf[4];
+	size_t len;
+
+	while (*in && outsize > 1) {
+
+		/* The format only knows three escapes - drop other control chars */
+		if (*in == '"' || *in == '\\') snprintf(buf, sizeof(buf), "\\%c", *in);
+		else if (*in == '\n') snprintf(buf, sizeof(buf), "\\n");
+		else if ((unsigned char) *in < 0x20) buf[0] = '\0';
+		else { buf[0] = *in; buf[1] = '\0'; }
+
+		/* Never output partial escapes */
+		if ((len = strlen(buf)) >= outsize) break;
+
+		memcpy(out, buf, len);
+		out += len;
+		outsize -= len;
+		in++;
+	}
+
+	*out = '\0';
+}
+
+
+/*
+ * Escape a string for use in HTML text & attributes
+ */
+void strnhtml(char *out, const char *in, size_t outsize)
+{
+	char *entity;
+	char buf[2];
+	size_t len;
+
+	while (*in && outsize > 1) {
+
+		/* Escape markup chars */
+		if (*in == '&') entity = "&amp;";
+		else if (*in == '<') entity = "&lt;";
+		else if (*in == '>') entity = "&gt;";
+		else if (*in == '"') entity = "&quot;";
+		else if (*in == '\'') entity = "&#39;";
+		else { buf[0] = *in; buf[1] = '\0'; entity = buf; }
+
+		/* Never output partial escapes */
+		if ((len = strlen(entity)) >= outsize) break;
+
+		memcpy(out, entity, len);
+		out += len;
+		outsize -= len;
+		in++;
+	}
+
+	*out = '\0';
+}
+
+
+/*
+ * Encode a selector for use in an URL with %HEX encoding
+ */
+void strnurl(char *out, const char *in, size_t outsize)
+{
+	unsigned char c;
+
+	while ((c = *in++) && outsize > 1) {
+
+		/* Need to encode the char? */
+		if (c <= ' ' || c > '~' || strchr("\"#%<>'\\^`{|}", c)) {
+
+			/* Never output partial encodings */
+			if (outsize < 4) break;
+
+			snprintf(out, outsize, "%%%02X", c);
+			out += 3;
+			outsize -= 3;
+		}
+
+		/* Copy regular chars */
+		else {
+			*out++ = c;
+			outsize--;
+		}
+	}
+
+	*out = '\0';
+}
+
+
+/*
+ * Convert days since the epoch to a civil date
+ */
+void days_to_civil(long days, int *year, int *month, int *day)
+{
+	long era;
+	long doe;
+	long yoe;
+	long doy;
+	long mp;
+
+	/* Shift the epoch to 0000-03-01 so leap days end the year */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = (mp < 10) ? mp + 3 : mp - 9;
+	*year = yoe + era * 400 + (*month <= 2);
+}
+
+
+/*
+ * Convert a civil date to days since the epoch
+ */
+long civil_to_days(int year, int month, int day)
+{
+	long era;
+	long yoe;
+	long doy;
+
+	year -= (month <= 2);
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+/*
+ * Return the UTC offset of a local broken-down time
+ */
+long tmoffset(struct tm *tm, time_t t)
+{
+	return (civil_to_days(tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday) * 86400 +
+		tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec) - t;
+}
+
+
+/*
+ * Look up the local UTC offset in seconds for a timestamp, return ERROR
+ * if the offset changes during that day
+ */
+int tzoffset(time_t t, long *offset)
+{
+	static struct {
+		long day;
+		long offset;
+		int valid;
+	} cache[DATE_CACHE];
+	struct tm tm;
+	time_t start;
+	time_t end;
+	long day;
+	int i;
+
+	/* UTC day of the timestamp */
+	day = (t >= 0) ? t / 86400 : -((-t + 86399) / 86400);
+	i = day & (DATE_CACHE - 1);
+
+	/* Seen this day already? */
+	if (cache[i].day == day && cache[i].valid != 0) {
+		*offset = cache[i].offset;
+		return (cache[i].valid == TRUE) ? OK : ERROR;
+	}
+
+	/* Ask the C library at both ends of the day */
+	start = (time_t) day * 86400;
+	end = start + 86399;
+
+	localtime_r(&start, &tm);
+	*offset = tmoffset(&tm, start);
+	localtime_r(&end, &tm);
+
+	cache[i].day = day;
+	cache[i].offset = *offset;
+	cache[i].valid = (tmoffset(&tm, end) == *offset) ? TRUE : -1;
+
+	return (cache[i].valid == TRUE) ? OK : ERROR;
+}
+
+
+/*
+ * Format a file timestamp exactly like strftime(DATE_FORMAT), only faster
+ */
+void strfdate(char *out, time_t t, size_t outsize)
+{
+	static const char *month[] = { DATE_MONTHS };
+	struct tm tm;
+	long offset;
+	long local;
+	long secs;
+	int y, m, d;
+
+	/* Custom formats, DST change days and odd years go the slow way */
+	if (strcmp(DATE_FORMAT, "%Y-%b-%d %H:%M") != 0 || outsize <= DATE_WIDTH ||
+	    tzoffset(t, &offset) == ERROR) {
+		localtime_r(&t, &tm);
+		strftime(out, outsize, DATE_FORMAT, &tm);
+		return;
+	}
+
+	/* Split local time into days and seconds */
+	local = t + offset;
+	secs = local % 86400;
+	if (secs < 0) secs += 86400;
+	days_to_civil((local - secs) / 86400, &y, &m, &d);
+
+	if (y < 1000 || y > 9999) {
+		localtime_r(&t, &tm);
+		strftime(out, outsize, DATE_FORMAT, &tm);
+		return;
+	}
+
+	/* YYYY-Mon-DD HH:MM */
+	out[0] = '0' + y / 1000;
+	out[1] = '0' + y / 100 % 10;
+	out[2] = '0' + y / 10 % 10;
+	out[3] = '0' + y % 10;
+	out[4] = '-';
+	memcpy(out + 5, month[m - 1], 3);
+	out[8] = '-';
+	out[9] = '0' + d / 10;
+	out[10] = '0' + d % 10;
+	out[11] = ' ';
+	out[12] = '0' + secs / 36000;
+	out[13] = '0' + secs / 3600 % 10;
+	out[14] = ':';
+	out[15] = '0' + secs / 600 % 6;
+	out[16] = '0' + secs / 60 % 10;
+	out[17] = '\0';
+}
+
+
+/*
+ * Format the current time for the log like strftime(HTTP_DATE),
+ * reusing the string within the same second
+ */
+void strflogdate(char *out, size_t outsize)
+{
+	static char timestr[64];
+	static time_t last = -1;
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	if (now != last) {
+		localtime_r(&now, &tm);
+		strftime(timestr, sizeof(timestr), HTTP_DATE, &tm);
+		last = now;
+	}
+
+	strlcpy(out, timestr, outsize);
+}
+
+
+/*
+ * Format a timestamp as an HTTP date (always in GMT & English)
+ */
+void strfhttpdate(char *out, time_t t, size_t outsize)
+{
+	static const char *month[] = { DATE_MONTHS };
+	static const char *weekday[] = { HTTP_DAYS };
+	long days;
+	long secs;
+	int y, m, d;
+
+	secs = t % 86400;
+	if (secs < 0) secs += 86400;
+	days = (t - secs) / 86400;
+	days_to_civil(days, &y, &m, &d);
+
+	/* 1970-01-01 was a Thursday */
+	snprintf(out, outsize, "%s, %02i %s %04i %02i:%02i:%02i GMT",
+		weekday[((days % 7) + 11) % 7], d, month[m - 1], y,
+		(int) (secs / 3600), (int) (secs / 60 % 60), (int) (secs % 60));
+}
+
+
+/*
+ * Parse an HTTP date (returns ERROR if it's not one)
+ */
+time_t strphttpdate(char *str)
+{
+	static const char *month[] = { DATE_MONTHS };
+	char mon[4];
+	int y, m, d;
+	int hh, mm, ss;
+
+	/* Sun, 06 Nov 1994 08:49:37 GMT */
+	if (sscanf(str, "%*[^,], %2d %3s %4d %2d:%2d:%2d", &d, mon, &y, &hh, &mm, &ss) != 6)
+		return ERROR;
+
+	for (m = 0; m < 12; m++)
+		if (strcmp(mon, month[m]) == MATCH) break;
+	if (m == 12) return ERROR;
+
+	return (time_t) civil_to_days(y, m + 1, d) * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+
 /*
  * Format number to human-readable filesize with unit
  */
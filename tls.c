@@ -0,0 +1,235 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Read from the client through TLS (stdin cookie)
+ */
+#ifdef HAVE_TLS
+ssize_t tls_read(void *cookie, char *buf, size_t size)
+{
+	state *st = (state *) cookie;
+	int bytes;
+
+	if (size > INT_MAX) size = INT_MAX;
+	if ((bytes = SSL_read(st->tls, buf, (int) size)) > 0) return bytes;
+
+	/* Close notify, a dropped connection & errors all end the input */
+	return 0;
+}
+#endif
+
+
+/*
+ * funopen() flavour of tls_read()
+ */
+#if defined(HAVE_TLS) && defined(HAVE_FUNOPEN)
+int tls_funread(void *cookie, char *buf, int size)
+{
+	if (size <= 0) return 0;
+	return (int) tls_read(cookie, buf, (size_t) size);
+}
+#endif
+
+
+/*
+ * Write to the client through TLS (returns ERROR like write())
+ */
+#ifdef HAVE_TLS
+ssize_t tls_write(state *st, const void *buf, size_t size)
+{
+	int bytes;
+
+	if (size > INT_MAX) size = INT_MAX;
+	if ((bytes = SSL_write(st->tls, buf, (int) size)) > 0) return bytes;
+
+	errno = EPIPE;
+	return ERROR;
+}
+#endif
+
+
+/*
+ * Write many buffers as one TLS record if they fit (returns ERROR if
+ * the client went away)
+ */
+#ifdef HAVE_TLS
+int tls_writev(state *st, struct iovec *iov, int count)
+{
+	char buf[HTTP_CHUNK + 64];
+	size_t len;
+	int i;
+
+	for (len = 0, i = 0; i < count; i++) len += iov[i].iov_len;
+
+	if (len <= sizeof(buf)) {
+		for (len = 0, i = 0; i < count; i++) {
+			memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		return (tls_write(st, buf, len) == (ssize_t) len) ? OK : ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (tls_write(st, iov[i].iov_base, iov[i].iov_len) != (ssize_t) iov[i].iov_len)
+			return ERROR;
+	}
+	return OK;
+}
+#endif
+
+
+/*
+ * Load session ticket keys shared by all server processes (so that
+ * clients can resume sessions on new connections)
+ */
+#if defined(HAVE_TLS) && defined(HAVE_SHMEM)
+void tls_tickets(state *st, SSL_CTX *ctx)
+{
+	unsigned char keys[TLS_TICKET_KEYS];
+	shm_state *shm;
+	time_t created;
+	time_t now;
+
+	if (!(shm = st->shm)) return;
+	now = time(NULL);
+
+	/* First one in (or the first after a day) makes new keys */
+	if ((now - shm->tls_ticket_time) >= TLS_TICKET_ROTATE &&
+	    __sync_bool_compare_and_swap(&shm->tls_ticket_lock, 0, 1)) {
+
+		if (RAND_bytes(shm->tls_ticket_keys, TLS_TICKET_KEYS) == 1) {
+			__sync_synchronize();
+			shm->tls_ticket_time = now;
+		}
+		__sync_lock_release(&shm->tls_ticket_lock);
+	}
+
+	/* Don't use keys that changed while we copied them */
+	created = shm->tls_ticket_time;
+	memcpy(keys, shm->tls_ticket_keys, sizeof(keys));
+	__sync_synchronize();
+
+	if (created && created == shm->tls_ticket_time && !shm->tls_ticket_lock)
+		SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+}
+#endif
+
+
+/*
+ * Do the TLS handshake & replace stdin with the decrypted stream
+ */
+#ifdef HAVE_TLS
+void tls_open(state *st)
+{
+#ifdef HAVE_FOPENCOOKIE
+	cookie_io_functions_t io = { tls_read, NULL, NULL, NULL };
+#endif
+	SSL_CTX *ctx;
+	SSL *ssl;
+	FILE *fp;
+
+	/* Nothing can be said to the client before the handshake so just log errors */
+	if (!(ctx = SSL_CTX_new(TLS_server_method()))) {
+		if (st->opt_syslog) syslog(LOG_ERR, "TLS setup failed");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Certificate chain & private key from the same PEM file */
+	if (SSL_CTX_use_certificate_chain_file(ctx, st->tls_file) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, st->tls_file, SSL_FILETYPE_PEM) != 1) {
+		if (st->opt_syslog) syslog(LOG_ERR, "couldn't load TLS certificate & key from \"%s\"", st->tls_file);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Let the kernel encrypt so that sendfile() keeps working (experimental) */
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	/* Every connection is a new process so only tickets can resume sessions */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+#ifdef HAVE_SHMEM
+	tls_tickets(st, ctx);
+#endif
+
+	if (!(ssl = SSL_new(ctx))) {
+		if (st->opt_syslog) syslog(LOG_ERR, "TLS setup failed");
+		exit(EXIT_FAILURE);
+	}
+	SSL_set_rfd(ssl, 0);
+	SSL_set_wfd(ssl, 1);
+
+	/* Don't wait forever for clients that never finish the handshake */
+	alarm(TLS_TIMEOUT);
+	if (SSL_accept(ssl) != 1) {
+		if (st->debug) syslog(LOG_INFO, "TLS handshake with %s failed", st->req_remote_addr);
+		exit(EXIT_FAILURE);
+	}
+	alarm(0);
+
+	st->tls_ctx = ctx;
+	st->tls = ssl;
+	st->tls_ktls = (BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0);
+
+	if (st->debug) {
+		syslog(LOG_INFO, "%s with %s%s%s", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+			SSL_session_reused(ssl) ? ", resumed" : "", st->tls_ktls ? ", kTLS" : "");
+	}
+
+	/* Requests are read through TLS */
+	fp = NULL;
+#ifdef HAVE_FOPENCOOKIE
+	fp = fopencookie(st, "r", io);
+#endif
+#ifdef HAVE_FUNOPEN
+	fp = funopen(st, tls_funread, NULL, NULL, NULL);
+#endif
+	if (!fp) exit(EXIT_FAILURE);
+	stdin = fp;
+}
+#endif
+
+
+/*
+ * Say goodbye properly at the end of the connection
+ */
+#ifdef HAVE_TLS
+void tls_close(state *st)
+{
+	if (!st->tls) return;
+
+	/* Keep-alive connections go on with the next request */
+	if (st->http_reuse && *st->http_reuse) return;
+
+	SSL_shutdown(st->tls);
+	SSL_free(st->tls);
+	st->tls = NULL;
+}
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Get out of the way of live traffic
+ */
+void warm_priority(state *st)
+{
+	/* Failing just means competing with everyone else */
+	errno = 0;
+	if (nice(WARM_NICE) == ERROR && errno && st->debug)
+		syslog(LOG_INFO, "couldn't lower the warm-up CPU priority");
+
+#ifdef HAVE_IOPRIO
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == ERROR && st->debug)
+		syslog(LOG_INFO, "couldn't lower the warm-up I/O priority");
+#endif
+}
+
+
+/*
+ * Sleep so that no more than WARM_RATE selectors are warmed per second
+ */
+void warm_throttle(swarm *warm)
+{
+	long long ahead;
+
+	ahead = warm->start + (long long) warm->count * 1000000 / WARM_RATE - monotime();
+	if (ahead > 0) usleep(ahead);
+}
+
+
+/*
+ * Queue a selector to be walked later
+ */
+void warm_queue(swarm *warm, char *selector)
+{
+	if (warm->tail >= WARM_MAX) return;
+
+	if (warm->tail >= warm->max) {
+		warm->max = warm->max ? warm->max * 2 : 1024;
+		if (!(warm->queue = realloc(warm->queue, warm->max * sizeof(char *)))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((warm->queue[warm->tail] = strdup(selector))) warm->tail++;
+}
+
+
+/*
+ * Render a menu into the void & queue what's listed in it
+ */
+void warm_menu(state *st, swarm *warm)
+{
+	sdirent *dir;
+	FILE *save;
+	char realpath[BUFSIZE];
+	char path[BUFSIZE];
+	char buf[BUFSIZE];
+	int hidden;
+	int depth;
+	int num;
+	int i;
+	char *c;
+
+	sstrlcpy(realpath, st->req_realpath);
+	if (strlast(realpath) != '/') sstrlcat(realpath, "/");
+
+	/* Skip menus that can't be read (a die() while rendering would end the warm-up) */
+	if (access(realpath, R_OK | X_OK) == ERROR) return;
+	if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) >= (int) sizeof(buf)) return;
+	if (access(buf, F_OK) == OK && access(buf, R_OK) == ERROR) return;
+
+	/* Relative gophermap includes are relative to the menu */
+	if (chdir(realpath) == ERROR) return;
+	num = sortdir(realpath, &dir);
+
+	/* Listed entries go to the back of the queue */
+	for (depth = 0, c = st->req_selector; *c; c++) if (*c == '/') depth++;
+
+	if (warm->walk && depth <= WARM_DEPTH) {
+		hidden = st->hidden_count;
+		if (snprintf(buf, sizeof(buf), "%s%s", realpath, st->map_file) < (int) sizeof(buf))
+			map_hidden(st, buf);
+
+		for (i = 0; i < num; i++) {
+			if (!menu_visible(st, &dir[i])) continue;
+
+			/* Names that don't fit would warm the wrong file */
+			if (snprintf(path, sizeof(path), "%s%s", realpath, dir[i].name) >= (int) sizeof(path)) continue;
+			if (snprintf(buf, sizeof(buf), "%s%s%s", st->req_selector, dir[i].name,
+				((dir[i].mode & S_IFMT) == S_IFDIR) ? "/" : "") >= (int) sizeof(buf)) continue;
+
+			/* Symlinks out of the root aren't served with -B */
+			if (st->opt_beneath && !search_beneath(st, path)) continue;
+			warm_queue(warm, buf);
+		}
+
+		st->hidden_count = hidden;
+	}
+
+	/*
+	 * Rendering compiles the gophermaps & sniffs the listed files -
+	 * unless a gophermap would run something
+	 */
+	if (pack_static(st, realpath, dir, num)) {
+		fflush(stdout);
+		save = stdout;
+		stdout = warm->null;
+
+		/* Don't lead a flight nobody will follow */
+		st->shm = NULL;
+		gopher_menu(st);
+
+		fflush(stdout);
+		stdout = save;
+		warm->menus++;
+	}
+
+	if (dir) free(dir);
+}
+
+
+/*
+ * Resolve a selector the way a request would & warm what it points to
+ */
+int warm_selector(state *st, swarm *warm, char *host, char *selector)
+{
+	struct stat file;
+	state copy;
+	int i;
+
+	/* Only the local files a client could get */
+	if (strstr(selector, "/.") || sstrncmp(selector, "/~") == MATCH) return ERROR;
+
+	/* Gophermaps change the state they run on */
+	memcpy(&copy, st, sizeof(state));
+	sstrlcpy(copy.server_host, host);
+	sstrlcpy(copy.req_selector, selector);
+	copy.root_fd = ERROR;
+
+	if (proxy_match(&copy) != ERROR) return ERROR;
+
+	copy.req_filetype = gopher_filetype(&copy, copy.req_selector, FALSE);
+	cache_key(&copy);
+
+	selector_to_path(&copy);
+	i = resolve_path(&copy, &file);
+	if (copy.root_fd != ERROR) close(copy.root_fd);
+	if (copy.req_fd != ERROR) close(copy.req_fd);
+
+	if (i == ERROR || !(file.st_mode & S_IROTH) || (file.st_mode & S_IWOTH)) return ERROR;
+	if ((file.st_mode & S_IFMT) != S_IFDIR && (file.st_mode & S_IFMT) != S_IFREG) return ERROR;
+
+	/* Remember the resolution like a served request would (walks only use free slots) */
+#ifdef HAVE_SHMEM
+	if (st->shm && st->opt_cache && warm->memo > 0 &&
+	    !(warm->walk && memo_evicts(&copy, st->shm))) {
+		memo_add(&copy, st->shm, &file);
+		warm->memo--;
+	}
+#endif
+
+	if ((file.st_mode & S_IFMT) == S_IFDIR) warm_menu(&copy, warm);
+
+	/* Magic sniffing reads the start of the file */
+	else gopher_filetype(&copy, copy.req_realpath, copy.opt_magic);
+
+	warm->count++;
+	warm_throttle(warm);
+	return OK;
+}
+
+
+/*
+ * Walk a vhost breadth first (shallow menus are the hot ones)
+ */
+void warm_walk(state *st, swarm *warm, char *host)
+{
+	char *selector;
+
+	warm->walk = TRUE;
+	warm_queue(warm, ROOT);
+
+	while (warm->head < warm->tail) {
+		selector = warm->queue[warm->head++];
+		warm_selector(st, warm, host, selector);
+		free(selector);
+	}
+
+	warm->head = warm->tail = 0;
+}
+
+
+/*
+ * Walk every vhost (or just the one without -nv)
+ */
+void warm_vhosts(state *st, swarm *warm)
+{
+	DIR *dp;
+	struct dirent *dir;
+	struct stat file;
+	char buf[BUFSIZE];
+
+	warm->memo = WARM_MEMO;
+
+	if (!st->opt_vhost) {
+		warm_walk(st, warm, st->server_host);
+		return;
+	}
+
+	if ((dp = opendir(st->server_root)) == NULL) {
+		fprintf(stderr, "Couldn't read %s\n", st->server_root);
+		exit(EXIT_FAILURE);
+	}
+
+	while ((dir = readdir(dp))) {
+
+		/* Skip .hidden dirs and . & .. */
+		if (dir->d_name[0] == '.') continue;
+
+		/* Special case - skip lost+found (don't ask) */
+		if (sstrncmp(dir->d_name, "lost+found") == MATCH) continue;
+
+		snprintf(buf, sizeof(buf), "%s/%s", st->server_root, dir->d_name);
+		if (stat(buf, &file) == ERROR || (file.st_mode & S_IFMT) != S_IFDIR) continue;
+
+		warm_walk(st, warm, dir->d_name);
+	}
+
+	closedir(dp);
+}
+
+
+/*
+ * Warm the heaviest hitters of a sketch ("host:port/Tselector" keys)
+ */
+#ifdef HAVE_SHMEM
+void warm_hitters(state *st, swarm *warm, shm_sketch *sketch)
+{
+	shm_hitter list[SHM_HITTERS];
+	char host[BUFSIZE];
+	char *c;
+	int num;
+	int i;
+
+	num = sketch_sort(sketch, list);
+	warm->memo = num;
+
+	for (i = 0; i < num; i++) {
+		sstrlcpy(host, list[i].key);
+		if (!(c = strchr(host, ':'))) continue;
+		*c++ = '\0';
+
+		/* Other servers may share the memory */
+		if (atoi(c) != st->server_port) continue;
+		if (!(c = strchr(c, '/')) || !c[1] || c[2] != '/') continue;
+
+		warm_selector(st, warm, host, c + 2);
+	}
+}
+#endif
+
+
+/*
+ * Count the successful requests of a combined log in a sketch
+ */
+#ifdef HAVE_SHMEM
+void warm_log(char *logfile, shm_sketch *sketch)
+{
+	FILE *fp;
+	char line[BUFSIZE];
+	char key[BUFSIZE];
+	char *host;
+	char *req;
+	char *c;
+
+	if (!(fp = fopen(logfile, "r"))) {
+		fprintf(stderr, "Couldn't read %s\n", logfile);
+		exit(EXIT_FAILURE);
+	}
+
+	/* addr host:port - [date] "GET Tselector HTTP/1.0" status bytes ... */
+	while (fgets(line, sizeof(line), fp)) {
+		if (!(c = strchr(line, ' '))) continue;
+		host = c + 1;
+		if (!(c = strchr(host, ' '))) continue;
+		*c++ = '\0';
+
+		if (!(req = strstr(c, "\"GET "))) continue;
+		req += 5;
+		if (!(c = strstr(req, " HTTP/1.0\" "))) continue;
+		*c = '\0';
+		if (atoi(c + 11) != HTTP_OK) continue;
+
+		snprintf(key, sizeof(key), "%s/%s", host, req);
+		sketch_update(sketch, key, 1);
+	}
+
+	fclose(fp);
+}
+#endif
+
+
+/*
+ * Warm up the caches from a walk, the live top list or an old log
+ */
+void warm_run(state *st, shm_state *shm)
+{
+#ifdef HAVE_SHMEM
+	shm_sketch sketch;
+#endif
+	swarm warm;
+
+	memset(&warm, 0, sizeof(warm));
+	if (!(warm.null = fopen("/dev/null", "w"))) {
+		fprintf(stderr, "Couldn't open /dev/null\n");
+		exit(EXIT_FAILURE);
+	}
+
+	warm_priority(st);
+	warm.start = monotime();
+
+	if (strcmp(st->warm_source, "walk") == MATCH) warm_vhosts(st, &warm);
+	else {
+#ifdef HAVE_SHMEM
+		if (strcmp(st->warm_source, "top") == MATCH) {
+			if (!shm) {
+				fprintf(stderr, "No shared memory to read the top selectors from\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(&sketch, &shm->top_selectors, sizeof(sketch));
+		}
+		else {
+			memset(&sketch, 0, sizeof(sketch));
+			warm_log(st->warm_source, &sketch);
+		}
+
+		warm_hitters(st, &warm, &sketch);
+#else
+		fprintf(stderr, "No shared memory support compiled in\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	fclose(warm.null);
+	if (warm.queue) free(warm.queue);
+
+	printf("Warmed %i selectors (%i menus) in %.1f seconds\n",
+		warm.count, warm.menus, (monotime() - warm.start) / 1000000.0);
+}
@@ -0,0 +1,345 @@
+/*
+ * Gophernicus - Copyright (c) 2009-2015 Kim Holviala <kim@holviala.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Check whether a watcher is publishing changes
+ */
+#ifdef HAVE_SHMEM
+int watch_active(shm_state *shm)
+{
+	return (shm->watch_pid && (time(NULL) - shm->watch_time) <= WATCH_TIMEOUT);
+}
+#endif
+
+
+/*
+ * Return the generation counter of a directory
+ */
+int watch_bucket(char *path)
+{
+	return strhash(path) % WATCH_BUCKETS;
+}
+
+
+/*
+ * Sum of the generations an entry depends on (they only ever grow)
+ */
+#ifdef HAVE_SHMEM
+long watch_stamp(shm_state *shm, int dir, int self)
+{
+	return shm->watch_global + shm->watch_gen[dir] + (self == ERROR ? 0 : shm->watch_gen[self]);
+}
+#endif
+
+
+/*
+ * Check whether nothing has changed since a snapshot without a stat()
+ */
+#ifdef HAVE_SHMEM
+int watch_valid(shm_state *shm, long epoch, int dir, int self, long stamp)
+{
+	if (!epoch || epoch != shm->watch_epoch || !watch_active(shm)) return FALSE;
+	if (dir < 0 || dir >= WATCH_BUCKETS || self < ERROR || self >= WATCH_BUCKETS) return FALSE;
+
+	return (watch_stamp(shm, dir, self) == stamp);
+}
+#endif
+
+
+/*
+ * Take a snapshot of the generations a stat()ed path depends on
+ * Returns the watcher epoch, or 0 if the path must be validated with stat()
+ */
+#ifdef HAVE_SHMEM
+long watch_snapshot(shm_state *shm, char *path, struct stat *file, int *dir, int *self, long *stamp)
+{
+	struct stat now;
+	char real[PATH_MAX];
+	char parent[PATH_MAX];
+	char root[sizeof(shm->watch_root)];
+	size_t len;
+	long epoch;
+	char *c;
+
+	if (!watch_active(shm)) return 0;
+	epoch = shm->watch_epoch;
+
+	/* Only non-hidden paths inside the watched tree */
+	sstrlcpy(root, shm->watch_root);
+	len = strlen(root);
+
+	if (!len || !realpath(path, real)) return 0;
+	if (strncmp(real, root, len) != MATCH || (real[len] != '/' && real[len] != '\0')) return 0;
+	if (strstr(real + len, "/.")) return 0;
+
+	/* Changes through other hard links are reported for those names */
+	if ((file->st_mode & S_IFMT) != S_IFDIR && file->st_nlink != 1) return 0;
+
+	/* Changes are reported to the directory of the changed entry */
+	sstrlcpy(parent, real);
+	if ((c = strrchr(parent, '/'))) {
+		if (c == parent) c++;
+		*c = '\0';
+	}
+
+	*dir = watch_bucket(parent);
+	*self = ((file->st_mode & S_IFMT) == S_IFDIR) ? watch_bucket(real) : ERROR;
+	*stamp = watch_stamp(shm, *dir, *self);
+
+	/* Anything changing from now on changes the stamp - was it changed before? */
+	if (stat(real, &now) == ERROR ||
+	    now.st_ino != file->st_ino || now.st_dev != file->st_dev ||
+	    now.st_mode != file->st_mode || now.st_size != file->st_size ||
+	    now.st_mtime != file->st_mtime || now.st_ctime != file->st_ctime) return 0;
+
+	return epoch;
+}
+#endif
+
+
+/*
+ * Watch a directory & everything under it
+ */
+#ifdef HAVE_INOTIFY
+int watch_add(swatch *w, char *path, int depth)
+{
+	DIR *dp;
+	struct dirent *d;
+	struct stat file;
+	char buf[BUFSIZE];
+	char **list;
+	int max;
+	int wd;
+
+	if (depth > WATCH_DEPTH) return OK;
+
+	if ((wd = inotify_add_watch(w->fd, path, WATCH_EVENTS)) == ERROR) {
+
+		/* Out of watches - nothing can be trusted */
+		if (errno == ENOSPC || errno == ENOMEM) return ERROR;
+		return OK;
+	}
+
+	/* Already watched through another path */
+	if (wd < w->max && w->path[wd]) return OK;
+
+	if (wd >= w->max) {
+		for (max = w->max ? w->max : MAP_ALLOC; wd >= max; max *= 2);
+		if (!(list = realloc(w->path, sizeof(char *) * max))) return ERROR;
+
+		memset(list + w->max, 0, sizeof(char *) * (max - w->max));
+		w->path = list;
+		w->max = max;
+	}
+
+	if (!(w->path[wd] = strdup(path))) return ERROR;
+	w->count++;
+
+	/* Subdirectories (symlinks lead to dirs that are watched anyway) */
+	if ((dp = opendir(path)) == NULL) return OK;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.') continue;
+
+		snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
+		if (lstat(buf, &file) == ERROR || (file.st_mode & S_IFMT) != S_IFDIR) continue;
+
+		if (watch_add(w, buf, depth + 1) == ERROR) {
+			closedir(dp);
+			return ERROR;
+		}
+	}
+
+	closedir(dp);
+	return OK;
+}
+#endif
+
+
+/*
+ * (Re)build the watches of the whole tree
+ */
+#ifdef HAVE_INOTIFY
+int watch_tree(swatch *w, char *root)
+{
+	int i;
+
+	if (w->fd != ERROR) close(w->fd);
+	for (i = 0; i < w->max; i++) {
+		if (w->path[i]) free(w->path[i]);
+		w->path[i] = NULL;
+	}
+	w->count = 0;
+
+	if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == ERROR) return ERROR;
+	return watch_add(w, root, 0);
+}
+#endif
+
+
+/*
+ * Publish one change - returns QUIT when the tree needs to be rewatched
+ */
+#ifdef HAVE_INOTIFY
+int watch_event(shm_state *shm, swatch *w, struct inotify_event *ev)
+{
+	char path[BUFSIZE];
+
+	/* Lost events could have been about anything */
+	if (ev->mask & IN_Q_OVERFLOW) {
+		shm->watch_global++;
+		return OK;
+	}
+
+	if (ev->wd < 0 || ev->wd >= w->max || !w->path[ev->wd]) return OK;
+
+	/* Removed dirs lose their watches */
+	if (ev->mask & IN_IGNORED) {
+		free(w->path[ev->wd]);
+		w->path[ev->wd] = NULL;
+		w->count--;
+		return OK;
+	}
+
+	/* Moved dirs take everything under them to new paths */
+	if ((ev->mask & IN_MOVE_SELF) ||
+	    ((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO)))) return QUIT;
+
+	/* Removed or replaced entries and dir permissions affect paths under them */
+	if ((ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)) ||
+	    ((ev->mask & IN_ISDIR) && (ev->mask & IN_ATTRIB))) shm->watch_global++;
+
+	/* New dirs get watched too */
+	if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) && ev->len && ev->name[0] != '.') {
+		snprintf(path, sizeof(path), "%s/%s", w->path[ev->wd], ev->name);
+		if (watch_add(w, path, 0) == ERROR) return ERROR;
+	}
+
+	shm->watch_gen[watch_bucket(w->path[ev->wd])]++;
+	return OK;
+}
+#endif
+
+
+/*
+ * Watch the gopher root & publish changes until killed
+ */
+#ifdef HAVE_INOTIFY
+void watch_run(state *st, shm_state *shm)
+{
+	struct inotify_event *ev;
+	struct pollfd fds[2];
+	sigset_t mask;
+	swatch w;
+	char root[PATH_MAX];
+	long buf[WATCH_READ / sizeof(long)];
+	ssize_t len;
+	char *c;
+	int ret;
+
+	if (!shm) {
+		fprintf(stderr, "Watching needs shared memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!realpath(st->server_root, root) || strlen(root) >= sizeof(shm->watch_root)) {
+		fprintf(stderr, "Couldn't watch %s\n", st->server_root);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Signals end the loop (& make the servers stat() again) */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	memset(&w, 0, sizeof(w));
+	w.fd = ERROR;
+
+	/* Servers keep using stat() if the tree doesn't fit in the watch limit */
+	if (watch_tree(&w, root) == ERROR) {
+		fprintf(stderr, "Couldn't watch %s: %s (see fs.inotify.max_user_watches)\n",
+			root, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Watching %i directories under %s\n", w.count, root);
+	fflush(stdout);
+
+	/* Run in the background */
+	if (!st->debug && daemon(0, 0) == ERROR) exit(EXIT_FAILURE);
+
+	fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	fds[0].events = POLLIN;
+	fds[1].events = POLLIN;
+
+	/* Publish */
+	sstrlcpy(shm->watch_root, root);
+	shm->watch_dirs = w.count;
+	shm->watch_time = time(NULL);
+	shm->watch_epoch++;
+	shm->watch_pid = getpid();
+
+	if (st->opt_syslog) syslog(LOG_INFO, "watching %i directories under \"%s\"", w.count, root);
+
+	for (ret = OK; ret != ERROR;) {
+		shm->watch_time = time(NULL);
+		shm->watch_dirs = w.count;
+		fds[1].fd = w.fd;
+
+		if (poll(fds, 2, WATCH_BEAT * 1000) == ERROR && errno != EINTR) break;
+		if (fds[0].revents & POLLIN) break;
+		if (!(fds[1].revents & POLLIN)) continue;
+
+		/* Publish the changes */
+		while ((len = read(w.fd, buf, sizeof(buf))) > 0) {
+			for (c = (char *) buf; c < (char *) buf + len; c += sizeof(struct inotify_event) + ev->len) {
+				ev = (struct inotify_event *) c;
+				if (ret == OK) ret = watch_event(shm, &w, ev);
+			}
+		}
+
+		/* Rewatch & forget everything cached while the paths were moving */
+		if (ret == QUIT) {
+			ret = watch_tree(&w, root);
+			shm->watch_global++;
+		}
+	}
+
+	if (ret == ERROR && st->opt_syslog)
+		syslog(LOG_ERR, "out of inotify watches, caches are validated with stat() again");
+
+	/* Unpublish */
+	shm->watch_pid = 0;
+	shm->watch_time = 0;
+	shm->watch_epoch++;
+}
+#endif